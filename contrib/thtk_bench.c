@@ -0,0 +1,769 @@
+/*
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+/* Throughput benchmarks for libthtk on generated data.  Every result is
+ * printed as a "name<TAB>MB/s" line, and a previous run can be passed with -b
+ * to compare against it. */
+#include <config.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#include <thtk/thtk.h>
+#include "thtk/thcrypt.h"
+#include "thtk/thlzss.h"
+#include "thtk/thrle.h"
+#include "mygetopt.h"
+#include "program.h"
+#ifdef HAVE_LIBPNG
+#include "image.h"
+
+/* Referenced by image.c, which is shared with thanm. */
+unsigned int option_force = 0;
+#endif
+
+/* The older formats store entry sizes in 16 bits. */
+#define BENCH_ENTRY_SIZE 16384
+/* Archives are written to a real file, as the modules may seek past the end
+ * of what has been written so far.  It goes to the temporary directory unless
+ * -a is given. */
+#define BENCH_ARCHIVE "thtk_bench.dat"
+
+typedef struct {
+    const char* name;
+    thtk_io_t* io;
+    unsigned char* data;
+} corpus_t;
+
+typedef struct {
+    char name[64];
+    double value;
+} result_t;
+
+static size_t bench_size = 1024 * 1024;
+static double bench_time = 0.5;
+static const char* bench_filter = NULL;
+static const char* bench_archive_path = NULL;
+static result_t* baseline;
+static size_t baseline_count;
+static double bench_threshold = 10;
+static int bench_regressions;
+
+static const unsigned int bench_versions[] = {
+    1, 2, 3, 4, 5, 6, 7, 8, 9, 95, 10, 12, 13, 14, 17, 75, 7575, 105105, 105, 123
+};
+
+static void
+print_usage(void)
+{
+    printf("Usage: %s [-V] [-s KIB] [-t SECONDS] [-f FILTER] [-a ARCHIVE] [-b BASELINE [-r PERCENT]]\n"
+           "Options:\n"
+           "  -s  size of each generated corpus in KiB, at least 16 (default 1024)\n"
+           "  -t  minimum time spent on each benchmark (default 0.5)\n"
+           "  -f  only run benchmarks whose name contains FILTER\n"
+           "  -a  file the archive benchmarks write to, removed afterwards\n"
+           "      (default " BENCH_ARCHIVE " in the temporary directory)\n"
+           "  -b  compare with the output of a previous run\n"
+           "  -r  slowdown in percent reported as a regression (default 10)\n"
+           "  -V  display version information and exit\n"
+           "The exit status is 2 if any benchmark regressed.\n"
+           "Report bugs to <" PACKAGE_BUGREPORT ">.\n", argv0);
+}
+
+static void
+print_error(
+    thtk_error_t* error)
+{
+    fprintf(stderr, "%s:%s\n", argv0, thtk_error_message(error));
+}
+
+static const char*
+bench_default_archive(void)
+{
+    static char path[1024];
+    const char* dir = getenv("TMPDIR");
+    if (!dir || !*dir)
+        dir = getenv("TEMP");
+    if (!dir || !*dir)
+#ifdef _WIN32
+        dir = ".";
+#else
+        dir = "/tmp";
+#endif
+    snprintf(path, sizeof(path), "%s/" BENCH_ARCHIVE, dir);
+    return path;
+}
+
+static double
+bench_now(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER counter, frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (double)counter.QuadPart / frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+static uint32_t
+bench_random(
+    uint32_t* state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+/* Words separated by spaces and line breaks, similar to script dumps. */
+static void
+corpus_text(
+    unsigned char* data,
+    size_t size)
+{
+    static const char* words[] = {
+        "the", "of", "and", "to", "stage", "boss", "enemy", "bullet", "spell",
+        "card", "score", "graze", "power", "bomb", "player", "ins_", "wait",
+        "0x1b", "3.14159", "Reimu", "Marisa", "shrine", "danmaku", "extend"
+    };
+    uint32_t state = 1;
+    size_t pos = 0, column = 0;
+    while (pos < size) {
+        const char* word = words[bench_random(&state) % (sizeof(words) / sizeof(*words))];
+        for (; *word && pos < size; ++word)
+            data[pos++] = *word;
+        if (pos < size)
+            data[pos++] = ++column % 12 ? ' ' : '\n';
+    }
+}
+
+/* 32-bit pixels of flat areas and gradients. */
+static void
+corpus_image(
+    unsigned char* data,
+    size_t size)
+{
+    for (size_t i = 0; i < size; ++i) {
+        const size_t pixel = i / 4, x = pixel % 256, y = pixel / 256;
+        if (i % 4 == 3)
+            data[i] = 0xff;
+        else if ((x / 32 + y / 32) % 3 == 0)
+            data[i] = 0x40 * (i % 4);
+        else
+            data[i] = (x + y * (i % 4 + 1)) & 0xff;
+    }
+}
+
+static void
+corpus_random(
+    unsigned char* data,
+    size_t size)
+{
+    uint32_t state = 2;
+    for (size_t i = 0; i < size; ++i)
+        data[i] = bench_random(&state) >> 24;
+}
+
+static void
+corpus_zeros(
+    unsigned char* data,
+    size_t size)
+{
+    memset(data, 0, size);
+}
+
+static int
+bench_selected(
+    const char* name)
+{
+    return !bench_filter || strstr(name, bench_filter);
+}
+
+static void
+bench_report(
+    const char* name,
+    double value)
+{
+    printf("%s\t%.1f", name, value);
+    for (size_t i = 0; i < baseline_count; ++i) {
+        if (strcmp(baseline[i].name, name) == 0) {
+            const double change = (value / baseline[i].value - 1) * 100;
+            printf("\t%.1f\t%+.1f%%", baseline[i].value, change);
+            if (change < -bench_threshold) {
+                printf("\tREGRESSION");
+                bench_regressions++;
+            }
+            break;
+        }
+    }
+    putchar('\n');
+    fflush(stdout);
+}
+
+/* Runs fn until bench_time has passed and returns the average time of one
+ * run, or a negative value if it failed. */
+static double
+bench_run(
+    int (*fn)(void* context),
+    void* context)
+{
+    unsigned int runs = 0;
+    const double start = bench_now();
+    double elapsed;
+    do {
+        if (!fn(context))
+            return -1;
+        ++runs;
+        elapsed = bench_now() - start;
+    } while (elapsed < bench_time);
+    return elapsed / runs;
+}
+
+static void
+bench(
+    const char* name,
+    size_t bytes,
+    int (*fn)(void* context),
+    void* context)
+{
+    if (!bench_selected(name))
+        return;
+    const double seconds = bench_run(fn, context);
+    if (seconds < 0) {
+        fprintf(stderr, "%s: %s failed\n", argv0, name);
+        exit(1);
+    }
+    bench_report(name, bytes / seconds / 1e6);
+}
+
+typedef struct {
+    corpus_t* corpus;
+    thtk_io_t* compressed;
+    thtk_io_t* output;
+    unsigned char* buffer;
+    size_t buffer_size;
+    size_t compressed_size;
+} codec_t;
+
+static int
+bench_lzss_encode(
+    void* context)
+{
+    codec_t* c = context;
+    thtk_error_t* error = NULL;
+    if (thtk_io_seek(c->corpus->io, 0, SEEK_SET, &error) == -1 ||
+        thtk_io_seek(c->output, 0, SEEK_SET, &error) == -1 ||
+        th_lzss(c->corpus->io, bench_size, c->output, &error) == -1) {
+        print_error(error);
+        thtk_error_free(&error);
+        return 0;
+    }
+    return 1;
+}
+
+static int
+bench_lzss_decode(
+    void* context)
+{
+    codec_t* c = context;
+    thtk_error_t* error = NULL;
+    if (thtk_io_seek(c->compressed, 0, SEEK_SET, &error) == -1 ||
+        thtk_io_seek(c->output, 0, SEEK_SET, &error) == -1 ||
+        th_unlzss(c->compressed, c->output, bench_size, &error) != (ssize_t)bench_size) {
+        print_error(error);
+        thtk_error_free(&error);
+        return 0;
+    }
+    return 1;
+}
+
+static int
+bench_encrypt(
+    void* context)
+{
+    codec_t* c = context;
+    th_encrypt(c->buffer, bench_size, 0x1b, 0x37, 0x400, bench_size);
+    return 1;
+}
+
+static int
+bench_decrypt(
+    void* context)
+{
+    codec_t* c = context;
+    th_decrypt(c->buffer, bench_size, 0x1b, 0x37, 0x400, bench_size);
+    return 1;
+}
+
+static int
+bench_rle_encode(
+    void* context)
+{
+    codec_t* c = context;
+    return thtk_rle_buffer(c->corpus->data, bench_size, c->buffer, c->buffer_size, NULL) == (ssize_t)c->compressed_size;
+}
+
+static int
+bench_rle_decode(
+    void* context)
+{
+    codec_t* c = context;
+    return thtk_unrle_buffer(c->buffer, c->compressed_size, c->buffer + c->compressed_size, bench_size, NULL) == (ssize_t)bench_size;
+}
+
+static void
+bench_codecs(
+    corpus_t* corpus)
+{
+    thtk_error_t* error = NULL;
+    codec_t c;
+    char name[64];
+
+    c.corpus = corpus;
+    c.compressed = thtk_io_open_growing_memory(&error);
+    c.output = thtk_io_open_growing_memory(&error);
+
+    snprintf(name, sizeof(name), "lzss.encode.%s", corpus->name);
+    bench(name, bench_size, bench_lzss_encode, &c);
+
+    snprintf(name, sizeof(name), "lzss.decode.%s", corpus->name);
+    if (bench_selected(name)) {
+        if (thtk_io_seek(corpus->io, 0, SEEK_SET, &error) == -1 ||
+            th_lzss(corpus->io, bench_size, c.compressed, &error) == -1) {
+            print_error(error);
+            exit(1);
+        }
+        bench(name, bench_size, bench_lzss_decode, &c);
+        unsigned char* map = thtk_io_map(c.output, 0, bench_size, &error);
+        if (!map || memcmp(map, corpus->data, bench_size)) {
+            fprintf(stderr, "%s: %s: decompressed data differs\n", argv0, name);
+            exit(1);
+        }
+        thtk_io_unmap(c.output, map);
+    }
+
+    c.buffer = malloc(bench_size);
+    memcpy(c.buffer, corpus->data, bench_size);
+    snprintf(name, sizeof(name), "crypt.encrypt.%s", corpus->name);
+    bench(name, bench_size, bench_encrypt, &c);
+    snprintf(name, sizeof(name), "crypt.decrypt.%s", corpus->name);
+    bench(name, bench_size, bench_decrypt, &c);
+    free(c.buffer);
+
+    c.compressed_size = thtk_rle_buffer(corpus->data, bench_size, NULL, 0, NULL);
+    c.buffer_size = c.compressed_size;
+    c.buffer = malloc(c.compressed_size + bench_size);
+    snprintf(name, sizeof(name), "rle.encode.%s", corpus->name);
+    bench(name, bench_size, bench_rle_encode, &c);
+    snprintf(name, sizeof(name), "rle.decode.%s", corpus->name);
+    if (bench_selected(name)) {
+        thtk_rle_buffer(corpus->data, bench_size, c.buffer, c.buffer_size, NULL);
+        bench(name, bench_size, bench_rle_decode, &c);
+        if (memcmp(c.buffer + c.compressed_size, corpus->data, bench_size)) {
+            fprintf(stderr, "%s: %s: decompressed data differs\n", argv0, name);
+            exit(1);
+        }
+    }
+    free(c.buffer);
+
+    thtk_io_close(c.compressed);
+    thtk_io_close(c.output);
+}
+
+#ifdef HAVE_LIBPNG
+typedef struct {
+    corpus_t* corpus;
+    format_t format;
+    unsigned char* converted;
+} pixels_t;
+
+static int
+bench_from_rgba(
+    void* context)
+{
+    pixels_t* p = context;
+    free(format_from_rgba((const uint32_t*)p->corpus->data, bench_size / 4, p->format));
+    return 1;
+}
+
+static int
+bench_to_rgba(
+    void* context)
+{
+    pixels_t* p = context;
+    free(format_to_rgba(p->converted, bench_size / 4, p->format));
+    return 1;
+}
+
+/* The conversions between thanm's texture formats and RGBA.  Throughput is
+ * counted in RGBA bytes. */
+static void
+bench_pixels(
+    corpus_t* corpus)
+{
+    static const struct {
+        const char* name;
+        format_t format;
+    } formats[] = {
+        { "bgra8888", FORMAT_BGRA8888 },
+        { "rgb565", FORMAT_RGB565 },
+        { "argb4444", FORMAT_ARGB4444 },
+        { "gray8", FORMAT_GRAY8 },
+    };
+    char name[64];
+    pixels_t p;
+
+    p.corpus = corpus;
+    for (size_t f = 0; f < sizeof(formats) / sizeof(*formats); ++f) {
+        p.format = formats[f].format;
+        snprintf(name, sizeof(name), "image.from_rgba.%s", formats[f].name);
+        bench(name, bench_size, bench_from_rgba, &p);
+        snprintf(name, sizeof(name), "image.to_rgba.%s", formats[f].name);
+        if (bench_selected(name)) {
+            p.converted = format_from_rgba((const uint32_t*)corpus->data, bench_size / 4, p.format);
+            bench(name, bench_size, bench_to_rgba, &p);
+            free(p.converted);
+        }
+    }
+}
+
+static int
+bench_png_encode(
+    void* context)
+{
+    size_t size;
+    free(png_write_mem(context, &size));
+    return 1;
+}
+
+/* PNG encoding of the image corpus as 1024 pixels wide RGBA, with the
+ * settings thanm's -z option takes. */
+static void
+bench_png(
+    corpus_t* corpus)
+{
+    static const char* settings[] = {
+        "1", "6", "9", "1,parallel", "6,parallel",
+    };
+    char name[64];
+    image_t image;
+
+    image.data = corpus->data;
+    image.width = 1024;
+    image.height = bench_size / 4 / image.width;
+    image.format = FORMAT_RGBA8888;
+    if (!image.height)
+        return;
+    for (size_t i = 0; i < sizeof(settings) / sizeof(*settings); ++i) {
+        snprintf(name, sizeof(name), "png.encode.%s", settings[i]);
+        for (char* c = name; *c; ++c)
+            if (*c == ',')
+                *c = '.';
+        png_set_options(settings[i]);
+        bench(name, (size_t)image.width * image.height * 4, bench_png_encode, &image);
+    }
+}
+#endif
+
+typedef struct {
+    unsigned int version;
+    corpus_t* corpora;
+    size_t corpus_count;
+    thtk_io_t** entries;
+    thtk_io_t* archive;
+    thtk_io_t* output;
+} archive_t;
+
+static int
+bench_archive_create(
+    void* context)
+{
+    archive_t* a = context;
+    thtk_error_t* error = NULL;
+    const size_t entries_per_corpus = bench_size / BENCH_ENTRY_SIZE;
+    const size_t entry_count = a->corpus_count * entries_per_corpus;
+    thdat_t* thdat = NULL;
+    char name[16];
+
+    thtk_io_close(a->archive);
+    if (!(a->archive = thtk_io_open_file(bench_archive_path, "w+b", &error)) ||
+        !(thdat = thdat_create(a->version, a->archive, entry_count, &error)))
+        goto fail;
+    for (size_t e = 0; e < entry_count; ++e) {
+        snprintf(name, sizeof(name), "B%u.DAT", (unsigned int)e);
+        if (!thdat_entry_set_name(thdat, e, name, &error))
+            goto fail;
+    }
+    if (!thdat_init(thdat, &error)) {
+        thdat = NULL;
+        goto fail;
+    }
+    for (size_t e = 0; e < entry_count; ++e) {
+        if (thtk_io_seek(a->entries[e], 0, SEEK_SET, &error) == -1 ||
+            thdat_entry_write_data(thdat, e, a->entries[e], BENCH_ENTRY_SIZE, &error) == -1)
+            goto fail;
+    }
+    if (!thdat_close(thdat, &error))
+        goto fail;
+    thdat_free(thdat);
+    return 1;
+fail:
+    print_error(error);
+    thtk_error_free(&error);
+    thdat_free(thdat);
+    return 0;
+}
+
+static int
+bench_archive_extract(
+    void* context)
+{
+    archive_t* a = context;
+    thtk_error_t* error = NULL;
+    thdat_t* thdat = NULL;
+    ssize_t entry_count;
+
+    if (thtk_io_seek(a->archive, 0, SEEK_SET, &error) == -1 ||
+        !(thdat = thdat_open(a->version, a->archive, &error)) ||
+        (entry_count = thdat_entry_count(thdat, &error)) == -1)
+        goto fail;
+    for (ssize_t e = 0; e < entry_count; ++e) {
+        if (thtk_io_seek(a->output, 0, SEEK_SET, &error) == -1 ||
+            thdat_entry_read_data(thdat, e, a->output, &error) == -1)
+            goto fail;
+    }
+    thdat_free(thdat);
+    return 1;
+fail:
+    print_error(error);
+    thtk_error_free(&error);
+    thdat_free(thdat);
+    return 0;
+}
+
+/* Checks that every entry of the archive matches its source. */
+static int
+bench_archive_verify(
+    archive_t* a)
+{
+    thtk_error_t* error = NULL;
+    const size_t entries_per_corpus = bench_size / BENCH_ENTRY_SIZE;
+    thdat_t* thdat = NULL;
+    int ok = thtk_io_seek(a->archive, 0, SEEK_SET, &error) != -1 &&
+        (thdat = thdat_open(a->version, a->archive, &error)) != NULL;
+    for (ssize_t e = 0; ok && e < thdat_entry_count(thdat, NULL); ++e) {
+        const char* name = thdat_entry_get_name(thdat, e, NULL);
+        unsigned int index;
+        unsigned char* map;
+        if (!name || sscanf(name, "%*[bB]%u", &index) != 1 ||
+            index >= a->corpus_count * entries_per_corpus ||
+            thtk_io_seek(a->output, 0, SEEK_SET, &error) == -1 ||
+            thdat_entry_read_data(thdat, e, a->output, &error) == -1 ||
+            thtk_io_seek(a->output, 0, SEEK_CUR, &error) != BENCH_ENTRY_SIZE ||
+            !(map = thtk_io_map(a->output, 0, BENCH_ENTRY_SIZE, &error))) {
+            ok = 0;
+            break;
+        }
+        ok = !memcmp(map, a->corpora[index / entries_per_corpus].data +
+            (index % entries_per_corpus) * BENCH_ENTRY_SIZE, BENCH_ENTRY_SIZE);
+        thtk_io_unmap(a->output, map);
+    }
+    if (error) {
+        print_error(error);
+        thtk_error_free(&error);
+    }
+    thdat_free(thdat);
+    return ok;
+}
+
+static void
+bench_archive(
+    unsigned int version,
+    corpus_t* corpora,
+    size_t corpus_count)
+{
+    thtk_error_t* error = NULL;
+    archive_t a;
+    char create[64], extract[64];
+    const size_t bytes = corpus_count * bench_size;
+
+    snprintf(create, sizeof(create), "dat.create.%u", version);
+    snprintf(extract, sizeof(extract), "dat.extract.%u", version);
+    if (!bench_selected(create) && !bench_selected(extract))
+        return;
+
+    a.version = version;
+    a.corpora = corpora;
+    a.corpus_count = corpus_count;
+    a.archive = NULL;
+    a.output = thtk_io_open_growing_memory(&error);
+    /* Some modules rewind their input, so every entry gets its own io. */
+    const size_t entries_per_corpus = bench_size / BENCH_ENTRY_SIZE;
+    a.entries = malloc(corpus_count * entries_per_corpus * sizeof(*a.entries));
+    for (size_t e = 0; e < corpus_count * entries_per_corpus; ++e) {
+        unsigned char* data = thtk_malloc(BENCH_ENTRY_SIZE);
+        memcpy(data, corpora[e / entries_per_corpus].data +
+            (e % entries_per_corpus) * BENCH_ENTRY_SIZE, BENCH_ENTRY_SIZE);
+        a.entries[e] = thtk_io_open_memory(data, BENCH_ENTRY_SIZE, &error);
+    }
+
+    if (bench_selected(create))
+        bench(create, bytes, bench_archive_create, &a);
+    else if (!bench_archive_create(&a))
+        exit(1);
+    if (!bench_archive_verify(&a)) {
+        fprintf(stderr, "%s: %s: extracted data differs\n", argv0, create);
+        exit(1);
+    }
+    bench(extract, bytes, bench_archive_extract, &a);
+
+    for (size_t e = 0; e < corpus_count * entries_per_corpus; ++e)
+        thtk_io_close(a.entries[e]);
+    free(a.entries);
+    thtk_io_close(a.archive);
+    thtk_io_close(a.output);
+    remove(bench_archive_path);
+}
+
+static void
+baseline_read(
+    const char* path)
+{
+    FILE* stream = fopen(path, "r");
+    char line[256];
+    size_t size = 0;
+    if (!stream) {
+        fprintf(stderr, "%s: couldn't open %s\n", argv0, path);
+        exit(1);
+    }
+    while (fgets(line, sizeof(line), stream)) {
+        result_t result;
+        if (line[0] == '#' || sscanf(line, "%63s %lf", result.name, &result.value) != 2 ||
+            !(result.value > 0))
+            continue;
+        if (baseline_count == size) {
+            size = size ? size * 2 : 64;
+            baseline = realloc(baseline, size * sizeof(*baseline));
+        }
+        baseline[baseline_count++] = result;
+    }
+    fclose(stream);
+}
+
+int
+main(
+    int argc,
+    char* argv[])
+{
+    thtk_error_t* error = NULL;
+    corpus_t corpora[] = {
+        { "text", NULL, NULL },
+        { "image", NULL, NULL },
+        { "random", NULL, NULL },
+        { "zeros", NULL, NULL },
+    };
+    void (*generators[])(unsigned char*, size_t) = {
+        corpus_text, corpus_image, corpus_random, corpus_zeros
+    };
+    const size_t corpus_count = sizeof(corpora) / sizeof(*corpora);
+    int opt;
+    int ind = 0;
+
+    argv0 = util_shortname(argv[0]);
+    while (argv[util_optind]) {
+        switch (opt = util_getopt(argc, argv, ":s:t:f:a:b:r:V")) {
+        case 's':
+            bench_size = strtoul(util_optarg, NULL, 10) * 1024;
+            break;
+        case 't':
+            bench_time = strtod(util_optarg, NULL);
+            break;
+        case 'f':
+            bench_filter = util_optarg;
+            break;
+        case 'a':
+            bench_archive_path = util_optarg;
+            break;
+        case 'b':
+            baseline_read(util_optarg);
+            break;
+        case 'r':
+            bench_threshold = strtod(util_optarg, NULL);
+            break;
+        default:
+            util_getopt_default(&ind, argv, opt, print_usage);
+        }
+    }
+    if (ind) {
+        print_usage();
+        exit(1);
+    }
+    if (!bench_archive_path)
+        bench_archive_path = bench_default_archive();
+    /* Archive entries are slices of a corpus. */
+    bench_size -= bench_size % BENCH_ENTRY_SIZE;
+    if (!bench_size) {
+        print_usage();
+        exit(1);
+    }
+
+    for (size_t i = 0; i < corpus_count; ++i) {
+        corpora[i].data = thtk_malloc(bench_size);
+        generators[i](corpora[i].data, bench_size);
+        if (!(corpora[i].io = thtk_io_open_memory(corpora[i].data, bench_size, &error))) {
+            print_error(error);
+            exit(1);
+        }
+    }
+
+    printf("# name\tMB/s%s\n", baseline_count ? "\tbaseline\tchange" : "");
+    for (size_t i = 0; i < corpus_count; ++i)
+        bench_codecs(&corpora[i]);
+#ifdef HAVE_LIBPNG
+    bench_pixels(&corpora[1]); /* image */
+    bench_png(&corpora[1]);
+#endif
+    for (size_t i = 0; i < sizeof(bench_versions) / sizeof(*bench_versions); ++i)
+        bench_archive(bench_versions[i], corpora, corpus_count);
+
+    for (size_t i = 0; i < corpus_count; ++i)
+        thtk_io_close(corpora[i].io);
+    free(baseline);
+
+    return bench_regressions ? 2 : 0;
+}
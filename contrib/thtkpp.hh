@@ -176,6 +176,12 @@ namespace Thtk {
             dat = thdat_open(version, input.io, &err);
             if(!dat) throw Thtk::Error(err);
         }
+        Dat(unsigned int version, Thtk::Io& input, Thtk::Io& index, uint64_t archive_size, uint64_t archive_mtime) {
+            write_mode = false;
+            thtk_error_t* err;
+            dat = thdat_open_index(version, input.io, index.io, archive_size, archive_mtime, &err);
+            if(!dat) throw Thtk::Error(err);
+        }
         Dat(unsigned int version, Thtk::Io& output, size_t entry_count) {
             write_mode = true;
             thtk_error_t* err;
@@ -197,6 +203,11 @@ namespace Thtk {
             if(-1 == rv) throw Thtk::Error(err);
             return rv;
         }
+        void write_index(Thtk::Io& output, uint64_t archive_size, uint64_t archive_mtime) {
+            thtk_error_t* err;
+            if(0 == thdat_write_index(dat, output.io, archive_size, archive_mtime, &err))
+                throw Thtk::Error(err);
+        }
         Entry entry(int index) {
             return Entry(dat,index);
         }
@@ -31,6 +31,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <sys/stat.h>
+#include <string>
 #include <utility>
 #include <memory>
 #include "thtkpp.hh"
@@ -45,6 +47,29 @@ Thtk::Dat* open_and_detect(const char* filename, Thtk::Io& io) {
     return new Thtk::Dat(version, io);
 }
 
+// With UTHDAT_INDEX set, the file list is kept in a .thidx file next to the
+// archive, so that it doesn't have to be decoded again for every command.
+Thtk::Dat* open_archive(const char* filename, Thtk::Io& io) {
+    struct stat st;
+    if(!getenv("UTHDAT_INDEX") || stat(filename, &st) == -1)
+        return open_and_detect(filename, io);
+
+    std::string index_path = std::string(filename) + ".thidx";
+    try {
+        Thtk::Io index(index_path.c_str(), "rb");
+        return new Thtk::Dat(0, io, index, st.st_size, st.st_mtime);
+    } catch(Thtk::Error&) {
+    }
+
+    Thtk::Dat* dat = open_and_detect(filename, io);
+    try {
+        Thtk::Io index(index_path.c_str(), "wb");
+        dat->write_index(index, st.st_size, st.st_mtime);
+    } catch(Thtk::Error&) {
+    }
+    return dat;
+}
+
 int main(int argc, char** argv) {
     try {
         if(argc < 3) return 1;
@@ -57,7 +82,7 @@ int main(int argc, char** argv) {
             strftime(date,sizeof(date),"%b %d %H:%M",&tm);
 
             Thtk::Io io(argv[2],"rb");
-            std::unique_ptr<Thtk::Dat> dat(open_and_detect(argv[2],io));
+            std::unique_ptr<Thtk::Dat> dat(open_archive(argv[2],io));
             ssize_t count = dat-> entry_count();
             for(int i=0;i<count;i++) {
                 Thtk::Entry e = dat->entry(i);
@@ -66,7 +91,7 @@ int main(int argc, char** argv) {
         } else if(!strcmp(argv[1],"copyout")) {
             if(argc < 5) return 1;
             Thtk::Io io(argv[2],"rb");
-            std::unique_ptr<Thtk::Dat> dat(open_and_detect(argv[2],io));
+            std::unique_ptr<Thtk::Dat> dat(open_archive(argv[2],io));
             Thtk::Entry e = dat->entry(argv[3]);
             Thtk::Io io2(argv[4],"wb");
             e.read(io2);
@@ -0,0 +1,368 @@
+/*
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cache.h"
+
+/* The cache file is stored in native byte order.  It starts with a header,
+ * followed by the records, each of which is an anm_cache_file_record_t,
+ * the sizes of its textures, and the textures themselves. */
+
+#define ANM_CACHE_FORMAT 1
+
+typedef struct {
+PACK_BEGIN
+    char magic[4];
+    uint32_t format;
+    uint32_t record_count;
+    uint32_t zero;
+PACK_END
+} PACK_ATTRIBUTE anm_cache_file_header_t;
+
+typedef struct {
+PACK_BEGIN
+    uint64_t source_hash;
+    uint64_t source_size;
+    uint64_t params_hash;
+    uint32_t count;
+    uint32_t zero;
+PACK_END
+} PACK_ATTRIBUTE anm_cache_file_record_t;
+
+typedef struct {
+    anm_cache_key_t key;
+    unsigned int count;
+    uint32_t* sizes;
+    /* Points into the loaded file, or to copies owned by the record. */
+    const unsigned char** data;
+    int owned;
+    int used;
+} anm_cache_record_t;
+
+struct anm_cache_t {
+    unsigned char* file;
+    anm_cache_record_t* records;
+    size_t record_count;
+    size_t record_capacity;
+    /* Open addressing table of record indices plus one, keyed on the hashes
+     * of the records.  It's kept at most half full. */
+    size_t* table;
+    size_t table_size;
+    int changed;
+};
+
+uint64_t
+anm_cache_hash(
+    uint64_t hash,
+    const void* data,
+    size_t size)
+{
+    const unsigned char* p = data;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= p[i];
+        hash *= UINT64_C(0x100000001b3);
+    }
+    return hash;
+}
+
+int
+anm_cache_hash_file(
+    const char* filename,
+    anm_cache_key_t* key)
+{
+    unsigned char buffer[65536];
+    size_t size;
+    FILE* stream = fopen(filename, "rb");
+    if (!stream)
+        return 0;
+
+    key->source_hash = ANM_CACHE_HASH_INIT;
+    key->source_size = 0;
+    while ((size = fread(buffer, 1, sizeof(buffer), stream))) {
+        key->source_hash = anm_cache_hash(key->source_hash, buffer, size);
+        key->source_size += size;
+    }
+    const int ret = !ferror(stream);
+    fclose(stream);
+    return ret;
+}
+
+static size_t
+anm_cache_slot(
+    const anm_cache_t* cache,
+    const anm_cache_key_t* key)
+{
+    /* The hashes are already FNV-1a, so they only need to be combined. */
+    const uint64_t hash = key->source_hash ^ (key->params_hash * UINT64_C(0x9e3779b97f4a7c15));
+    return (size_t)(hash ^ hash >> 32) & (cache->table_size - 1);
+}
+
+static void
+anm_cache_index(
+    anm_cache_t* cache,
+    size_t r)
+{
+    size_t slot = anm_cache_slot(cache, &cache->records[r].key);
+    while (cache->table[slot])
+        slot = (slot + 1) & (cache->table_size - 1);
+    cache->table[slot] = r + 1;
+}
+
+static anm_cache_record_t*
+anm_cache_add(
+    anm_cache_t* cache,
+    const anm_cache_key_t* key,
+    unsigned int count)
+{
+    if (cache->record_count == cache->record_capacity) {
+        cache->record_capacity = cache->record_capacity ? cache->record_capacity * 2 : 16;
+        cache->records = realloc(cache->records, cache->record_capacity * sizeof(*cache->records));
+        /* Records keep their probe order when they are indexed again, so
+         * lookups still find the first of several records with one key. */
+        free(cache->table);
+        cache->table_size = cache->record_capacity * 2;
+        cache->table = calloc(cache->table_size, sizeof(*cache->table));
+        for (size_t r = 0; r < cache->record_count; ++r)
+            anm_cache_index(cache, r);
+    }
+    anm_cache_record_t* record = &cache->records[cache->record_count++];
+    record->key = *key;
+    record->count = count;
+    record->sizes = malloc(count * sizeof(*record->sizes));
+    record->data = malloc(count * sizeof(*record->data));
+    record->owned = 0;
+    record->used = 0;
+    anm_cache_index(cache, cache->record_count - 1);
+    return record;
+}
+
+/* Reads the records of a cache file, returns 0 if it's invalid. */
+static int
+anm_cache_parse(
+    anm_cache_t* cache,
+    size_t size)
+{
+    const unsigned char* p = cache->file;
+    const unsigned char* end = cache->file + size;
+    anm_cache_file_header_t header;
+
+    if (size < sizeof(header))
+        return 0;
+    memcpy(&header, p, sizeof(header));
+    p += sizeof(header);
+    if (memcmp(header.magic, "THTC", 4) != 0 || header.format != ANM_CACHE_FORMAT)
+        return 0;
+
+    for (uint32_t r = 0; r < header.record_count; ++r) {
+        anm_cache_file_record_t file_record;
+        if ((size_t)(end - p) < sizeof(file_record))
+            return 0;
+        memcpy(&file_record, p, sizeof(file_record));
+        p += sizeof(file_record);
+        if ((size_t)(end - p) / sizeof(uint32_t) < file_record.count)
+            return 0;
+
+        const anm_cache_key_t key = {
+            file_record.source_hash,
+            file_record.source_size,
+            file_record.params_hash
+        };
+        anm_cache_record_t* record = anm_cache_add(cache, &key, file_record.count);
+        memcpy(record->sizes, p, file_record.count * sizeof(uint32_t));
+        p += file_record.count * sizeof(uint32_t);
+        for (unsigned int t = 0; t < record->count; ++t) {
+            if ((size_t)(end - p) < record->sizes[t])
+                return 0;
+            record->data[t] = p;
+            p += record->sizes[t];
+        }
+    }
+
+    return p == end;
+}
+
+static void
+anm_cache_clear(
+    anm_cache_t* cache)
+{
+    for (size_t r = 0; r < cache->record_count; ++r) {
+        anm_cache_record_t* record = &cache->records[r];
+        if (record->owned)
+            for (unsigned int t = 0; t < record->count; ++t)
+                free((unsigned char*)record->data[t]);
+        free(record->sizes);
+        free(record->data);
+    }
+    cache->record_count = 0;
+    if (cache->table)
+        memset(cache->table, 0, cache->table_size * sizeof(*cache->table));
+}
+
+anm_cache_t*
+anm_cache_load(
+    const char* filename)
+{
+    anm_cache_t* cache = malloc(sizeof(*cache));
+    cache->file = NULL;
+    cache->records = NULL;
+    cache->record_count = 0;
+    cache->record_capacity = 0;
+    cache->table = NULL;
+    cache->table_size = 0;
+    cache->changed = 0;
+
+    FILE* stream = fopen(filename, "rb");
+    if (!stream)
+        return cache;
+
+    long size;
+    if (fseek(stream, 0, SEEK_END) == 0 &&
+        (size = ftell(stream)) > 0 &&
+        fseek(stream, 0, SEEK_SET) == 0 &&
+        (cache->file = malloc(size)) &&
+        fread(cache->file, 1, size, stream) == (size_t)size &&
+        anm_cache_parse(cache, size)) {
+        fclose(stream);
+        return cache;
+    }
+
+    fclose(stream);
+    anm_cache_clear(cache);
+    free(cache->file);
+    cache->file = NULL;
+    /* Replace the file. */
+    cache->changed = 1;
+    return cache;
+}
+
+int
+anm_cache_lookup(
+    anm_cache_t* cache,
+    const anm_cache_key_t* key,
+    unsigned int count,
+    const unsigned char** data,
+    uint32_t* sizes)
+{
+    if (!cache->table)
+        return 0;
+    for (size_t slot = anm_cache_slot(cache, key); cache->table[slot];
+         slot = (slot + 1) & (cache->table_size - 1)) {
+        anm_cache_record_t* record = &cache->records[cache->table[slot] - 1];
+        if (record->key.source_hash == key->source_hash &&
+            record->key.source_size == key->source_size &&
+            record->key.params_hash == key->params_hash &&
+            record->count == count) {
+            memcpy(data, record->data, count * sizeof(*data));
+            memcpy(sizes, record->sizes, count * sizeof(*sizes));
+            record->used = 1;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void
+anm_cache_store(
+    anm_cache_t* cache,
+    const anm_cache_key_t* key,
+    unsigned int count,
+    const unsigned char* const* data,
+    const uint32_t* sizes)
+{
+    anm_cache_record_t* record = anm_cache_add(cache, key, count);
+    record->owned = 1;
+    record->used = 1;
+    for (unsigned int t = 0; t < count; ++t) {
+        unsigned char* copy = malloc(sizes[t]);
+        memcpy(copy, data[t], sizes[t]);
+        record->data[t] = copy;
+        record->sizes[t] = sizes[t];
+    }
+    cache->changed = 1;
+}
+
+void
+anm_cache_save(
+    anm_cache_t* cache,
+    const char* filename)
+{
+    anm_cache_file_header_t header;
+    size_t r;
+
+    memcpy(header.magic, "THTC", 4);
+    header.format = ANM_CACHE_FORMAT;
+    header.record_count = 0;
+    header.zero = 0;
+    for (r = 0; r < cache->record_count; ++r)
+        header.record_count += cache->records[r].used;
+
+    if (!cache->changed && header.record_count == cache->record_count)
+        return;
+
+    /* Problems with the cache are not errors, the next run just converts
+     * the textures again. */
+    FILE* stream = fopen(filename, "wb");
+    if (!stream)
+        return;
+    fwrite(&header, sizeof(header), 1, stream);
+    for (r = 0; r < cache->record_count; ++r) {
+        const anm_cache_record_t* record = &cache->records[r];
+        if (!record->used)
+            continue;
+        const anm_cache_file_record_t file_record = {
+            record->key.source_hash,
+            record->key.source_size,
+            record->key.params_hash,
+            record->count,
+            0
+        };
+        fwrite(&file_record, sizeof(file_record), 1, stream);
+        fwrite(record->sizes, sizeof(uint32_t), record->count, stream);
+        for (unsigned int t = 0; t < record->count; ++t)
+            fwrite(record->data[t], 1, record->sizes[t], stream);
+    }
+    const int failed = ferror(stream);
+    if (fclose(stream) != 0 || failed)
+        remove(filename);
+}
+
+void
+anm_cache_free(
+    anm_cache_t* cache)
+{
+    if (cache) {
+        anm_cache_clear(cache);
+        free(cache->records);
+        free(cache->table);
+        free(cache->file);
+        free(cache);
+    }
+}
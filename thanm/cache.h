@@ -0,0 +1,100 @@
+/*
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+#ifndef CACHE_H_
+#define CACHE_H_
+
+#include <config.h>
+#include <stddef.h>
+#include <inttypes.h>
+
+/* A cache of converted textures for thanm -c.  The textures that are cut
+ * out of one image are stored together, under a key made of the contents
+ * of the image and of everything that affects the conversion. */
+typedef struct anm_cache_t anm_cache_t;
+
+typedef struct {
+    uint64_t source_hash;
+    uint64_t source_size;
+    /* The formats and rectangles of the textures, and the settings. */
+    uint64_t params_hash;
+} anm_cache_key_t;
+
+#define ANM_CACHE_HASH_INIT UINT64_C(0xcbf29ce484222325)
+
+/* 64-bit FNV-1a. */
+uint64_t
+anm_cache_hash(
+    uint64_t hash,
+    const void* data,
+    size_t size);
+
+/* Hashes the contents of a file into key.  Returns 0 if the file can't be
+ * read. */
+int
+anm_cache_hash_file(
+    const char* filename,
+    anm_cache_key_t* key);
+
+/* Loads the cache from filename.  A missing or invalid file gives an empty
+ * cache. */
+anm_cache_t*
+anm_cache_load(
+    const char* filename);
+
+/* Returns 1 and sets data and sizes to the count textures stored for key,
+ * or returns 0.  The data is owned by the cache. */
+int
+anm_cache_lookup(
+    anm_cache_t* cache,
+    const anm_cache_key_t* key,
+    unsigned int count,
+    const unsigned char** data,
+    uint32_t* sizes);
+
+/* Stores a copy of count textures under key. */
+void
+anm_cache_store(
+    anm_cache_t* cache,
+    const anm_cache_key_t* key,
+    unsigned int count,
+    const unsigned char* const* data,
+    const uint32_t* sizes);
+
+/* Writes the textures that were looked up or stored to filename, dropping
+ * the others.  Nothing is written if that wouldn't change the file. */
+void
+anm_cache_save(
+    anm_cache_t* cache,
+    const char* filename);
+
+void
+anm_cache_free(
+    anm_cache_t* cache);
+
+#endif
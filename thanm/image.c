@@ -31,6 +31,7 @@
 #include <inttypes.h>
 #ifdef HAVE_LIBPNG
 #include <png.h>
+#include <zlib.h>
 #endif
 #include <stdlib.h>
 #include <errno.h>
@@ -38,6 +39,13 @@
 #include "program.h"
 #include "thanm.h"
 
+/* SSE2 is part of every x86-64 target, 32-bit builds only get it when the
+ * compiler is told so. */
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  define THANM_SSE2 1
+#  include <emmintrin.h>
+#endif
+
 unsigned int
 format_Bpp(
     format_t format)
@@ -59,32 +67,117 @@ format_Bpp(
 }
 
 #ifdef HAVE_LIBPNG
-unsigned char*
-format_from_rgba(
+#ifdef THANM_SSE2
+/* Swaps the first and third byte of every 32-bit lane. */
+static inline __m128i
+sse2_swap_rb(
+    __m128i v)
+{
+    const __m128i ga = _mm_set1_epi32((int)0xff00ff00);
+    const __m128i low = _mm_set1_epi32(0xff);
+    return _mm_or_si128(_mm_and_si128(v, ga),
+        _mm_or_si128(_mm_and_si128(_mm_srli_epi32(v, 16), low),
+                     _mm_slli_epi32(_mm_and_si128(v, low), 16)));
+}
+
+/* Packs the low 16 bits of every 32-bit lane of a and b. */
+static inline __m128i
+sse2_pack_low16(
+    __m128i a,
+    __m128i b)
+{
+    a = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+    b = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);
+    return _mm_packs_epi32(a, b);
+}
+
+/* Maps each byte of v from 0-255 to 0-15 by rounding v/17.  The quotient
+ * is computed as (v+8)*3856 >> 16, which is exact for this range. */
+static inline __m128i
+sse2_div17(
+    __m128i v)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i eight = _mm_set1_epi16(8);
+    const __m128i m = _mm_set1_epi16(3856);
+    __m128i lo = _mm_unpacklo_epi8(v, zero);
+    __m128i hi = _mm_unpackhi_epi8(v, zero);
+    lo = _mm_mulhi_epu16(_mm_add_epi16(lo, eight), m);
+    hi = _mm_mulhi_epu16(_mm_add_epi16(hi, eight), m);
+    return _mm_packus_epi16(lo, hi);
+}
+
+/* Bit-extends the 5-bit value in the low bits of every 16-bit lane to 8 bits
+ * by repeating the lowest bit, as format_to_rgba does for blue. */
+static inline __m128i
+sse2_extend5(
+    __m128i v)
+{
+    const __m128i bit = _mm_and_si128(v, _mm_set1_epi16(1));
+    return _mm_or_si128(_mm_slli_epi16(v, 3), _mm_sub_epi16(_mm_slli_epi16(bit, 3), bit));
+}
+#endif
+
+static void
+format_from_rgba_to(
     const uint32_t* data,
     unsigned int pixels,
-    format_t format)
+    format_t format,
+    unsigned char* out)
 {
-    unsigned int i;
-    unsigned char* out = NULL;
+    unsigned int i = 0;
 
     if (format == FORMAT_GRAY8) {
-        out = malloc(pixels);
-        for (i = 0; i < pixels; ++i) {
+#ifdef THANM_SSE2
+        const __m128i low = _mm_set1_epi32(0xff);
+        for (; i + 16 <= pixels; i += 16) {
+            const __m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i*)(data + i)), low);
+            const __m128i b = _mm_and_si128(_mm_loadu_si128((const __m128i*)(data + i + 4)), low);
+            const __m128i c = _mm_and_si128(_mm_loadu_si128((const __m128i*)(data + i + 8)), low);
+            const __m128i d = _mm_and_si128(_mm_loadu_si128((const __m128i*)(data + i + 12)), low);
+            _mm_storeu_si128((__m128i*)(out + i),
+                _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d)));
+        }
+#endif
+        for (; i < pixels; ++i) {
             out[i] = data[i] & 0xff;
         }
     } else if (format == FORMAT_BGRA8888) {
         const unsigned char* data8 = (const unsigned char*)data;
-        out = malloc(sizeof(uint32_t) * pixels);
-        for (i = 0; i < pixels; ++i) {
+#ifdef THANM_SSE2
+        for (; i + 4 <= pixels; i += 4) {
+            const __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+            _mm_storeu_si128((__m128i*)(out + i * sizeof(uint32_t)), sse2_swap_rb(v));
+        }
+#endif
+        for (; i < pixels; ++i) {
             out[i * sizeof(uint32_t) + 0] = data8[i * sizeof(uint32_t) + 2];
             out[i * sizeof(uint32_t) + 1] = data8[i * sizeof(uint32_t) + 1];
             out[i * sizeof(uint32_t) + 2] = data8[i * sizeof(uint32_t) + 0];
             out[i * sizeof(uint32_t) + 3] = data8[i * sizeof(uint32_t) + 3];
         }
     } else if (format == FORMAT_ARGB4444) {
-        out = malloc(sizeof(uint16_t) * pixels);
-        for (i = 0; i < pixels; ++i) {
+#ifdef THANM_SSE2
+        /* With the quotients q0-q3 of the four bytes, each pixel becomes
+         * q2 | q1 << 4 | q0 << 8 | q3 << 12. */
+        const __m128i m0 = _mm_set1_epi32(0x000f);
+        const __m128i m1 = _mm_set1_epi32(0x00f0);
+        const __m128i m2 = _mm_set1_epi32(0x0f00);
+        const __m128i m3 = _mm_set1_epi32(0xf000);
+        for (; i + 8 <= pixels; i += 8) {
+            __m128i q[2];
+            for (unsigned int k = 0; k < 2; ++k) {
+                const __m128i v = sse2_div17(_mm_loadu_si128((const __m128i*)(data + i + k * 4)));
+                q[k] = _mm_or_si128(
+                    _mm_or_si128(_mm_and_si128(_mm_srli_epi32(v, 16), m0),
+                                 _mm_and_si128(_mm_srli_epi32(v, 4), m1)),
+                    _mm_or_si128(_mm_and_si128(_mm_slli_epi32(v, 8), m2),
+                                 _mm_and_si128(_mm_srli_epi32(v, 12), m3)));
+            }
+            _mm_storeu_si128((__m128i*)(out + i * sizeof(uint16_t)), sse2_pack_low16(q[0], q[1]));
+        }
+#endif
+        for (; i < pixels; ++i) {
             /* Use the extra precision for rounding. */
             const unsigned char r = (((data[i] & 0xff000000) >> 24) + 8) / 17;
             const unsigned char g = (((data[i] &   0xff0000) >> 16) + 8) / 17;
@@ -96,9 +189,24 @@ format_from_rgba(
         }
     } else if (format == FORMAT_RGB565) {
         uint16_t* out16;
-        out = malloc(sizeof(uint16_t) * pixels);
         out16 = (uint16_t*)out;
-        for (i = 0; i < pixels; ++i) {
+#ifdef THANM_SSE2
+        const __m128i m0 = _mm_set1_epi32(0xf8);
+        const __m128i m1 = _mm_set1_epi32(0xfc00);
+        const __m128i m2 = _mm_set1_epi32(0xf80000);
+        for (; i + 8 <= pixels; i += 8) {
+            __m128i p[2];
+            for (unsigned int k = 0; k < 2; ++k) {
+                const __m128i v = _mm_loadu_si128((const __m128i*)(data + i + k * 4));
+                p[k] = _mm_or_si128(
+                    _mm_slli_epi32(_mm_and_si128(v, m0), 8),
+                    _mm_or_si128(_mm_srli_epi32(_mm_and_si128(v, m1), 5),
+                                 _mm_srli_epi32(_mm_and_si128(v, m2), 19)));
+            }
+            _mm_storeu_si128((__m128i*)(out16 + i), sse2_pack_low16(p[0], p[1]));
+        }
+#endif
+        for (; i < pixels; ++i) {
                      /* 00000000 00000000 11111000 -> 00000000 00011111 */
             out16[i] = ((data[i] &     0xf8) << 8)
                      /* 00000000 11111100 00000000 -> 00000111 11100000 */
@@ -107,27 +215,61 @@ format_from_rgba(
                      | ((data[i] & 0xf80000) >>19);
         }
     } else if (format == FORMAT_RGBA8888) {
-        out = malloc(sizeof(uint32_t) * pixels);
         memcpy(out, data, sizeof(uint32_t) * pixels);
     } else {
         fprintf(stderr, "%s: unknown format: %u\n", argv0, format);
         abort();
     }
+}
 
+unsigned char*
+format_from_rgba(
+    const uint32_t* data,
+    unsigned int pixels,
+    format_t format)
+{
+    unsigned char* out = malloc(pixels * format_Bpp(format));
+    format_from_rgba_to(data, pixels, format, out);
     return out;
 }
 
-unsigned char*
-format_to_rgba(
+void
+format_from_rgba_rect(
+    const uint32_t* data,
+    unsigned int stride,
+    unsigned int width,
+    unsigned int height,
+    format_t format,
+    unsigned char* out)
+{
+    const size_t row_size = (size_t)width * format_Bpp(format);
+    for (unsigned int y = 0; y < height; ++y)
+        format_from_rgba_to(data + (size_t)y * stride, width, format, out + y * row_size);
+}
+
+void
+format_to_rgba_to(
     const unsigned char* data,
     unsigned int pixels,
-    format_t format)
+    format_t format,
+    uint32_t* out)
 {
-    unsigned int i;
-    uint32_t* out = malloc(sizeof(uint32_t) * pixels);
+    unsigned int i = 0;
 
     if (format == FORMAT_GRAY8) {
-        for (i = 0; i < pixels; ++i) {
+#ifdef THANM_SSE2
+        const __m128i alpha = _mm_set1_epi32((int)0xff000000);
+        for (; i + 16 <= pixels; i += 16) {
+            const __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+            const __m128i lo = _mm_unpacklo_epi8(v, v);
+            const __m128i hi = _mm_unpackhi_epi8(v, v);
+            _mm_storeu_si128((__m128i*)(out + i), _mm_or_si128(_mm_unpacklo_epi16(lo, lo), alpha));
+            _mm_storeu_si128((__m128i*)(out + i + 4), _mm_or_si128(_mm_unpackhi_epi16(lo, lo), alpha));
+            _mm_storeu_si128((__m128i*)(out + i + 8), _mm_or_si128(_mm_unpacklo_epi16(hi, hi), alpha));
+            _mm_storeu_si128((__m128i*)(out + i + 12), _mm_or_si128(_mm_unpackhi_epi16(hi, hi), alpha));
+        }
+#endif
+        for (; i < pixels; ++i) {
             out[i] = 0xff000000
                    | (data[i] << 16 & 0xff0000)
                    | (data[i] <<  8 &   0xff00)
@@ -135,14 +277,36 @@ format_to_rgba(
         }
     } else if (format == FORMAT_BGRA8888) {
         unsigned char* out8 = (unsigned char*)out;
-        for (i = 0; i < pixels; ++i) {
+#ifdef THANM_SSE2
+        for (; i + 4 <= pixels; i += 4) {
+            const __m128i v = _mm_loadu_si128((const __m128i*)(data + i * sizeof(uint32_t)));
+            _mm_storeu_si128((__m128i*)(out + i), sse2_swap_rb(v));
+        }
+#endif
+        for (; i < pixels; ++i) {
             out8[i * sizeof(uint32_t) + 0] = data[i * sizeof(uint32_t) + 2];
             out8[i * sizeof(uint32_t) + 1] = data[i * sizeof(uint32_t) + 1];
             out8[i * sizeof(uint32_t) + 2] = data[i * sizeof(uint32_t) + 0];
             out8[i * sizeof(uint32_t) + 3] = data[i * sizeof(uint32_t) + 3];
         }
     } else if (format == FORMAT_ARGB4444) {
-        for (i = 0; i < pixels; ++i) {
+#ifdef THANM_SSE2
+        /* Splitting the nibbles of every byte gives n0 n1 n2 n3 for each
+         * pixel, while the output needs n2 n1 n0 n3, each times 17. */
+        const __m128i nibble = _mm_set1_epi8(0x0f);
+        for (; i + 8 <= pixels; i += 8) {
+            const __m128i v = _mm_loadu_si128((const __m128i*)(data + i * sizeof(uint16_t)));
+            const __m128i lo = _mm_and_si128(v, nibble);
+            const __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), nibble);
+            __m128i a = sse2_swap_rb(_mm_unpacklo_epi8(lo, hi));
+            __m128i b = sse2_swap_rb(_mm_unpackhi_epi8(lo, hi));
+            a = _mm_or_si128(a, _mm_slli_epi32(a, 4));
+            b = _mm_or_si128(b, _mm_slli_epi32(b, 4));
+            _mm_storeu_si128((__m128i*)(out + i), a);
+            _mm_storeu_si128((__m128i*)(out + i + 4), b);
+        }
+#endif
+        for (; i < pixels; ++i) {
             /* Extends like this: 0x0 -> 0x00, 0x3 -> 0x33, 0xf -> 0xff.
              * It's required for proper alpha. */
             out[i] = ((data[i * sizeof(uint16_t) + 1] & 0xf0) << 24 & 0xf0000000)
@@ -156,7 +320,28 @@ format_to_rgba(
         }
     } else if (format == FORMAT_RGB565) {
         uint16_t* u16 = (uint16_t*)data;
-        for (i = 0; i < pixels; ++i) {
+#ifdef THANM_SSE2
+        const __m128i five = _mm_set1_epi16(0x1f);
+        const __m128i six = _mm_set1_epi16(0x3f);
+        const __m128i one = _mm_set1_epi16(1);
+        const __m128i alpha = _mm_set1_epi16((short)0xff00);
+        for (; i + 8 <= pixels; i += 8) {
+            const __m128i v = _mm_loadu_si128((const __m128i*)(u16 + i));
+            /* Red only gets its lowest bit repeated once. */
+            const __m128i r5 = _mm_and_si128(v, five);
+            const __m128i r = _mm_or_si128(_mm_slli_epi16(r5, 3), _mm_and_si128(r5, one));
+            const __m128i b = sse2_extend5(_mm_srli_epi16(v, 11));
+            const __m128i g6 = _mm_and_si128(_mm_srli_epi16(v, 5), six);
+            const __m128i gbit = _mm_and_si128(g6, one);
+            const __m128i g = _mm_or_si128(_mm_slli_epi16(g6, 2), _mm_sub_epi16(_mm_slli_epi16(gbit, 2), gbit));
+            /* Bytes 0 and 1 of each pixel, then bytes 2 and 3. */
+            const __m128i bg = _mm_or_si128(b, _mm_slli_epi16(g, 8));
+            const __m128i ra = _mm_or_si128(r, alpha);
+            _mm_storeu_si128((__m128i*)(out + i), _mm_unpacklo_epi16(bg, ra));
+            _mm_storeu_si128((__m128i*)(out + i + 4), _mm_unpackhi_epi16(bg, ra));
+        }
+#endif
+        for (; i < pixels; ++i) {
             /* Bit-extends channels: 00001b -> 00001111b. */
             out[i] = 0xff000000
                    | ((u16[i] & 0x001f) << 19 & 0xf80000)
@@ -179,107 +364,802 @@ format_to_rgba(
         fprintf(stderr, "%s: unknown format: %u\n", argv0, format);
         abort();
     }
+}
 
+unsigned char*
+format_to_rgba(
+    const unsigned char* data,
+    unsigned int pixels,
+    format_t format)
+{
+    uint32_t* out = malloc(sizeof(uint32_t) * pixels);
+    format_to_rgba_to(data, pixels, format, out);
     return (unsigned char*)out;
 }
 
-void
-png_read_mem(
-    image_t *image,
-    void *data,
-    size_t len)
+/* PNG writer settings from png_set_options.  -1 leaves the choice to the
+ * writer. */
+static int png_level = -1;
+static int png_strategy = -1;
+static int png_filters = -1;
+static int png_parallel = 0;
+
+int
+png_set_options(
+    const char* spec)
 {
-    png_image png = {
-        .version = PNG_IMAGE_VERSION,
-        .opaque = NULL
+    static const struct {
+        const char* name;
+        int strategy;
+    } strategies[] = {
+        { "default", Z_DEFAULT_STRATEGY },
+        { "filtered", Z_FILTERED },
+        { "huffman", Z_HUFFMAN_ONLY },
+        { "rle", Z_RLE },
+        { "fixed", Z_FIXED },
     };
-    png_image_begin_read_from_memory(&png, data, len);
-    if (PNG_IMAGE_FAILED(png)) {
-        fprintf(stderr, "%s: error decoding png: %s\n", argv0, png.message);
-        exit(1);
+    static const struct {
+        const char* name;
+        int filters;
+    } filters[] = {
+        { "none", PNG_FILTER_NONE },
+        { "sub", PNG_FILTER_SUB },
+        { "up", PNG_FILTER_UP },
+        { "avg", PNG_FILTER_AVG },
+        { "paeth", PNG_FILTER_PAETH },
+        { "all", PNG_ALL_FILTERS },
+    };
+    int level = png_level;
+    int strategy = png_strategy;
+    int filter_mask = -1;
+    int parallel = png_parallel;
+
+    while (*spec) {
+        size_t len = strcspn(spec, ",");
+        size_t i;
+
+        if (len == 1 && spec[0] >= '0' && spec[0] <= '9') {
+            level = spec[0] - '0';
+            goto next;
+        }
+        if (len == 8 && !strncmp(spec, "parallel", len)) {
+            parallel = 1;
+            goto next;
+        }
+        for (i = 0; i < sizeof(strategies) / sizeof(*strategies); ++i) {
+            if (strlen(strategies[i].name) == len && !strncmp(spec, strategies[i].name, len)) {
+                strategy = strategies[i].strategy;
+                goto next;
+            }
+        }
+        for (i = 0; i < sizeof(filters) / sizeof(*filters); ++i) {
+            if (strlen(filters[i].name) == len && !strncmp(spec, filters[i].name, len)) {
+                filter_mask = (filter_mask == -1 ? 0 : filter_mask) | filters[i].filters;
+                goto next;
+            }
+        }
+        return 0;
+next:
+        spec += len;
+        if (*spec == ',')
+            ++spec;
     }
-    png.format = PNG_FORMAT_RGBA;
 
-    image->width = png.width;
-    image->height = png.height;
-    image->format = FORMAT_RGBA8888;
-    image->data = malloc(PNG_IMAGE_SIZE(png));
+    png_level = level;
+    png_strategy = strategy;
+    if (filter_mask != -1)
+        png_filters = filter_mask;
+    png_parallel = parallel;
+    return 1;
+}
 
-    png_image_finish_read(&png, 0, image->data, 0, 0);
-    if (PNG_IMAGE_FAILED(png)) {
-        fprintf(stderr, "%s: error decoding png: %s\n", argv0, png.message);
-        exit(1);
+/* Where an encoded PNG goes: a stream, or a growing buffer when stream is
+ * NULL. */
+typedef struct {
+    FILE* stream;
+    unsigned char* data;
+    size_t size;
+    size_t capacity;
+} png_sink_t;
+
+static void
+png_sink_write(
+    png_sink_t* sink,
+    const void* data,
+    size_t size)
+{
+    if (sink->stream) {
+        fwrite(data, 1, size, sink->stream);
+        return;
+    }
+    if (sink->capacity - sink->size < size) {
+        size_t capacity = sink->capacity ? sink->capacity : 65536;
+        while (capacity - sink->size < size)
+            capacity *= 2;
+        sink->data = realloc(sink->data, capacity);
+        if (!sink->data) {
+            fprintf(stderr, "%s: allocation of %zu bytes failed\n", argv0, capacity);
+            exit(1);
+        }
+        sink->capacity = capacity;
     }
+    memcpy(sink->data + sink->size, data, size);
+    sink->size += size;
 }
 
-void *
-png_write_mem(
-    image_t *image,
-    size_t *outsize)
+static void
+png_sink_write_fn(
+    png_structp png_ptr,
+    png_bytep data,
+    png_size_t length)
 {
-    png_image png;
-    memset(&png, 0, sizeof(png));
-    png.version = PNG_IMAGE_VERSION;
-    png.width = image->width;
-    png.height = image->height;
-    png.format = PNG_FORMAT_RGBA;
-    png.flags = PNG_IMAGE_FLAG_FAST;
+    png_sink_write(png_get_io_ptr(png_ptr), data, length);
+}
 
-    png_image_write_to_memory(&png, 0, outsize, 0, image->data, 0, 0);
-    if (PNG_IMAGE_FAILED(png)) {
-        fprintf(stderr, "%s: error encoding png: %s\n", argv0, png.message);
-        exit(1);
+static void
+png_sink_flush_fn(
+    png_structp png_ptr)
+{
+    (void)png_ptr;
+}
+
+/* Row-parallel mode: the filtered image is cut into strips of about this
+ * many bytes, which are deflated independently and joined into one zlib
+ * stream.  The strips only depend on the image, never on the thread
+ * count, so the output is the same however many threads run. */
+#define PNG_STRIP_SIZE (256 * 1024)
+/* Deflate's window; each strip is primed with this much of the previous
+ * one to keep the ratio close to a single stream. */
+#define PNG_WINDOW_SIZE 32768
+
+static inline unsigned int
+png_paeth(
+    int a,
+    int b,
+    int c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a);
+    int pb = abs(p - b);
+    int pc = abs(p - c);
+    if (pa <= pb && pa <= pc)
+        return a;
+    return pb <= pc ? b : c;
+}
+
+/* Filters one row into out, which gets the filter type byte followed by
+ * the filtered bytes.  prev is NULL for the first row. */
+static void
+png_filter_row(
+    const unsigned char* row,
+    const unsigned char* prev,
+    size_t rowbytes,
+    unsigned int bpp,
+    int type,
+    unsigned char* out)
+{
+    size_t i;
+
+    out[0] = type;
+    ++out;
+    switch (type) {
+    case PNG_FILTER_VALUE_SUB:
+        for (i = 0; i < rowbytes; ++i)
+            out[i] = row[i] - (i >= bpp ? row[i - bpp] : 0);
+        break;
+    case PNG_FILTER_VALUE_UP:
+        for (i = 0; i < rowbytes; ++i)
+            out[i] = row[i] - (prev ? prev[i] : 0);
+        break;
+    case PNG_FILTER_VALUE_AVG:
+        for (i = 0; i < rowbytes; ++i) {
+            unsigned int a = i >= bpp ? row[i - bpp] : 0;
+            unsigned int b = prev ? prev[i] : 0;
+            out[i] = row[i] - ((a + b) >> 1);
+        }
+        break;
+    case PNG_FILTER_VALUE_PAETH:
+        for (i = 0; i < rowbytes; ++i) {
+            int a = i >= bpp ? row[i - bpp] : 0;
+            int b = prev ? prev[i] : 0;
+            int c = prev && i >= bpp ? prev[i - bpp] : 0;
+            out[i] = row[i] - png_paeth(a, b, c);
+        }
+        break;
+    default:
+        memcpy(out, row, rowbytes);
+        break;
     }
-    void *out = malloc(*outsize);
-    png_image_write_to_memory(&png, out, outsize, 0, image->data, 0, 0);
-    if (PNG_IMAGE_FAILED(png)) {
-        fprintf(stderr, "%s: error encoding png: %s\n", argv0, png.message);
+}
+
+/* Picks the allowed filter with the smallest sum of absolute values, the
+ * heuristic libpng uses, and leaves the filtered row in out. */
+static void
+png_filter_row_adaptive(
+    const unsigned char* row,
+    const unsigned char* prev,
+    size_t rowbytes,
+    unsigned int bpp,
+    int filters,
+    unsigned char* out,
+    unsigned char* scratch)
+{
+    static const int masks[5] = {
+        PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_UP, PNG_FILTER_AVG, PNG_FILTER_PAETH
+    };
+    uint64_t best_sum = UINT64_MAX;
+
+    for (int type = 0; type < 5; ++type) {
+        if (!(filters & masks[type]))
+            continue;
+        png_filter_row(row, prev, rowbytes, bpp, type, scratch);
+        uint64_t sum = 0;
+        for (size_t i = 1; i <= rowbytes; ++i)
+            sum += abs((int8_t)scratch[i]);
+        if (sum < best_sum) {
+            best_sum = sum;
+            memcpy(out, scratch, rowbytes + 1);
+        }
+    }
+}
+
+static void
+png_put_chunk(
+    png_sink_t* sink,
+    const char* type,
+    const unsigned char* data,
+    size_t size)
+{
+    unsigned char buf[4];
+    uLong crc;
+
+    buf[0] = size >> 24;
+    buf[1] = size >> 16;
+    buf[2] = size >> 8;
+    buf[3] = size;
+    png_sink_write(sink, buf, 4);
+    png_sink_write(sink, type, 4);
+    if (size)
+        png_sink_write(sink, data, size);
+
+    crc = crc32(0, (const Bytef*)type, 4);
+    crc = crc32(crc, data, size);
+    buf[0] = crc >> 24;
+    buf[1] = crc >> 16;
+    buf[2] = crc >> 8;
+    buf[3] = crc;
+    png_sink_write(sink, buf, 4);
+}
+
+/* Writes the image with its strips filtered and deflated in parallel.
+ * Returns 0 when the image is too small to be worth splitting. */
+static int
+png_encode_parallel(
+    png_sink_t* sink,
+    image_t* image,
+    int level,
+    int strategy,
+    int filters,
+    int srgb)
+{
+    static const unsigned char signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+    const unsigned int bpp = image->format == FORMAT_GRAY8 ? 1 : 4;
+    const size_t rowbytes = (size_t)image->width * bpp;
+    const size_t stride = rowbytes + 1;
+    size_t strip_rows = PNG_STRIP_SIZE / stride;
+    if (!strip_rows)
+        strip_rows = 1;
+    const size_t strip_count = (image->height + strip_rows - 1) / strip_rows;
+
+    if (strip_count < 2 || !image->width)
+        return 0;
+
+    unsigned char* filtered = malloc(stride * image->height);
+    unsigned char** out = calloc(strip_count, sizeof(*out));
+    size_t* out_size = calloc(strip_count, sizeof(*out_size));
+    uLong* adler = calloc(strip_count, sizeof(*adler));
+    int failed = 0;
+
+#pragma omp parallel for schedule(dynamic)
+    for (ssize_t s = 0; s < (ssize_t)strip_count; ++s) {
+        const size_t first = s * strip_rows;
+        const size_t last = first + strip_rows < image->height ? first + strip_rows : image->height;
+        unsigned char* scratch = malloc(stride);
+        for (size_t y = first; y < last; ++y) {
+            const unsigned char* row = image->data + y * rowbytes;
+            const unsigned char* prev = y ? row - rowbytes : NULL;
+            if (filters & (filters - 1))
+                png_filter_row_adaptive(row, prev, rowbytes, bpp, filters, filtered + y * stride, scratch);
+            else
+                png_filter_row(row, prev, rowbytes, bpp,
+                    filters == PNG_FILTER_SUB ? PNG_FILTER_VALUE_SUB :
+                    filters == PNG_FILTER_UP ? PNG_FILTER_VALUE_UP :
+                    filters == PNG_FILTER_AVG ? PNG_FILTER_VALUE_AVG :
+                    filters == PNG_FILTER_PAETH ? PNG_FILTER_VALUE_PAETH :
+                    PNG_FILTER_VALUE_NONE,
+                    filtered + y * stride);
+        }
+        free(scratch);
+    }
+
+#pragma omp parallel for schedule(dynamic)
+    for (ssize_t s = 0; s < (ssize_t)strip_count; ++s) {
+        const unsigned char* in = filtered + s * strip_rows * stride;
+        const size_t in_size = (s == (ssize_t)strip_count - 1 ? image->height - s * strip_rows : strip_rows) * stride;
+        z_stream z;
+
+        adler[s] = adler32(adler32(0, NULL, 0), in, in_size);
+
+        memset(&z, 0, sizeof(z));
+        if (deflateInit2(&z, level, Z_DEFLATED, -15, 8, strategy) != Z_OK) {
+            failed = 1;
+            continue;
+        }
+        if (s) {
+            const size_t dict = in - filtered < PNG_WINDOW_SIZE ? in - filtered : PNG_WINDOW_SIZE;
+            deflateSetDictionary(&z, in - dict, dict);
+        }
+        /* Room for the sync flush marker on top of the worst case. */
+        size_t capacity = deflateBound(&z, in_size) + 16;
+        out[s] = malloc(capacity);
+        z.next_in = (Bytef*)in;
+        z.avail_in = in_size;
+        z.next_out = out[s];
+        z.avail_out = capacity;
+        if (deflate(&z, s == (ssize_t)strip_count - 1 ? Z_FINISH : Z_SYNC_FLUSH) == Z_STREAM_ERROR || z.avail_in)
+            failed = 1;
+        out_size[s] = capacity - z.avail_out;
+        deflateEnd(&z);
+    }
+
+    if (failed) {
+        fprintf(stderr, "%s: error encoding png: deflate failed\n", argv0);
         exit(1);
     }
 
-    return out;
+    unsigned char ihdr[13];
+    ihdr[0] = image->width >> 24;
+    ihdr[1] = image->width >> 16;
+    ihdr[2] = image->width >> 8;
+    ihdr[3] = image->width;
+    ihdr[4] = image->height >> 24;
+    ihdr[5] = image->height >> 16;
+    ihdr[6] = image->height >> 8;
+    ihdr[7] = image->height;
+    ihdr[8] = 8;
+    ihdr[9] = image->format == FORMAT_GRAY8 ? PNG_COLOR_TYPE_GRAY : PNG_COLOR_TYPE_RGB_ALPHA;
+    ihdr[10] = PNG_COMPRESSION_TYPE_BASE;
+    ihdr[11] = PNG_FILTER_TYPE_BASE;
+    ihdr[12] = PNG_INTERLACE_NONE;
+
+    png_sink_write(sink, signature, sizeof(signature));
+    png_put_chunk(sink, "IHDR", ihdr, sizeof(ihdr));
+    if (srgb) {
+        const unsigned char intent = PNG_sRGB_INTENT_PERCEPTUAL;
+        png_put_chunk(sink, "sRGB", &intent, 1);
+    }
+
+    /* The zlib header, with the level hint zlib itself would use. */
+    unsigned char header[2] = { 0x78, 0 };
+    header[1] = (strategy >= Z_HUFFMAN_ONLY || level < 2 ? 0 :
+                 level < 6 ? 1 : level == 6 ? 2 : 3) << 6;
+    header[1] += 31 - (header[0] * 256 + header[1]) % 31;
+    png_put_chunk(sink, "IDAT", header, sizeof(header));
+
+    uLong check = adler[0];
+    size_t total = out_size[0];
+    for (size_t s = 1; s < strip_count; ++s) {
+        const size_t in_size = (s == strip_count - 1 ? image->height - s * strip_rows : strip_rows) * stride;
+        check = adler32_combine(check, adler[s], in_size);
+        total += out_size[s];
+    }
+    for (size_t s = 0; s < strip_count; ++s) {
+        png_put_chunk(sink, "IDAT", out[s], out_size[s]);
+        free(out[s]);
+    }
+    unsigned char trailer[4] = { check >> 24, check >> 16, check >> 8, check };
+    png_put_chunk(sink, "IDAT", trailer, sizeof(trailer));
+    png_put_chunk(sink, "IEND", NULL, 0);
+
+    free(adler);
+    free(out_size);
+    free(out);
+    free(filtered);
+    return 1;
 }
 
-image_t*
-png_read(
-    const char* filename)
+struct png_writer_t {
+    png_structp png_ptr;
+    png_infop info_ptr;
+    png_sink_t sink;
+    /* In parallel mode, the rows are collected here and compressed when
+     * the writer is closed. */
+    image_t image;
+    unsigned int row;
+    int default_level;
+    int default_filters;
+    int srgb;
+};
+
+static void
+png_writer_error_fn(
+    png_structp png_ptr,
+    png_const_charp message)
+{
+    (void)png_ptr;
+    fprintf(stderr, "%s: error encoding png: %s\n", argv0, message);
+    exit(1);
+}
+
+/* Starts an image for stream, or for memory when stream is NULL.
+ * default_level and default_filters (-1 for libpng's choice) apply where
+ * png_set_options left the setting alone. */
+static png_writer_t*
+png_writer_new(
+    unsigned int width,
+    unsigned int height,
+    format_t format,
+    int default_level,
+    int default_filters,
+    int srgb,
+    int parallel,
+    FILE* stream)
+{
+    png_writer_t* writer = calloc(1, sizeof(*writer));
+    const int level = png_level != -1 ? png_level : default_level;
+    const int filters = png_filters != -1 ? png_filters : default_filters;
+
+    writer->image.width = width;
+    writer->image.height = height;
+    writer->image.format = format;
+    writer->default_level = default_level;
+    writer->default_filters = default_filters;
+    writer->srgb = srgb;
+    writer->sink.stream = stream;
+
+    if (parallel) {
+        writer->image.data = malloc((size_t)width * height * (format == FORMAT_GRAY8 ? 1 : 4));
+        return writer;
+    }
+
+    writer->png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, writer, png_writer_error_fn, NULL);
+    png_set_compression_level(writer->png_ptr, level);
+    if (png_strategy != -1)
+        png_set_compression_strategy(writer->png_ptr, png_strategy);
+    if (filters != -1)
+        png_set_filter(writer->png_ptr, PNG_FILTER_TYPE_BASE, filters);
+    writer->info_ptr = png_create_info_struct(writer->png_ptr);
+    png_set_write_fn(writer->png_ptr, &writer->sink, png_sink_write_fn, png_sink_flush_fn);
+
+    png_set_IHDR(writer->png_ptr, writer->info_ptr,
+        width, height, 8,
+        format == FORMAT_GRAY8 ? PNG_COLOR_TYPE_GRAY : PNG_COLOR_TYPE_RGB_ALPHA,
+        PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    if (srgb)
+        png_set_sRGB(writer->png_ptr, writer->info_ptr, PNG_sRGB_INTENT_PERCEPTUAL);
+
+    png_write_info(writer->png_ptr, writer->info_ptr);
+    return writer;
+}
+
+png_writer_t*
+png_writer_open(
+    const char* filename,
+    unsigned int width,
+    unsigned int height,
+    format_t format)
+{
+    FILE* stream = fopen(filename, "wb");
+    if (!stream) {
+        fprintf(stderr, "%s: couldn't open %s for writing: %s\n",
+            argv0, filename, strerror(errno));
+        return NULL;
+    }
+    return png_writer_new(width, height, format, 1, -1, 0, png_parallel, stream);
+}
+
+png_writer_t*
+png_writer_open_mem(
+    unsigned int width,
+    unsigned int height)
+{
+    /* These match what libpng's simplified API wrote with
+     * PNG_IMAGE_FLAG_FAST, which png_write_mem used before. */
+    return png_writer_new(width, height, FORMAT_RGBA8888, 3, PNG_FILTER_NONE, 1, png_parallel, NULL);
+}
+
+void
+png_writer_write_row(
+    png_writer_t* writer,
+    const unsigned char* row)
+{
+    if (writer->row >= writer->image.height)
+        return;
+    if (writer->image.data) {
+        const size_t rowbytes = (size_t)writer->image.width * (writer->image.format == FORMAT_GRAY8 ? 1 : 4);
+        memcpy(writer->image.data + writer->row * rowbytes, row, rowbytes);
+    } else {
+        png_write_row(writer->png_ptr, row);
+    }
+    writer->row++;
+}
+
+void*
+png_writer_close(
+    png_writer_t* writer,
+    size_t* outsize)
 {
+    void* ret;
+
+    if (writer->image.data) {
+        const int level = png_level != -1 ? png_level : writer->default_level;
+        const int filters = png_filters != -1 ? png_filters : writer->default_filters;
+        /* libpng leaves the filters to adaptive selection, and picks the
+         * filtered strategy when it filters at all. */
+        const int strip_filters = filters != -1 ? filters : PNG_ALL_FILTERS;
+        const int strategy = png_strategy != -1 ? png_strategy :
+            strip_filters == PNG_FILTER_NONE ? Z_DEFAULT_STRATEGY : Z_FILTERED;
+        if (!png_encode_parallel(&writer->sink, &writer->image, level, strategy, strip_filters, writer->srgb)) {
+            /* Too small to split, so it goes through libpng after all. */
+            const size_t rowbytes = (size_t)writer->image.width * (writer->image.format == FORMAT_GRAY8 ? 1 : 4);
+            png_writer_t* serial = png_writer_new(writer->image.width, writer->image.height,
+                writer->image.format, writer->default_level, writer->default_filters, writer->srgb, 0,
+                writer->sink.stream);
+            for (unsigned int y = 0; y < writer->image.height; ++y)
+                png_writer_write_row(serial, writer->image.data + y * rowbytes);
+            free(writer->image.data);
+            free(writer);
+            return png_writer_close(serial, outsize);
+        }
+        free(writer->image.data);
+    } else {
+        png_write_end(writer->png_ptr, writer->info_ptr);
+        png_destroy_write_struct(&writer->png_ptr, &writer->info_ptr);
+    }
+
+    if (writer->sink.stream) {
+        fclose(writer->sink.stream);
+        ret = NULL;
+    } else {
+        ret = writer->sink.data;
+        if (outsize)
+            *outsize = writer->sink.size;
+    }
+    free(writer);
+    return ret;
+}
+
+struct png_reader_t {
+    png_structp png_ptr;
+    png_infop info_ptr;
     FILE* stream;
-    image_t* image;
+    const unsigned char* data;
+    size_t size;
+    size_t pos;
+    /* The file name for error messages, NULL for memory. */
+    const char* filename;
+    /* The whole image, for the files that can't be read a row at a
+     * time. */
+    unsigned char* image;
+    unsigned int width;
+    unsigned int height;
+    unsigned int row;
+};
+
+static void
+png_reader_error(
+    const png_reader_t* reader,
+    const char* message)
+{
+    if (reader->filename)
+        fprintf(stderr, "%s: error reading %s: %s\n", argv0, reader->filename, message);
+    else
+        fprintf(stderr, "%s: error decoding png: %s\n", argv0, message);
+    exit(1);
+}
+
+static void
+png_reader_error_fn(
+    png_structp png_ptr,
+    png_const_charp message)
+{
+    png_reader_error(png_get_error_ptr(png_ptr), message);
+}
+
+static void
+png_reader_warning_fn(
+    png_structp png_ptr,
+    png_const_charp message)
+{
+    (void)png_ptr;
+    (void)message;
+}
+
+static void
+png_reader_read_fn(
+    png_structp png_ptr,
+    png_bytep data,
+    png_size_t length)
+{
+    png_reader_t* reader = png_get_io_ptr(png_ptr);
+    if (reader->size - reader->pos < length)
+        png_error(png_ptr, "unexpected end of data");
+    memcpy(data, reader->data + reader->pos, length);
+    reader->pos += length;
+}
+
+/* Decodes the whole image with the simplified API, which also handles
+ * interlacing, 16-bit samples and gamma conversion. */
+static void
+png_reader_read_all(
+    png_reader_t* reader)
+{
     png_image png = {
         .version = PNG_IMAGE_VERSION,
         .opaque = NULL
     };
 
-    stream = fopen(filename, "rb");
-    if(!stream) {
+    if (reader->stream) {
+        if (fseek(reader->stream, 0, SEEK_SET))
+            png_reader_error(reader, strerror(errno));
+        png_image_begin_read_from_stdio(&png, reader->stream);
+    } else {
+        png_image_begin_read_from_memory(&png, reader->data, reader->size);
+    }
+    if (PNG_IMAGE_FAILED(png))
+        png_reader_error(reader, png.message);
+    png.format = PNG_FORMAT_RGBA;
+
+    reader->image = malloc(PNG_IMAGE_SIZE(png));
+    png_image_finish_read(&png, 0, reader->image, 0, NULL);
+    if (PNG_IMAGE_FAILED(png))
+        png_reader_error(reader, png.message);
+}
+
+static png_reader_t*
+png_reader_start(
+    png_reader_t* reader,
+    unsigned int* width,
+    unsigned int* height)
+{
+    png_uint_32 w, h;
+    int bit_depth, color_type, interlace;
+
+    reader->png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, reader,
+        png_reader_error_fn, png_reader_warning_fn);
+    reader->info_ptr = png_create_info_struct(reader->png_ptr);
+    if (reader->stream)
+        png_init_io(reader->png_ptr, reader->stream);
+    else
+        png_set_read_fn(reader->png_ptr, reader, png_reader_read_fn);
+
+    png_read_info(reader->png_ptr, reader->info_ptr);
+    png_get_IHDR(reader->png_ptr, reader->info_ptr, &w, &h, &bit_depth, &color_type,
+        &interlace, NULL, NULL);
+    reader->width = *width = w;
+    reader->height = *height = h;
+
+    /* Everything else is left to the simplified API, so that the pixels
+     * come out exactly as png_image_finish_read gives them. */
+    if (interlace != PNG_INTERLACE_NONE || bit_depth == 16 ||
+            (png_get_valid(reader->png_ptr, reader->info_ptr, PNG_INFO_gAMA | PNG_INFO_cHRM | PNG_INFO_iCCP) &&
+             !png_get_valid(reader->png_ptr, reader->info_ptr, PNG_INFO_sRGB))) {
+        png_destroy_read_struct(&reader->png_ptr, &reader->info_ptr, NULL);
+        png_reader_read_all(reader);
+        return reader;
+    }
+
+    if (color_type == PNG_COLOR_TYPE_PALETTE)
+        png_set_palette_to_rgb(reader->png_ptr);
+    if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
+        png_set_expand_gray_1_2_4_to_8(reader->png_ptr);
+    if (png_get_valid(reader->png_ptr, reader->info_ptr, PNG_INFO_tRNS))
+        png_set_tRNS_to_alpha(reader->png_ptr);
+    if (!(color_type & PNG_COLOR_MASK_COLOR))
+        png_set_gray_to_rgb(reader->png_ptr);
+    png_set_add_alpha(reader->png_ptr, 0xff, PNG_FILLER_AFTER);
+    png_read_update_info(reader->png_ptr, reader->info_ptr);
+
+    if (png_get_rowbytes(reader->png_ptr, reader->info_ptr) != (size_t)w * 4)
+        png_reader_error(reader, "unsupported format");
+
+    return reader;
+}
+
+png_reader_t*
+png_reader_open(
+    const char* filename,
+    unsigned int* width,
+    unsigned int* height)
+{
+    png_reader_t* reader = calloc(1, sizeof(*reader));
+    reader->filename = filename;
+    reader->stream = fopen(filename, "rb");
+    if (!reader->stream) {
         fprintf(stderr, "%s: couldn't open %s for reading: %s\n",
             argv0, filename, strerror(errno));
         exit(1);
     }
+    return png_reader_start(reader, width, height);
+}
 
-#define ERR_WRAP(x) \
-    x; \
-    if(PNG_IMAGE_FAILED(png)) { \
-        fprintf(stderr, "%s: error reading %s: %s\n", \
-            argv0, filename, png.message); \
-        exit(1); \
-    }
+png_reader_t*
+png_reader_open_mem(
+    const void* data,
+    size_t size,
+    unsigned int* width,
+    unsigned int* height)
+{
+    png_reader_t* reader = calloc(1, sizeof(*reader));
+    reader->data = data;
+    reader->size = size;
+    return png_reader_start(reader, width, height);
+}
 
-    ERR_WRAP(png_image_begin_read_from_stdio(&png, stream));
-    png.format = PNG_FORMAT_RGBA;
+void
+png_reader_read_row(
+    png_reader_t* reader,
+    uint32_t* row)
+{
+    if (reader->row >= reader->height)
+        return;
+    if (reader->image)
+        memcpy(row, reader->image + (size_t)reader->row * reader->width * 4, (size_t)reader->width * 4);
+    else
+        png_read_row(reader->png_ptr, (png_bytep)row, NULL);
+    reader->row++;
+}
+
+void
+png_reader_close(
+    png_reader_t* reader)
+{
+    if (reader->png_ptr)
+        png_destroy_read_struct(&reader->png_ptr, &reader->info_ptr, NULL);
+    if (reader->stream)
+        fclose(reader->stream);
+    free(reader->image);
+    free(reader);
+}
 
-    image = malloc(sizeof(image_t));
-    image->width = png.width;
-    image->height = png.height;
+static void
+png_reader_read_image(
+    png_reader_t* reader,
+    image_t* image)
+{
     image->format = FORMAT_RGBA8888;
-    image->data = malloc(PNG_IMAGE_SIZE(png));
+    image->data = malloc((size_t)image->width * image->height * 4);
+    for (unsigned int y = 0; y < image->height; ++y)
+        png_reader_read_row(reader, (uint32_t*)image->data + (size_t)y * image->width);
+    png_reader_close(reader);
+}
 
-    ERR_WRAP(png_image_finish_read(&png, 0, image->data, 0, NULL));
-    fclose(stream);
+void
+png_read_mem(
+    image_t *image,
+    void *data,
+    size_t len)
+{
+    png_reader_read_image(png_reader_open_mem(data, len, &image->width, &image->height), image);
+}
 
-#undef ERR_WRAP
+void *
+png_write_mem(
+    image_t *image,
+    size_t *outsize)
+{
+    png_writer_t* writer = png_writer_open_mem(image->width, image->height);
+    for (unsigned int y = 0; y < image->height; ++y)
+        png_writer_write_row(writer, image->data + (size_t)y * image->width * 4);
+    return png_writer_close(writer, outsize);
+}
 
+image_t*
+png_read(
+    const char* filename)
+{
+    image_t* image = malloc(sizeof(image_t));
+    png_reader_read_image(png_reader_open(filename, &image->width, &image->height), image);
     return image;
 }
 
@@ -288,52 +1168,12 @@ png_write(
     const char* filename,
     image_t* image)
 {
-    FILE* stream;
-    png_structp png_ptr;
-    png_infop info_ptr;
-    png_bytepp imagep;
-
-    int bit_depth;
-    int color_type;
-    int bytes_per_pixel;
-
-    stream = fopen(filename, "wb");
-    if(!stream) {
-        fprintf(stderr, "%s: couldn't open %s for writing: %s\n",
-            argv0, filename, strerror(errno));
+    const unsigned int bytes_per_pixel = image->format == FORMAT_GRAY8 ? 1 : 4;
+    png_writer_t* writer = png_writer_open(filename, image->width, image->height, image->format);
+    if (!writer)
         return;
-    }
-
-    if (image->format == FORMAT_GRAY8) {
-        bit_depth = 8;
-        color_type = PNG_COLOR_TYPE_GRAY;
-        bytes_per_pixel = 1;
-    } else /* if (image->format == FORMAT_RGBA8888) */ {
-        bit_depth = 8;
-        color_type = PNG_COLOR_TYPE_RGB_ALPHA;
-        bytes_per_pixel = 4;
-    } /* else { abort(); } */
-
-    png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    png_set_compression_level(png_ptr, 1);
-    info_ptr = png_create_info_struct(png_ptr);
-    png_init_io(png_ptr, stream);
-
-    png_set_IHDR(png_ptr, info_ptr,
-        image->width, image->height, bit_depth, color_type,
-        PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-
-    png_write_info(png_ptr, info_ptr);
-
-    imagep = malloc(image->height * sizeof(png_byte*));
     for (unsigned int y = 0; y < image->height; ++y)
-        imagep[y] = (png_byte*)(image->data + y * image->width * bytes_per_pixel);
-
-    png_write_image(png_ptr, imagep);
-    free(imagep);
-    png_write_end(png_ptr, info_ptr);
-    png_destroy_write_struct(&png_ptr, &info_ptr);
-
-    fclose(stream);
+        png_writer_write_row(writer, image->data + (size_t)y * image->width * bytes_per_pixel);
+    png_writer_close(writer, NULL);
 }
 #endif
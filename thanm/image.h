@@ -46,12 +46,31 @@ format_from_rgba(
     unsigned int pixels,
     format_t format);
 
+/* Converts the width*height rectangle starting at data, whose rows are
+ * stride pixels apart, to rows of width pixels in out. */
+void
+format_from_rgba_rect(
+    const uint32_t* data,
+    unsigned int stride,
+    unsigned int width,
+    unsigned int height,
+    format_t format,
+    unsigned char* out);
+
 unsigned char*
 format_to_rgba(
     const unsigned char* data,
     unsigned int pixels,
     format_t format);
 
+/* Converts pixels into out, which has room for them. */
+void
+format_to_rgba_to(
+    const unsigned char* data,
+    unsigned int pixels,
+    format_t format,
+    uint32_t* out);
+
 typedef struct {
     unsigned char* data;
     unsigned int width;
@@ -59,6 +78,76 @@ typedef struct {
     format_t format;
 } image_t;
 
+/* Parses a comma-separated list of PNG writer settings: a zlib level from
+ * 0 to 9, a strategy (default, filtered, huffman, rle or fixed), any of the
+ * row filters none, sub, up, avg, paeth or all, and parallel to deflate
+ * strips of large images on several threads.  Returns 0 on an unknown
+ * setting. */
+int
+png_set_options(
+    const char* spec);
+
+/* Reads a PNG a row at a time, as RGBA8888.  Only the row being decoded is
+ * kept in memory, except for interlaced, 16-bit and gamma-corrected files,
+ * which are decoded whole.  Errors end the program. */
+typedef struct png_reader_t png_reader_t;
+
+png_reader_t*
+png_reader_open(
+    const char* filename,
+    unsigned int* width,
+    unsigned int* height);
+
+png_reader_t*
+png_reader_open_mem(
+    const void* data,
+    size_t size,
+    unsigned int* width,
+    unsigned int* height);
+
+/* Reads the next row into row, which has room for width pixels.  Rows past
+ * the end are ignored. */
+void
+png_reader_read_row(
+    png_reader_t* reader,
+    uint32_t* row);
+
+void
+png_reader_close(
+    png_reader_t* reader);
+
+/* Writes a PNG a row at a time, with the settings from png_set_options.
+ * With the parallel setting the rows are kept until the writer is
+ * closed. */
+typedef struct png_writer_t png_writer_t;
+
+/* Writes an RGBA8888 or GRAY8 image to a file.  Returns NULL after printing
+ * a message when the file can't be created. */
+png_writer_t*
+png_writer_open(
+    const char* filename,
+    unsigned int width,
+    unsigned int height,
+    format_t format);
+
+/* Writes an RGBA8888 image to memory, as png_write_mem does. */
+png_writer_t*
+png_writer_open_mem(
+    unsigned int width,
+    unsigned int height);
+
+void
+png_writer_write_row(
+    png_writer_t* writer,
+    const unsigned char* row);
+
+/* Finishes the image.  Returns the encoded data of a memory writer, and
+ * stores its size in outsize, or NULL for a file. */
+void*
+png_writer_close(
+    png_writer_t* writer,
+    size_t* outsize);
+
 void
 png_read_mem(
     image_t *image,
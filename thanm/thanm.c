@@ -42,6 +42,8 @@
 #include "value.h"
 #include "mygetopt.h"
 #include "reg.h"
+#include "cache.h"
+#include "datpath.h"
 
 #define TH19_OR_NEWER(version) (version >= 19 && (version < 100 || version >= 200))
 
@@ -51,6 +53,7 @@ unsigned int option_print_offsets = 0;
 unsigned int option_unique_filenames = 0;
 unsigned int option_dont_add_offset_border = 0;
 unsigned int option_verbose = 0;
+unsigned int option_cache = 0;
 
 /* SPECIAL FORMATS:
  * 'o' - offset (for labels)
@@ -713,22 +716,155 @@ anm_find_format(
     return format;
 }
 
+/* Open addressing hash table keyed by entry names.  It grows as needed, and
+ * a slot with a NULL name is free. */
+typedef struct {
+    size_t hash;
+    const char* name;
+    /* The last entry with this name seen so far. */
+    anm_entry_t* tail;
+} anm_name_slot_t;
+
+typedef struct {
+    size_t size;
+    size_t used;
+    anm_name_slot_t* slots;
+} anm_name_table_t;
+
+static size_t
+anm_name_hash(
+    const char* name)
+{
+    uint32_t hash = 0x811c9dc5;
+    for (; *name; ++name) {
+        hash ^= (unsigned char)*name;
+        hash *= 0x01000193;
+    }
+    return hash;
+}
+
+static anm_name_slot_t*
+anm_name_table_find(
+    anm_name_slot_t* slots,
+    size_t size,
+    size_t hash,
+    const char* name)
+{
+    for (size_t i = hash & (size - 1);; i = (i + 1) & (size - 1)) {
+        anm_name_slot_t* slot = &slots[i];
+        if (!slot->name || (slot->hash == hash && strcmp(slot->name, name) == 0))
+            return slot;
+    }
+}
+
+/* Returns the slot for name.  If the name isn't in the table yet, the slot
+ * is free and the caller has to set its name before the next call. */
+static anm_name_slot_t*
+anm_name_table_get(
+    anm_name_table_t* table,
+    const char* name)
+{
+    if ((table->used + 1) * 2 > table->size) {
+        const size_t size = table->size ? table->size * 2 : 64;
+        anm_name_slot_t* slots = calloc(size, sizeof(*slots));
+        for (size_t i = 0; i < table->size; ++i) {
+            if (table->slots[i].name)
+                *anm_name_table_find(slots, size, table->slots[i].hash, table->slots[i].name) = table->slots[i];
+        }
+        free(table->slots);
+        table->slots = slots;
+        table->size = size;
+    }
+
+    const size_t hash = anm_name_hash(name);
+    anm_name_slot_t* slot = anm_name_table_find(table->slots, table->size, hash, name);
+    if (!slot->name) {
+        slot->hash = hash;
+        slot->tail = NULL;
+        table->used++;
+    }
+    return slot;
+}
+
+static void
+anm_name_table_free(
+    anm_name_table_t* table)
+{
+    free(table->slots);
+}
+
 static char*
 anm_get_name(
     anm_archive_t* archive,
+    anm_name_table_t* names,
     const char* name)
 {
-    char* other_name;
-    list_for_each(&archive->names, other_name) {
-        if (strcmp(name, other_name) == 0)
-            return other_name;
-    }
+    anm_name_slot_t* slot = anm_name_table_get(names, name);
+    if (slot->name)
+        return (char*)slot->name;
 
-    other_name = strdup(name);
+    char* other_name = strdup(name);
     list_append_new(&archive->names, other_name);
+    slot->name = other_name;
     return other_name;
 }
 
+/* Most scripts fit in a single block. */
+#define ANM_ARENA_BLOCK_SIZE 65536
+/* Enough for value_t. */
+#define ANM_ARENA_ALIGN 8
+
+struct anm_arena_block_t {
+    anm_arena_block_t* next;
+    size_t size;
+    size_t used;
+    unsigned char data[];
+};
+
+static void*
+anm_arena_alloc(
+    anm_archive_t* anm,
+    size_t size)
+{
+    anm_arena_block_t* block = anm->arena;
+    size_t pad = block ? -(uintptr_t)(block->data + block->used) & (ANM_ARENA_ALIGN - 1) : 0;
+    if (!block || block->size - block->used < pad + size) {
+        const size_t block_size = (size > ANM_ARENA_BLOCK_SIZE ? size : ANM_ARENA_BLOCK_SIZE) + ANM_ARENA_ALIGN - 1;
+        block = util_malloc(sizeof(*block) + block_size);
+        block->size = block_size;
+        block->used = 0;
+        block->next = anm->arena;
+        anm->arena = block;
+        pad = -(uintptr_t)block->data & (ANM_ARENA_ALIGN - 1);
+    }
+    unsigned char* ret = block->data + block->used + pad;
+    block->used += pad + size;
+    return ret;
+}
+
+static list_node_t*
+anm_arena_node(
+    anm_archive_t* anm,
+    void* data)
+{
+    list_node_t* node = anm_arena_alloc(anm, sizeof(*node));
+    node->next = NULL;
+    node->prev = NULL;
+    node->data = data;
+    return node;
+}
+
+static void
+anm_arena_free(
+    anm_archive_t* anm)
+{
+    while (anm->arena) {
+        anm_arena_block_t* next = anm->arena->next;
+        free(anm->arena);
+        anm->arena = next;
+    }
+}
+
 thanm_param_t*
 thanm_param_new(
     int type
@@ -752,8 +888,11 @@ thanm_param_free(
     free(param);
 }
 
+/* The format tables only use fixed-size types, so the values never own
+ * memory outside the arena. */
 static void
 thanm_make_params(
+    anm_archive_t* anm,
     anm_instr_t* raw_instr,
     list_t* param_list,
     const char* format
@@ -761,7 +900,7 @@ thanm_make_params(
     size_t i = 0;
     size_t v = 0;
     while(i < raw_instr->length - sizeof(anm_instr_t)) {
-        value_t* value = (value_t*)malloc(sizeof(value_t));
+        value_t* value = anm_arena_alloc(anm, sizeof(value_t));
         ssize_t read;
         char c = format ? format[v] : 'S';
         switch(c) {
@@ -789,14 +928,13 @@ thanm_make_params(
         }
 
         i += read;
-        thanm_param_t* param = thanm_param_new(c);
-        if (raw_instr->param_mask & 1 << v) {
-            param->is_var = 1;
-        }
-
+        thanm_param_t* param = anm_arena_alloc(anm, sizeof(*param));
+        param->type = c;
+        param->is_var = (raw_instr->param_mask & 1 << v) != 0;
+        param->expr = NULL;
         param->val = value;
 
-        list_append_new(param_list, param);
+        list_append(param_list, anm_arena_node(anm, param));
         ++v;
     }
 }
@@ -944,26 +1082,39 @@ instr_new(
     return instr;
 }
 
+/* The instructions below are only created by anm_read_file, and live in the
+ * archive's arena. */
+static thanm_instr_t*
+thanm_instr_new_arena(
+    anm_archive_t* anm
+) {
+    thanm_instr_t* ret = anm_arena_alloc(anm, sizeof(thanm_instr_t));
+    list_init(&ret->params);
+    return ret;
+}
+
 static thanm_instr_t*
 thanm_instr_new_raw(
+    anm_archive_t* anm,
     anm_instr_t* raw_instr,
     const char* format
 ) {
-    thanm_instr_t* ret = thanm_instr_new();
+    thanm_instr_t* ret = thanm_instr_new_arena(anm);
     ret->type = THANM_INSTR_INSTR;
     ret->time = raw_instr->time;
     ret->id = raw_instr->type;
     ret->size = raw_instr->length;
     ret->param_mask = raw_instr->param_mask;
-    thanm_make_params(raw_instr, &ret->params, format);
+    thanm_make_params(anm, raw_instr, &ret->params, format);
     return ret;
 }
 
 static thanm_instr_t*
 thanm_instr_new_time(
+    anm_archive_t* anm,
     int16_t time
 ) {
-    thanm_instr_t* ret = thanm_instr_new();
+    thanm_instr_t* ret = thanm_instr_new_arena(anm);
     ret->type = THANM_INSTR_TIME;
     ret->time = time;
     ret->id = -1;
@@ -971,8 +1122,10 @@ thanm_instr_new_time(
 }
 
 static thanm_instr_t*
-thanm_instr_new_label() {
-    thanm_instr_t* ret = thanm_instr_new();
+thanm_instr_new_label(
+    anm_archive_t* anm
+) {
+    thanm_instr_t* ret = thanm_instr_new_arena(anm);
     ret->type = THANM_INSTR_LABEL;
     ret->time = 0;
     ret->id = -1;
@@ -993,6 +1146,7 @@ thanm_instr_free(
 
 static void
 anm_insert_labels(
+    anm_archive_t* anm,
     anm_script_t* script,
     int32_t scriptn
 ) {
@@ -1019,9 +1173,9 @@ anm_insert_labels(
                         search_instr = iter_instr;
                         instr_node = node;
                         if (search_instr-> type == THANM_INSTR_INSTR && search_instr->offset == offset) {
-                            thanm_instr_t* instr_label = thanm_instr_new_label();
+                            thanm_instr_t* instr_label = thanm_instr_new_label(anm);
                             instr_label->offset = offset;
-                            list_prepend_to(&script->instrs, instr_label, instr_node);
+                            list_prepend_node_to(&script->instrs, anm_arena_node(anm, instr_label), instr_node);
                             break;
                         }
                     }
@@ -1029,21 +1183,28 @@ anm_insert_labels(
                 /* There is a possibility that the label has to be inserted after the last instruction,
                  * and we can know that we need to do that if the loop didn't end with a break (when node is NULL) */
                 if (node == NULL && search_instr->offset + search_instr->size == offset) {
-                    thanm_instr_t* instr_label = thanm_instr_new_label();
+                    thanm_instr_t* instr_label = thanm_instr_new_label(anm);
                     instr_label->offset = offset;
-                    list_append_to(&script->instrs, instr_label, instr_node);
+                    list_append_node_to(&script->instrs, anm_arena_node(anm, instr_label), instr_node);
                 }
             }
         }
     }
 }
 
+/* Reads the named archive, which can also be inside a .dat archive.  Exits
+ * upon error. */
 static anm_archive_t*
 anm_read_file(
-    FILE* in,
+    const char* filename,
     unsigned version)
 {
     anm_archive_t* archive = malloc(sizeof(*archive));
+    anm_name_table_t names = { 0, 0, NULL };
+    /* Version 0 instructions are widened into this buffer. */
+    anm_instr_t* instr0_buf = NULL;
+    size_t instr0_size = 0;
+    archive->arena = NULL;
     list_init(&archive->names);
     list_init(&archive->entries);
 
@@ -1051,8 +1212,10 @@ anm_read_file(
     unsigned char* map_base;
     unsigned char* map;
 
-    archive->map_size = file_size = file_fsize(in);
-    archive->map = map_base = file_mmap(in, file_size);
+    archive->map = map_base = datpath_map(filename, version, &file_size);
+    if (!map_base)
+        exit(1);
+    archive->map_size = file_size;
     map = map_base;
 
     int32_t scriptn = 0;
@@ -1095,7 +1258,7 @@ anm_read_file(
         assert(TH19_OR_NEWER(version) || header->jpeg_quality == 0);
 
         /* Lengths, including padding, observed are: 16, 32, 48. */
-        entry->name = anm_get_name(archive, (const char*)map + header->nameoffset);
+        entry->name = anm_get_name(archive, &names, (const char*)map + header->nameoffset);
         if (header->version == 0 && header->y != 0)
             entry->name2 = (char*)map + header->y;
 
@@ -1146,7 +1309,11 @@ anm_read_file(
                         if (temp_instr->type == 0 && temp_instr->time == 0)
                             break;
 
-                        instr = util_malloc(sizeof(anm_instr_t) + temp_instr->length);
+                        if (instr0_size < sizeof(anm_instr_t) + temp_instr->length) {
+                            instr0_size = sizeof(anm_instr_t) + temp_instr->length;
+                            instr0_buf = realloc(instr0_buf, instr0_size);
+                        }
+                        instr = instr0_buf;
                         instr->type = temp_instr->type;
                         instr->length = sizeof(anm_instr_t) + temp_instr->length;
                         instr->time = temp_instr->time;
@@ -1169,8 +1336,8 @@ anm_read_file(
                     }
 
                     if (instr->time != time) {
-                        thanm_instr_t* time_instr = thanm_instr_new_time(instr->time);
-                        list_append_new(&script->instrs, time_instr);
+                        thanm_instr_t* time_instr = thanm_instr_new_time(archive, instr->time);
+                        list_append(&script->instrs, anm_arena_node(archive, time_instr));
                         time = instr->time;
                     }
 
@@ -1184,18 +1351,15 @@ anm_read_file(
                         fprintf(stderr, "\n");
 #endif
                     }
-                    thanm_instr_t* thanm_instr = thanm_instr_new_raw(instr, format);
+                    thanm_instr_t* thanm_instr = thanm_instr_new_raw(archive, instr, format);
                     thanm_instr->offset = (uint32_t)((ptrdiff_t)instr_ptr - (ptrdiff_t)(map + script->offset->offset));
                     thanm_instr->address = (ptrdiff_t)instr_ptr - (ptrdiff_t)map_base;
-                    list_append_new(&script->instrs, thanm_instr);
-
-                    if (header->version == 0)
-                        free(instr);
+                    list_append(&script->instrs, anm_arena_node(archive, thanm_instr));
 
                     instr_ptr += len;
                 }
 
-                anm_insert_labels(script, scriptn);
+                anm_insert_labels(archive, script, scriptn);
                 list_append_new(&entry->scripts, script);
                 ++scriptn;
             }
@@ -1223,6 +1387,8 @@ anm_read_file(
         map = map + header->nextoffset;
     }
 
+    free(instr0_buf);
+    anm_name_table_free(&names);
     return archive;
 }
 
@@ -1270,8 +1436,11 @@ anm_make_unique_filename(
         p = name + strlen(name);
     namepfx = p - name;
 
-    /* get basename of the anm file ("dir/file.anm" -> "file") */
+    /* get basename of the anm file ("dir/file.anm" -> "file"), which may be
+     * inside a .dat archive ("th13.dat:file.anm" -> "file") */
     anmname = util_shortname(anmname);
+    if ((p = strrchr(anmname, ':')))
+        anmname = p + 1;
     if (!(p = strrchr(anmname, '.')))
         p = anmname + strlen(anmname);
     anmnamepfx = p - anmname;
@@ -1442,43 +1611,41 @@ util_entry_by_name(
     return rv;
 }
 
+/* Links every entry to the next one with the same name, using a table of
+ * the last entry seen for each name. */
+static void
+anm_link_names(
+    anm_name_table_t* table,
+    const anm_archive_t* anm)
+{
+    anm_entry_t *entry;
+    list_for_each(&anm->entries, entry) {
+        anm_name_slot_t* slot = anm_name_table_get(table, entry->name);
+        if (slot->name)
+            slot->tail->next_by_name = entry;
+        slot->name = entry->name;
+        slot->tail = entry;
+    }
+}
+
 static void
 anm_build_name_lists(
     const anm_archive_t *anm)
 {
-    const char *name;
-    anm_entry_t *entry, *tmp, **nextloc;
-    list_for_each(&anm->names, name) {
-        nextloc = &tmp;
-        list_for_each(&anm->entries, entry)
-            if (entry->name == name) {
-                *nextloc = entry;
-                nextloc = &entry->next_by_name;
-            }
-    }
+    anm_name_table_t table = { 0, 0, NULL };
+    anm_link_names(&table, anm);
+    anm_name_table_free(&table);
 }
 
 static void
 anm_build_name_lists_multiple(
     list_t *anms)
 {
-    const anm_archive_t *anm, *anm2;
-    const char *name;
-    anm_entry_t *entry, *tmp, **nextloc;
+    const anm_archive_t *anm;
+    anm_name_table_t table = { 0, 0, NULL };
     list_for_each(anms, anm)
-        list_for_each(&anm->names, name) {
-            nextloc = &tmp;
-            list_for_each(anms, anm2)
-                list_for_each(&anm2->entries, entry)
-                    if (entry->name == name || !strcmp(name, entry->name)) {
-                        name = entry->name;
-                        if (entry->next_by_name)
-                            goto next_name; /* we already did this name */
-                        *nextloc = entry;
-                        nextloc = &entry->next_by_name;
-                    }
-            next_name:;
-        }
+        anm_link_names(&table, anm);
+    anm_name_table_free(&table);
 }
 
 static void
@@ -1506,6 +1673,128 @@ util_total_entry_size(
     *heightptr = height;
 }
 
+/* One entry that anm_replace converts a row at a time. */
+typedef struct {
+    anm_entry_t* entry;
+    format_t format;
+    uint32_t ox;
+    uint32_t oy;
+    /* The offset of the entry in the archive, for -r. */
+    long offset;
+    unsigned char* out;
+    png_writer_t* writer;
+} anm_target_t;
+
+/* The textures converted by -c, when -k is given. */
+static anm_cache_t* anm_cache = NULL;
+/* Identifies the -z settings, which change the PNGs made for TH19. */
+static uint64_t png_settings_hash = ANM_CACHE_HASH_INIT;
+
+static uint64_t
+anm_cache_hash_u32(
+    uint64_t hash,
+    uint32_t value)
+{
+    return anm_cache_hash(hash, &value, sizeof(value));
+}
+
+/* Makes the cache key for converting an image into targets.  The image is
+ * the data of source for TH19, and the named file otherwise. */
+static int
+anm_cache_make_key(
+    anm_cache_key_t* key,
+    const anm_target_t* targets,
+    size_t target_count,
+    const anm_entry_t* source,
+    const char* filename,
+    unsigned int version)
+{
+    if (source) {
+        key->source_hash = anm_cache_hash(ANM_CACHE_HASH_INIT, source->data, source->thtx->size);
+        key->source_size = source->thtx->size;
+    } else if (!anm_cache_hash_file(filename, key)) {
+        return 0;
+    }
+
+    uint64_t hash = ANM_CACHE_HASH_INIT;
+    hash = anm_cache_hash_u32(hash, version);
+    hash = anm_cache_hash(hash, &png_settings_hash, sizeof(png_settings_hash));
+    for (size_t t = 0; t < target_count; ++t) {
+        const anm_target_t* target = &targets[t];
+        hash = anm_cache_hash_u32(hash, target->format);
+        hash = anm_cache_hash_u32(hash, target->ox);
+        hash = anm_cache_hash_u32(hash, target->oy);
+        hash = anm_cache_hash_u32(hash, target->entry->thtx->w);
+        hash = anm_cache_hash_u32(hash, target->entry->thtx->h);
+    }
+    key->params_hash = hash;
+    return 1;
+}
+
+/* Fills the targets from the cache, returns 0 if they aren't in it. */
+static int
+anm_replace_cached(
+    anm_target_t* targets,
+    size_t target_count,
+    const anm_cache_key_t* key,
+    int is_png)
+{
+    const unsigned char** data = malloc(target_count * sizeof(*data));
+    uint32_t* sizes = malloc(target_count * sizeof(*sizes));
+    size_t t;
+    int ret = 0;
+
+    if (!anm_cache_lookup(anm_cache, key, target_count, data, sizes))
+        goto done;
+    if (!is_png) {
+        for (t = 0; t < target_count; ++t) {
+            const thtx_header_t* thtx = targets[t].entry->thtx;
+            if (sizes[t] != (size_t)thtx->w * thtx->h * format_Bpp(targets[t].format))
+                goto done;
+        }
+    }
+
+    for (t = 0; t < target_count; ++t) {
+        anm_entry_t* entry = targets[t].entry;
+        if (is_png) {
+            free(entry->data);
+            entry->data = malloc(sizes[t]);
+            entry->thtx->size = sizes[t];
+        }
+        memcpy(entry->data, data[t], sizes[t]);
+        entry->processed = 1;
+    }
+    ret = 1;
+
+done:
+    free(data);
+    free(sizes);
+    return ret;
+}
+
+/* Adds the converted targets to the cache. */
+static void
+anm_replace_store(
+    const anm_target_t* targets,
+    size_t target_count,
+    const anm_cache_key_t* key,
+    int is_png)
+{
+    const unsigned char** data = malloc(target_count * sizeof(*data));
+    uint32_t* sizes = malloc(target_count * sizeof(*sizes));
+
+    for (size_t t = 0; t < target_count; ++t) {
+        const anm_entry_t* entry = targets[t].entry;
+        data[t] = entry->data;
+        sizes[t] = is_png ? entry->thtx->size :
+            entry->thtx->w * entry->thtx->h * format_Bpp(targets[t].format);
+    }
+    anm_cache_store(anm_cache, key, target_count, data, sizes);
+
+    free(data);
+    free(sizes);
+}
+
 static void
 anm_replace(
     anm_archive_t* anm,
@@ -1524,7 +1813,9 @@ anm_replace(
     unsigned int f;
     unsigned int width = 0;
     unsigned int height = 0;
-    image_t* image;
+    unsigned int image_width;
+    unsigned int image_height;
+    png_reader_t* reader;
 
     util_total_entry_size(entry_first, &width, &height);
     if (width == 0 || height == 0) {
@@ -1551,104 +1842,139 @@ anm_replace(
         }
         if (option_verbose >= 2)
             fprintf(stderr, "%s: composing %s\n", argv0, filename);
-        image = malloc(sizeof(image_t));
-        png_read_mem(image, entry->data, entry->thtx->size);
         is_png = 1;
-    } else {
-        image = png_read(filename);
     }
 
-    if (width > image->width || height > image->height) {
+    size_t target_count = 0;
+    anm_entry_t *entry, *entry_next = entry_first;
+    for (entry = entry_first; entry; entry = entry->next_by_name)
+        ++target_count;
+    anm_target_t* targets = calloc(target_count, sizeof(*targets));
+    target_count = 0;
+
+    long offset = 0;
+    list_for_each(&anm->entries, entry) {
+        if (entry == entry_next &&
+            entry->header->hasdata) {
+            for (f = 0; f < sizeof(formats) / sizeof(formats[0]); ++f)
+                if (entry->thtx->format == formats[f])
+                    break;
+            if (f == sizeof(formats) / sizeof(formats[0]))
+                goto next;
+
+            anm_target_t* target = &targets[target_count++];
+            target->entry = entry;
+            target->format = formats[f];
+            target->ox = option_dont_add_offset_border ? 0 : entry->header->x;
+            target->oy = option_dont_add_offset_border ? 0 : entry->header->y;
+            target->offset = offset;
+
+            if (is_png && target->format != FORMAT_BGRA8888) {
+                fprintf(stderr, "%s: %s is not FORMAT_BGRA8888\n", argv0, entry->name);
+                exit(1);
+            }
+        }
+next:
+        if (entry == entry_next)
+            entry_next = entry->next_by_name;
+
+        offset += entry->header->nextoffset;
+    }
+
+    anm_cache_key_t key;
+    const int use_cache = anm_cache && !anmfp &&
+        anm_cache_make_key(&key, targets, target_count, is_png ? entry_first : NULL, filename, version);
+    if (use_cache && anm_replace_cached(targets, target_count, &key, is_png)) {
+        if (option_verbose >= 2)
+            fprintf(stderr, "%s: using cached textures for %s\n", argv0, filename);
+        free(targets);
+        return;
+    }
+
+    if (is_png)
+        reader = png_reader_open_mem(entry_first->data, entry_first->thtx->size, &image_width, &image_height);
+    else
+        reader = png_reader_open(filename, &image_width, &image_height);
+
+    if (width > image_width || height > image_height) {
         fprintf(stderr,
             "%s:%s:%s: wrong image dimensions for %s: %u, %u instead of %u, %u\n",
-            argv0, current_input, entry_first->name, filename, image->width, image->height,
+            argv0, current_input, entry_first->name, filename, image_width, image_height,
             width, height);
         exit(1);
     }
 
-    for (f = 0; f < sizeof(formats) / sizeof(formats[0]); ++f) {
-        long offset = 0;
-        anm_entry_t *entry, *entry_next = entry_first;
-        list_for_each(&anm->entries, entry) {
-            if (entry == entry_next &&
-                entry->thtx->format == formats[f] &&
-                entry->header->hasdata) {
-                unsigned int y;
-                format_t fmt = formats[f];
-
-                if (is_png) {
-                    if (fmt != FORMAT_BGRA8888) {
-                        fprintf(stderr, "%s: %s is not FORMAT_BGRA8888\n", argv0, entry->name);
-                        exit(1);
-                    }
-                    fmt = FORMAT_RGBA8888;
-                    entry->thtx->size = entry->thtx->w*entry->thtx->h*4;
-                    free(entry->data);
-                    entry->data = malloc(entry->thtx->size);
-                }
-
-                unsigned char* converted_data = format_from_rgba((uint32_t*)image->data, width * height, fmt);
-                const uint32_t ox = option_dont_add_offset_border ? 0 : entry->header->x;
-                const uint32_t oy = option_dont_add_offset_border ? 0 : entry->header->y;
-
-                if (anmfp) {
-                    for (y = oy; y < oy + entry->thtx->h; ++y) {
-                        if (!file_seek(anmfp,
-                            offset + entry->header->thtxoffset + sizeof(thtx_header_t) + (y - oy) * entry->thtx->w * format_Bpp(fmt)))
-                            exit(1);
-                        if (!file_write(anmfp, converted_data + y * width * format_Bpp(fmt) + ox * format_Bpp(fmt), entry->thtx->w * format_Bpp(fmt)))
-                            exit(1);
-                    }
-                } else {
-                    for (y = oy; y < oy + entry->thtx->h; ++y) {
-                        memcpy(entry->data + (y - oy) * entry->thtx->w * format_Bpp(fmt),
-                               converted_data + y * width * format_Bpp(fmt) + ox * format_Bpp(fmt),
-                               entry->thtx->w * format_Bpp(fmt));
-                    }
-                }
-
-                free(converted_data);
-
-                if (is_png) {
-                    image_t image2 = {
-                        .data = entry->data,
-                        .width = entry->thtx->w,
-                        .height = entry->thtx->h,
-                        .format = FORMAT_RGBA8888,
-                    };
-                    size_t size;
-                    entry->data = png_write_mem(&image2, &size);
-                    entry->thtx->size = size;
-                    free(image2.data);
-                }
+    /* The image is read a row at a time, and each row is converted into
+     * the rectangles of the entries it crosses: straight into the entry's
+     * data, into one buffer per entry that is written to the file at once
+     * for -r, or into a PNG encoder for TH19. */
+    for (size_t t = 0; t < target_count; ++t) {
+        anm_target_t* target = &targets[t];
+        entry = target->entry;
+        if (is_png)
+            target->writer = png_writer_open_mem(entry->thtx->w, entry->thtx->h);
+        else if (anmfp)
+            target->out = malloc((size_t)entry->thtx->w * entry->thtx->h * format_Bpp(target->format));
+        else
+            target->out = entry->data;
+    }
 
-                entry->processed = 1;
+    uint32_t* row = malloc(image_width * sizeof(uint32_t));
+    for (unsigned int y = 0; y < height; ++y) {
+        png_reader_read_row(reader, row);
+        for (size_t t = 0; t < target_count; ++t) {
+            const anm_target_t* target = &targets[t];
+            const thtx_header_t* thtx = target->entry->thtx;
+            if (y < target->oy || y >= target->oy + thtx->h)
+                continue;
+            if (target->writer) {
+                png_writer_write_row(target->writer, (const unsigned char*)(row + target->ox));
+            } else {
+                format_from_rgba_rect(row + target->ox, image_width, thtx->w, 1, target->format,
+                    target->out + (size_t)(y - target->oy) * thtx->w * format_Bpp(target->format));
             }
-            if (entry == entry_next)
-                entry_next = entry->next_by_name;
-
-            offset += entry->header->nextoffset;
         }
     }
-
-    free(image->data);
-    free(image);
-}
-
-static unsigned char *
-entry_to_rgba(
-    anm_entry_t *entry,
-    int is_png)
-{
-    if (is_png) {
-        image_t image;
-        png_read_mem(&image, entry->data, entry->thtx->size);
-        return image.data;
-    } else {
-        return format_to_rgba(entry->data, entry->thtx->w * entry->thtx->h, entry->thtx->format);
+    free(row);
+    png_reader_close(reader);
+
+    for (size_t t = 0; t < target_count; ++t) {
+        anm_target_t* target = &targets[t];
+        entry = target->entry;
+        if (target->writer) {
+            /* The source PNG may be one of these, so the old data is only
+             * freed once the whole image was read. */
+            size_t size;
+            free(entry->data);
+            entry->data = png_writer_close(target->writer, &size);
+            entry->thtx->size = size;
+        } else if (anmfp) {
+            const size_t size = (size_t)entry->thtx->w * entry->thtx->h * format_Bpp(target->format);
+            if (!file_seek(anmfp, target->offset + entry->header->thtxoffset + sizeof(thtx_header_t)))
+                exit(1);
+            if (!file_write(anmfp, target->out, size))
+                exit(1);
+            free(target->out);
+        }
+        entry->processed = 1;
     }
+    if (use_cache)
+        anm_replace_store(targets, target_count, &key, is_png);
+    free(targets);
 }
 
+/* One entry of an image that is being composed a row at a time. */
+typedef struct {
+    anm_entry_t* entry;
+    uint32_t ox;
+    uint32_t oy;
+    /* The decoder of a TH19 PNG texture. */
+    png_reader_t* reader;
+    unsigned int reader_width;
+    unsigned int reader_height;
+    uint32_t* reader_row;
+} anm_strip_t;
+
 static void
 anm_extract(
     anm_entry_t* entry,
@@ -1662,17 +1988,14 @@ anm_extract(
         FORMAT_BGRA8888,
         FORMAT_RGBA8888
     };
-    image_t image;
+    unsigned int width = 0;
+    unsigned int height = 0;
 
     unsigned int f, y;
 
-    image.width = 0;
-    image.height = 0;
-    image.format = FORMAT_RGBA8888;
+    util_total_entry_size(entry, &width, &height);
 
-    util_total_entry_size(entry, &image.width, &image.height);
-
-    if (image.width == 0 || image.height == 0) {
+    if (width == 0 || height == 0) {
         /* Then there's nothing to extract. */
         return;
     }
@@ -1708,28 +2031,123 @@ anm_extract(
         }
     }
 
-    image.data = malloc(image.width * image.height * 4);
-    /* XXX: Why 0xff? */
-    memset(image.data, 0xff, image.width* image.height * 4);
+    /* The image is composed and written a row at a time, so only one row
+     * of it, and one of every PNG texture, is ever in memory. */
+    size_t strip_count = 0;
+    for (anm_entry_t *entryp = entry; entryp; entryp = entryp->next_by_name)
+        ++strip_count;
+    anm_strip_t* strips = calloc(strip_count, sizeof(*strips));
+    strip_count = 0;
     for (anm_entry_t *entryp = entry; entryp; entryp = entryp->next_by_name) {
         for (f = 0; f < sizeof(formats) / sizeof(formats[0]); ++f) {
             if (formats[f] == entryp->thtx->format) {
-                ox = option_dont_add_offset_border ? 0 : entryp->header->x;
-                oy = option_dont_add_offset_border ? 0 : entryp->header->y;
-                unsigned char* temp_data = entry_to_rgba(entryp, is_png);
-                for (y = oy; y < oy + entryp->thtx->h; ++y) {
-                    memcpy(image.data + y * image.width * 4 + ox * 4,
-                        temp_data + (y - oy) * entryp->thtx->w * 4,
-                        entryp->thtx->w * 4);
+                anm_strip_t* strip = &strips[strip_count++];
+                strip->entry = entryp;
+                strip->ox = option_dont_add_offset_border ? 0 : entryp->header->x;
+                strip->oy = option_dont_add_offset_border ? 0 : entryp->header->y;
+                if (is_png) {
+                    strip->reader = png_reader_open_mem(entryp->data, entryp->thtx->size,
+                        &strip->reader_width, &strip->reader_height);
+                    strip->reader_row = malloc(strip->reader_width * sizeof(uint32_t));
                 }
-                free(temp_data);
                 entryp->processed = 1;
             }
         }
     }
 
-    png_write(filename, &image);
-    free(image.data);
+    png_writer_t* writer = png_writer_open(filename, width, height, FORMAT_RGBA8888);
+    uint32_t* row = malloc(width * sizeof(uint32_t));
+    for (y = 0; writer && y < height; ++y) {
+        /* XXX: Why 0xff? */
+        memset(row, 0xff, width * sizeof(uint32_t));
+        for (size_t s = 0; s < strip_count; ++s) {
+            const anm_strip_t* strip = &strips[s];
+            const thtx_header_t* thtx = strip->entry->thtx;
+            if (y < strip->oy || y >= strip->oy + thtx->h)
+                continue;
+            if (strip->reader) {
+                png_reader_read_row(strip->reader, strip->reader_row);
+                memcpy(row + strip->ox, strip->reader_row,
+                    (thtx->w < strip->reader_width ? thtx->w : strip->reader_width) * sizeof(uint32_t));
+            } else {
+                format_to_rgba_to(strip->entry->data + (size_t)(y - strip->oy) * thtx->w * format_Bpp(thtx->format),
+                    thtx->w, thtx->format, row + strip->ox);
+            }
+        }
+        png_writer_write_row(writer, (const unsigned char*)row);
+    }
+    free(row);
+    if (writer)
+        png_writer_close(writer, NULL);
+
+    for (size_t s = 0; s < strip_count; ++s) {
+        if (strips[s].reader) {
+            png_reader_close(strips[s].reader);
+            free(strips[s].reader_row);
+        }
+    }
+    free(strips);
+}
+
+typedef struct {
+    anm_entry_t* entry;
+    /* The archive the entry came from and its index there, for -u. */
+    const char* input;
+    int index;
+} anm_extract_task_t;
+
+/* Extracts the entries of tasks, which must be in archive order.  Entries
+ * linked by next_by_name end up in the same image, so every name group is
+ * handled by one thread, which visits its entries in the same order as a
+ * serial run would.  The processed flags are only touched by that thread.
+ * Every entry linked from a task's entry must have a task of its own. */
+static void
+anm_extract_tasks(
+    const anm_extract_task_t* tasks,
+    size_t task_count,
+    unsigned version)
+{
+    size_t* order = malloc(task_count * sizeof(*order));
+    size_t* groups = malloc((task_count + 1) * sizeof(*groups));
+    ssize_t group_count = 0;
+    size_t n = 0;
+
+    for (size_t t = 0; t < task_count; ++t) {
+        tasks[t].entry->task = t;
+        tasks[t].entry->grouped = 0;
+    }
+
+    for (size_t t = 0; t < task_count; ++t) {
+        if (tasks[t].entry->grouped)
+            continue;
+        groups[group_count++] = n;
+        for (anm_entry_t* entry = tasks[t].entry; entry; entry = entry->next_by_name) {
+            entry->grouped = 1;
+            order[n++] = entry->task;
+        }
+    }
+    groups[group_count] = n;
+
+    ssize_t g;
+#pragma omp parallel for schedule(dynamic)
+    for (g = 0; g < group_count; ++g) {
+        for (size_t k = groups[g]; k < groups[g + 1]; ++k) {
+            const anm_extract_task_t* task = &tasks[order[k]];
+            anm_entry_t* entry = task->entry;
+            char* filename = NULL;
+            if (entry->processed)
+                continue;
+            if (option_verbose >= 1)
+                fprintf(stderr, "%s\n", entry->name);
+            if (option_unique_filenames)
+                filename = anm_make_unique_filename(entry->name, task->input, task->index);
+            anm_extract(entry, filename ? filename : entry->name, version);
+            free(filename);
+        }
+    }
+
+    free(order);
+    free(groups);
 }
 
 label_t*
@@ -1922,23 +2340,21 @@ anm_create(
     anm_archive_t* anm = (anm_archive_t*)util_malloc(sizeof(anm_archive_t));
     anm->map = NULL;
     anm->map_size = 0;
+    anm->arena = NULL;
     list_init(&anm->names);
     anm->entries = state.entries;
 
+    anm_name_table_t names = { 0, 0, NULL };
     anm_entry_t* entry;
     list_for_each(&anm->entries, entry) {
-        char* name;
-        int found = 0;
-        list_for_each(&anm->names, name) {
-            if (strcmp(entry->name, name) == 0) {
-                free(entry->name);
-                entry->name = name;
-                found = 1;
-                break;
-            }
-        }
-        if (!found)
+        anm_name_slot_t* slot = anm_name_table_get(&names, entry->name);
+        if (slot->name) {
+            free(entry->name);
+            entry->name = (char*)slot->name;
+        } else {
+            slot->name = entry->name;
             list_append_new(&anm->names, entry->name);
+        }
 
         anm_script_t* script;
         list_for_each(&entry->scripts, script) {
@@ -1952,6 +2368,7 @@ anm_create(
             list_free_nodes(&script->vars);
         }
     }
+    anm_name_table_free(&names);
 
     /* Free stuff. */
     reg_free_user();
@@ -2096,6 +2513,54 @@ anm_defaults(
     }
 }
 
+/* A growable output buffer, so that anm_write can patch offsets in place
+ * and write the whole archive at once. */
+typedef struct {
+    unsigned char* data;
+    size_t size;
+    size_t capacity;
+} anm_buffer_t;
+
+/* Makes room for at least size more bytes. */
+static void
+anm_buffer_reserve(
+    anm_buffer_t* buffer,
+    size_t size)
+{
+    if (buffer->capacity - buffer->size >= size)
+        return;
+
+    size_t capacity = buffer->capacity ? buffer->capacity : 65536;
+    while (capacity - buffer->size < size)
+        capacity *= 2;
+    unsigned char* grown = realloc(buffer->data, capacity);
+    if (!grown) {
+        fprintf(stderr, "%s: allocation of %zu bytes failed: %s\n",
+            argv0, capacity, strerror(errno));
+        exit(1);
+    }
+    buffer->data = grown;
+    buffer->capacity = capacity;
+}
+
+/* Appends size bytes to the buffer, and returns the offset they were stored
+ * at.  data may be NULL to append zeroes. */
+static size_t
+anm_buffer_append(
+    anm_buffer_t* buffer,
+    const void* data,
+    size_t size)
+{
+    size_t offset = buffer->size;
+    anm_buffer_reserve(buffer, size);
+    if (data)
+        memcpy(buffer->data + offset, data, size);
+    else
+        memset(buffer->data + offset, 0, size);
+    buffer->size += size;
+    return offset;
+}
+
 static void
 anm_write(
     anm_archive_t* anm,
@@ -2103,6 +2568,7 @@ anm_write(
     unsigned version)
 {
     FILE* stream;
+    anm_buffer_t buffer = { NULL, 0, 0 };
 
     stream = fopen(filename, "wb");
     if (!stream) {
@@ -2111,14 +2577,20 @@ anm_write(
         exit(1);
     }
 
+    /* Most of the archive is texture data, so reserve that up front. */
+    size_t reserve = 0;
     anm_entry_t* entry;
+    list_for_each(&anm->entries, entry) {
+        if (entry->header->hasdata)
+            reserve += sizeof(thtx_header_t) + entry->thtx->size;
+    }
+    anm_buffer_reserve(&buffer, reserve);
+
     list_for_each(&anm->entries, entry) {
         sprite19_t* sprite;
         anm_script_t* script;
-        long base = file_tell(stream);
-        fflush(stream);
+        size_t base = buffer.size;
         unsigned int namepad = 0;
-        static const char padding[16] = "";
         unsigned int j;
         unsigned int spriteoffset;
 
@@ -2132,31 +2604,32 @@ anm_write(
         list_for_each(&entry->scripts, script)
             ++script_count;
 
-        file_seek(stream, base +
+        /* The header and the offset tables are filled in at the end. */
+        anm_buffer_append(&buffer, NULL,
                           sizeof(anm_header06_t) +
                           sprite_count * sizeof(uint32_t) +
                           script_count * sizeof(anm_offset_t));
 
-        entry->header->nameoffset = file_tell(stream) - base;
-        file_write(stream, entry->name, strlen(entry->name));
-        file_write(stream, padding, namepad);
+        entry->header->nameoffset = buffer.size - base;
+        anm_buffer_append(&buffer, entry->name, strlen(entry->name));
+        anm_buffer_append(&buffer, NULL, namepad);
 
         if (entry->name2 && entry->header->version == 0) {
             namepad = (16 - strlen(entry->name2) % 16);
 
-            entry->header->y = file_tell(stream) - base;
-            file_write(stream, entry->name2, strlen(entry->name2));
-            file_write(stream, padding, namepad);
+            entry->header->y = buffer.size - base;
+            anm_buffer_append(&buffer, entry->name2, strlen(entry->name2));
+            anm_buffer_append(&buffer, NULL, namepad);
         }
 
         const unsigned spritesize = TH19_OR_NEWER(version) ? sizeof(sprite19_t) : sizeof(sprite_t);
-        spriteoffset = file_tell(stream) - base;
+        spriteoffset = buffer.size - base;
 
         list_for_each(&entry->sprites, sprite)
-            file_write(stream, sprite, spritesize);
+            anm_buffer_append(&buffer, sprite, spritesize);
 
         list_for_each(&entry->scripts, script) {
-            script->offset->offset = file_tell(stream) - base;
+            script->offset->offset = buffer.size - base;
 
             anm_instr_t* instr;
             list_for_each(&script->raw_instrs, instr) {
@@ -2165,19 +2638,19 @@ anm_write(
                     new_instr.time = instr->time;
                     new_instr.type = instr->type;
                     new_instr.length = instr->length;
-                    file_write(stream, &new_instr, sizeof(new_instr));
+                    anm_buffer_append(&buffer, &new_instr, sizeof(new_instr));
                     if (new_instr.length) {
-                        file_write(stream,
+                        anm_buffer_append(&buffer,
                             instr->data,
                             new_instr.length);
                     }
                 } else {
                     if (instr->type == 0xffff) {
                         instr->length = 0;
-                        file_write(stream, instr, sizeof(*instr));
+                        anm_buffer_append(&buffer, instr, sizeof(*instr));
                     } else {
                         instr->length += sizeof(*instr);
-                        file_write(stream, instr, instr->length);
+                        anm_buffer_append(&buffer, instr, instr->length);
                     }
                 }
             }
@@ -2185,52 +2658,56 @@ anm_write(
             if (!script->no_sentinel) {
                 if (entry->header->version == 0) {
                     anm_instr0_t sentinel = { 0, 0, 0 };
-                    file_write(stream, &sentinel, sizeof(sentinel));
+                    anm_buffer_append(&buffer, &sentinel, sizeof(sentinel));
                 } else {
                     anm_instr_t sentinel = { 0xffff, 0, 0, 0 };
-                    file_write(stream, &sentinel, sizeof(sentinel));
+                    anm_buffer_append(&buffer, &sentinel, sizeof(sentinel));
                 }
             }
         }
 
         if (entry->header->hasdata) {
-            entry->header->thtxoffset = file_tell(stream) - base;
+            entry->header->thtxoffset = buffer.size - base;
 
-            file_write(stream, entry->thtx, sizeof(thtx_header_t));
-            file_write(stream, entry->data, entry->thtx->size);
+            anm_buffer_append(&buffer, entry->thtx, sizeof(thtx_header_t));
+            anm_buffer_append(&buffer, entry->data, entry->thtx->size);
         }
 
         if (list_is_last_iteration())
             entry->header->nextoffset = 0;
         else
-            entry->header->nextoffset = file_tell(stream) - base;
+            entry->header->nextoffset = buffer.size - base;
 
         entry->header->sprites = sprite_count;
         entry->header->scripts = script_count;
 
-        file_seek(stream, base);
+        unsigned char* out = buffer.data + base;
 
         if (entry->header->version >= 7) {
             convert_header_to_11(entry->header);
 
-            file_write(stream, entry->header, sizeof(anm_header06_t));
+            memcpy(out, entry->header, sizeof(anm_header06_t));
             convert_header_to_old(entry->header);
         } else {
-            file_write(stream, entry->header, sizeof(anm_header06_t));
+            memcpy(out, entry->header, sizeof(anm_header06_t));
         }
+        out += sizeof(anm_header06_t);
 
         for (j = 0; j < sprite_count; ++j) {
             uint32_t ofs = spriteoffset + j * spritesize;
-            file_write(stream, &ofs, sizeof(uint32_t));
+            memcpy(out, &ofs, sizeof(uint32_t));
+            out += sizeof(uint32_t);
         }
 
         list_for_each(&entry->scripts, script) {
-            file_write(stream, script->offset, sizeof(*script->offset));
+            memcpy(out, script->offset, sizeof(*script->offset));
+            out += sizeof(*script->offset);
         }
-
-        file_seek(stream, base + entry->header->nextoffset);
     }
 
+    file_write(stream, buffer.data, buffer.size);
+    free(buffer.data);
+
     fclose(stream);
 }
 #endif
@@ -2253,9 +2730,13 @@ anm_free(
             if (!is_mapped)
                 free(script->offset);
 
-            thanm_instr_t* instr;
-            list_for_each(&script->instrs, instr) {
-                thanm_instr_free(instr);
+            /* Instructions read from a file are released with the arena. */
+            if (!anm->arena) {
+                thanm_instr_t* instr;
+                list_for_each(&script->instrs, instr) {
+                    thanm_instr_free(instr);
+                }
+                list_free_nodes(&script->instrs);
             }
             if (!is_mapped || entry->header->version == 0) {
                 anm_instr_t* instr;
@@ -2263,7 +2744,6 @@ anm_free(
                     free(instr);
                 }
             }
-            list_free_nodes(&script->instrs);
             list_free_nodes(&script->raw_instrs);
 
             free(script);
@@ -2289,6 +2769,8 @@ anm_free(
     }
     list_free_nodes(&anm->entries);
 
+    anm_arena_free(anm);
+
     if (is_mapped)
         file_munmap(anm->map, anm->map_size);
 
@@ -2303,7 +2785,7 @@ print_usage(void)
 #else
 #define USAGE_LIBPNGFLAGS ""
 #endif
-    printf("Usage: %s [-Vfouv] [[-l" USAGE_LIBPNGFLAGS "] VERSION] [-m ANMMAP]... [-s SYMBOLS] ARCHIVE ...\n"
+    printf("Usage: %s [-Vfkouv] [[-l" USAGE_LIBPNGFLAGS "] VERSION] [-m ANMMAP]... [-s SYMBOLS] [-z SETTINGS] ARCHIVE ...\n"
            "Options:\n"
            "  -l VERSION ARCHIVE            list archive\n"
 #ifdef HAVE_LIBPNG
@@ -2312,6 +2794,8 @@ print_usage(void)
            "  -r VERSION ARCHIVE NAME FILE  replace entry in archive\n"
            "  -c VERSION ARCHIVE SPEC       create archive\n"
            "  -s SYMBOLS                    save symbol ids to the given file as globaldefs\n"
+           "  -z SETTING[,SETTING]...       PNG compression level, strategy and filters\n"
+           "  -k                            keep converted textures in ARCHIVE.thcache for -c\n"
 #endif
            "  -m ANMMAP                     use map file for translating mnemonics\n"
            "  -V                            display version information and exit\n"
@@ -2341,12 +2825,11 @@ main(
 
     const char commands[] = "+:l:om:"
 #ifdef HAVE_LIBPNG
-                            "x:X:r:c:s:"
+                            "x:X:r:c:s:z:k"
 #endif
                             "Vfuv";
     int command = -1;
 
-    FILE* in;
     unsigned version = 0;
 
     anm_archive_t* anm;
@@ -2401,6 +2884,18 @@ main(
                     argv0, util_optarg, strerror(errno));
             }
             break;
+#ifdef HAVE_LIBPNG
+        case 'z':
+            if (!png_set_options(util_optarg)) {
+                fprintf(stderr, "%s: invalid PNG setting: %s\n", argv0, util_optarg);
+                exit(1);
+            }
+            png_settings_hash = anm_cache_hash(png_settings_hash, util_optarg, strlen(util_optarg) + 1);
+            break;
+        case 'k':
+            option_cache = 1;
+            break;
+#endif
         case 'f':
             option_force = 1;
             break;
@@ -2473,13 +2968,7 @@ main(
         }
 
         current_input = argv[0];
-        in = fopen(argv[0], "rb");
-        if (!in) {
-            fprintf(stderr, "%s: couldn't open %s for reading\n", argv0, current_input);
-            exit(1);
-        }
-        anm = anm_read_file(in, version);
-        fclose(in);
+        anm = anm_read_file(argv[0], version);
         anm_dump(stdout, anm, version, argv[0]);
 
         anm_free(anm);
@@ -2492,33 +2981,26 @@ main(
         }
 
         current_input = argv[0];
-        in = fopen(argv[0], "rb");
-        if (!in) {
-            fprintf(stderr, "%s: couldn't open %s for reading\n", argv0, current_input);
-            exit(1);
-        }
-        anm = anm_read_file(in, version);
-        fclose(in);
+        anm = anm_read_file(argv[0], version);
 
         if (!option_unique_filenames)
             anm_build_name_lists(anm);
 
         if (argc == 1) {
             /* Extract all files. */
+            size_t task_count = 0;
+            list_for_each(&anm->entries, entry)
+                ++task_count;
+            anm_extract_task_t* tasks = malloc(task_count * sizeof(*tasks));
             int j = 0;
             list_for_each(&anm->entries, entry) {
-                if (!entry->processed) {
-                    char *filename = 0;
-                    current_output = entry->name;
-                    if (option_verbose >= 1)
-                        fprintf(stderr, "%s\n", entry->name);
-                    if (option_unique_filenames)
-                        filename = anm_make_unique_filename(entry->name, argv[0], j);
-                    anm_extract(entry, filename ? filename : entry->name, version);
-                    free(filename);
-                }
+                tasks[j].entry = entry;
+                tasks[j].input = argv[0];
+                tasks[j].index = j;
                 j++;
             }
+            anm_extract_tasks(tasks, task_count, version);
+            free(tasks);
         } else {
             /* Extract all listed files. */
             for (i = 1; i < argc; ++i) {
@@ -2557,36 +3039,34 @@ main(
 
         for (i = 0; i < argc; ++i) {
             current_input = argv[i];
-            in = fopen(argv[i], "rb");
-            if (!in) {
-                fprintf(stderr, "%s: couldn't open %s for reading\n", argv0, current_input);
-                exit(1);
-            }
-            anm = anm_read_file(in, version);
+            anm = anm_read_file(argv[i], version);
             list_append_new(&anms, anm);
-            fclose(in);
         }
 
         anm_build_name_lists_multiple(&anms);
 
+        /* All archives share one set of tasks, so that they are extracted
+         * in parallel too. */
+        size_t task_count = 0;
+        list_for_each(&anms, anm)
+            list_for_each(&anm->entries, entry)
+                ++task_count;
+        anm_extract_task_t* tasks = malloc(task_count * sizeof(*tasks));
+        size_t t = 0;
         i = 0;
         list_for_each(&anms, anm) {
             int j = 0;
             list_for_each(&anm->entries, entry) {
-                if (!entry->processed) {
-                    char *filename = 0;
-                    current_output = entry->name;
-                    if (option_verbose >= 1)
-                        fprintf(stderr, "%s\n", entry->name);
-                    if (option_unique_filenames)
-                        filename = anm_make_unique_filename(entry->name, argv[i], j);
-                    anm_extract(entry, filename ? filename : entry->name, version);
-                    free(filename);
-                }
+                tasks[t].entry = entry;
+                tasks[t].input = argv[i];
+                tasks[t].index = j;
+                ++t;
                 j++;
             }
             i++;
         }
+        anm_extract_tasks(tasks, task_count, version);
+        free(tasks);
 
         list_for_each(&anms, anm)
             anm_free(anm);
@@ -2607,13 +3087,7 @@ main(
 
         current_output = argv[2];
         current_input = argv[0];
-        in = fopen(argv[0], "rb");
-        if (!in) {
-            fprintf(stderr, "%s: couldn't open %s for reading\n", argv0, current_input);
-            exit(1);
-        }
-        anm = anm_read_file(in, version);
-        fclose(in);
+        anm = anm_read_file(argv[0], version);
 
         anmfp = fopen(argv[0], "rb+");
         if (!anmfp) {
@@ -2670,6 +3144,14 @@ replace_done:
 
         anm_defaults(anm, version);
 
+        char* cache_path = NULL;
+        if (option_cache) {
+            cache_path = malloc(strlen(argv[0]) + sizeof(".thcache"));
+            strcpy(cache_path, argv[0]);
+            strcat(cache_path, ".thcache");
+            anm_cache = anm_cache_load(cache_path);
+        }
+
         /* Allocate enough space for the THTX data. */
         if (!option_unique_filenames)
             anm_build_name_lists(anm);
@@ -2688,6 +3170,13 @@ replace_done:
         current_output = argv[0];
         anm_write(anm, argv[0], version);
 
+        if (anm_cache) {
+            anm_cache_save(anm_cache, cache_path);
+            anm_cache_free(anm_cache);
+            anm_cache = NULL;
+        }
+        free(cache_path);
+
         anm_free(anm);
         exit(0);
 #endif
@@ -74,6 +74,8 @@ typedef struct anm_entry_t {
     char* filename; /* filename from which to load the image */
     struct anm_entry_t *next_by_name; /* next entry with the same name */
     int processed; /* whether the entry was already processed */
+    size_t task; /* index in the tasks of anm_extract_tasks */
+    int grouped; /* whether anm_extract_tasks has put it in a group */
 
     /* List of sprite19_t*. */
     list_t sprites;
@@ -83,9 +85,15 @@ typedef struct anm_entry_t {
     unsigned char* data;
 } anm_entry_t;
 
+typedef struct anm_arena_block_t anm_arena_block_t;
+
 typedef struct {
     unsigned char* map;
     long map_size;
+    /* Instructions, parameters and their list nodes of an archive read by
+     * anm_read_file, released at once by anm_free.  NULL for archives
+     * built by the parser. */
+    anm_arena_block_t* arena;
 
     /* List of const char*. */
     list_t names;
@@ -27,34 +27,43 @@
  * DAMAGE.
  */
 #include <config.h>
+#include <ctype.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <thtk/thtk.h>
 #include "program.h"
+#include "file.h"
 #include "util.h"
 #include "mygetopt.h"
 
 static const char *dat_chdir = NULL;
+static int dat_dedup = 0;
+static int dat_use_index = 0;
+static int dat_use_glob = 0;
 
 static void
 print_usage(
     void)
 {
-    printf("Usage: %s [-Vg] [-C DIR] [[-c | -l | -x] VERSION] [ARCHIVE [FILE...]]\n"
+    printf("Usage: %s [-VgDI] [-C DIR] [[-c | -l | -x] VERSION] [ARCHIVE [FILE...]]\n"
+           "       %s [-gDI] [-C DIR] -b JOBFILE\n"
            "Options:\n"
            "  -c  create an archive\n"
            "  -l  list the contents of an archive\n"
            "  -x  extract an archive\n"
+           "  -b  create and extract the archives listed in JOBFILE\n"
            "  -V  display version information and exit\n"
            "  -g  enable glob matching for -x filenames\n"
+           "  -D  store identical files only once (-c only)\n"
+           "  -I  keep the file list in ARCHIVE.thidx for faster opening\n"
            "  -C  change directory after opening the archive\n"
            "VERSION can be:\n"
            "  1, 2, 3, 4, 5, 6, 7, 75, 8, 9, 95, 10, 103 (for Uwabami Breakers), 105, 11, 12, 123, 125, 128, 13, 14, 143, 15, 16, 165, 17, 18, 185, 19, or 20\n"
            /* NEWHU: 20 */
        "Specify 'd' as VERSION to automatically detect archive format. (-l and -x only)\n\n"
-           "Report bugs to <" PACKAGE_BUGREPORT ">.\n", argv0);
+           "Report bugs to <" PACKAGE_BUGREPORT ">.\n", argv0, argv0);
 }
 
 static void
@@ -91,6 +100,70 @@ thdat_state_free(
     }
 }
 
+static char*
+thdat_index_path(
+    const char* path)
+{
+    char* index_path = malloc(strlen(path) + sizeof(".thidx"));
+    strcpy(index_path, path);
+    strcat(index_path, ".thidx");
+    return index_path;
+}
+
+/* Opens the archive using the index file next to it, which is created or
+ * updated if it's missing or out of date.  Problems with the index file are
+ * not errors, the archive is just opened normally then. */
+static thdat_t*
+thdat_open_indexed(
+    unsigned int version,
+    const char* path,
+    thtk_io_t* stream,
+    thtk_error_t** error)
+{
+    uint64_t size, mtime;
+    if (!file_stat(path, &size, &mtime))
+        return thdat_open(version, stream, error);
+
+    char* index_path = thdat_index_path(path);
+    thtk_io_t* index;
+    thdat_t* thdat = NULL;
+
+    if ((index = thtk_io_open_file(index_path, "rb", NULL))) {
+        thdat = thdat_open_index(version, stream, index, size, mtime, NULL);
+        thtk_io_close(index);
+    }
+
+    if (!thdat && (thdat = thdat_open(version, stream, error))) {
+        if ((index = thtk_io_open_file(index_path, "wb", NULL))) {
+            thdat_write_index(thdat, index, size, mtime, NULL);
+            thtk_io_close(index);
+        }
+    }
+
+    free(index_path);
+    return thdat;
+}
+
+/* Returns the version stored in a valid index file for the archive, or 0. */
+static unsigned int
+thdat_index_detect(
+    const char* path)
+{
+    uint64_t size, mtime;
+    if (!file_stat(path, &size, &mtime))
+        return 0;
+
+    char* index_path = thdat_index_path(path);
+    thtk_io_t* index;
+    unsigned int version = 0;
+    if ((index = thtk_io_open_file(index_path, "rb", NULL))) {
+        version = thdat_index_version(index, size, mtime, NULL);
+        thtk_io_close(index);
+    }
+    free(index_path);
+    return version;
+}
+
 static thdat_state_t*
 thdat_open_file(
     unsigned int version,
@@ -104,7 +177,12 @@ thdat_open_file(
         return NULL;
     }
 
-    if (!(state->thdat = thdat_open(version, state->stream, error))) {
+    if (dat_use_index)
+        state->thdat = thdat_open_indexed(version, path, state->stream, error);
+    else
+        state->thdat = thdat_open(version, state->stream, error);
+
+    if (!state->thdat) {
         thdat_state_free(state);
         return NULL;
     }
@@ -209,128 +287,601 @@ thdat_list(
     return 1;
 }
 
-static int
-thdat_create_wrapper(
-    unsigned int version,
-    const char* path,
-    const char** paths,
-    size_t entry_count,
-    thtk_error_t** error)
+/* Returns the version of the archive at path as detected by thdat_detect,
+ * or 0 after printing the reason. */
+static unsigned int
+thdat_detect_version(
+    const char* path)
 {
-    thdat_state_t* state = thdat_state_alloc();
-    char*** entries = calloc(entry_count, sizeof(char**));
-    char** realpaths;
-    int* entries_count = calloc(entry_count, sizeof(int));
-    size_t real_entry_count = 0;
+    thtk_error_t* error = NULL;
+    thtk_io_t* file;
 
-    if (!(state->stream = thtk_io_open_file(path, "wb", error))) {
-        thdat_state_free(state);
-        exit(1);
+    if (dat_use_index) {
+        unsigned int cached = thdat_index_detect(path);
+        if (cached)
+            return cached;
     }
 
-    if (dat_chdir && util_chdir(dat_chdir) == -1) {
-        fprintf(stderr, "%s: couldn't change directory to %s: %s\n",
-            argv0, dat_chdir, strerror(errno));
-        thdat_state_free(state);
-        exit(1);
+    if (!(file = thtk_io_open_file(path, "rb", &error))) {
+        print_error(error);
+        thtk_error_free(&error);
+        return 0;
+    }
+    uint32_t out[4];
+    unsigned int heur;
+    printf("Detecting '%s'...\n", path);
+    if (-1 == thdat_detect(path, file, out, &heur, &error)) {
+        thtk_io_close(file);
+        print_error(error);
+        thtk_error_free(&error);
+        return 0;
+    }
+    thtk_io_close(file);
+    if (heur == -1) {
+        const thdat_detect_entry_t* ent;
+        printf("Couldn't detect version!\nPossible versions: ");
+        while ((ent = thdat_detect_iter(out))) {
+            printf("%d,", ent->alias);
+        }
+        printf("\n");
+        return 0;
+    }
+    printf("Detected version %d\n", heur);
+    return heur;
+}
+
+/* An archive to create or extract.  Entries of all jobs are processed by the
+ * same parallel loop, see thdat_run_jobs. */
+typedef struct {
+    /* 'c' or 'x'. */
+    int mode;
+    unsigned int version;
+    const char* path;
+    const char** files;
+    size_t file_count;
+    thdat_state_t* state;
+    /* -c: the file to read for each entry. */
+    char** realpaths;
+    /* -x: the entries to extract. */
+    ssize_t* entries;
+    size_t entry_count;
+    size_t failed;
+} thdat_job_t;
+
+typedef struct {
+    thdat_job_t* job;
+    size_t index;
+} thdat_task_t;
+
+static int
+thdat_job_open(
+    thdat_job_t* job,
+    thtk_error_t** error)
+{
+    if (job->mode == 'x') {
+        if (job->version == ~0 && !(job->version = thdat_detect_version(job->path))) {
+            thtk_error_new(error, "couldn't detect the version of %s", job->path);
+            return 0;
+        }
+        return (job->state = thdat_open_file(job->version, job->path, error)) != NULL;
     }
 
-    for (size_t i = 0; i < entry_count; i++) {
-        int n = util_scan_files(paths[i], &entries[i]);
+    job->state = thdat_state_alloc();
+    return (job->state->stream = thtk_io_open_file(job->path, "wb", error)) != NULL;
+}
+
+static int
+thdat_job_prepare_create(
+    thdat_job_t* job,
+    thtk_error_t** error)
+{
+    char*** entries = calloc(job->file_count, sizeof(char**));
+    int* entries_count = calloc(job->file_count, sizeof(int));
+    size_t real_entry_count = 0;
+
+    for (size_t i = 0; i < job->file_count; i++) {
+        int n = util_scan_files(job->files[i], &entries[i]);
         if (n == -1) {
             entries[i] = calloc(1, sizeof(char*));
-            entries[i][0] = malloc(strlen(paths[i])+1);
-            strcpy(entries[i][0], paths[i]);
+            entries[i][0] = malloc(strlen(job->files[i])+1);
+            strcpy(entries[i][0], job->files[i]);
             n = 1;
         }
         entries_count[i] = n;
         real_entry_count += n;
     }
 
-    if (!(state->thdat = thdat_create(version, state->stream, real_entry_count, error))) {
-        thdat_state_free(state);
-        exit(1);
+    job->state->thdat = thdat_create(job->version, job->state->stream, real_entry_count, error);
+    if (job->state->thdat && dat_dedup && !thdat_set_dedup(job->state->thdat, 1, error)) {
+        thdat_free(job->state->thdat);
+        job->state->thdat = NULL;
     }
 
     // Set entry names first...
-    realpaths = calloc(real_entry_count, sizeof(char*));
+    job->realpaths = calloc(real_entry_count, sizeof(char*));
     size_t k = 0;
-    for (size_t i = 0; i < entry_count; ++i) {
+    for (size_t i = 0; i < job->file_count; ++i) {
         thtk_error_t* error = NULL;
         for (size_t j = 0; j < entries_count[i]; j++) {
-            if (!thdat_entry_set_name(state->thdat, k, entries[i][j], &error)) {
+            if (job->state->thdat && !thdat_entry_set_name(job->state->thdat, k, entries[i][j], &error)) {
                 print_error(error);
                 thtk_error_free(&error);
+                free(entries[i][j]);
                 continue;
             }
-            realpaths[k] = malloc(strlen(entries[i][j])+1);
-            strcpy(realpaths[k], entries[i][j]);
-            k++;
-            free(entries[i][j]);
+            job->realpaths[k++] = entries[i][j];
         }
         free(entries[i]);
     }
     free(entries);
     free(entries_count);
+    job->entry_count = real_entry_count;
+
+    if (!job->state->thdat)
+        return 0;
+
     // ...and then module->create, if this is th105 archive.
     // This is because the list of entries comes first in th105 archives.
-    if (!thdat_init(state->thdat, error)) {
-        thdat_state_free(state);
-        exit(1);
+    if (!thdat_init(job->state->thdat, error)) {
+        /* thdat_init frees the archive on failure. */
+        job->state->thdat = NULL;
+        return 0;
     }
 
-    k = 0;
-    /* TODO: Properly indicate when insertion fails. */
-    ssize_t i;
-#pragma omp parallel for schedule(dynamic)
-    for (i = 0; i < real_entry_count; ++i) {
+    return 1;
+}
+
+static int
+thdat_job_prepare_extract(
+    thdat_job_t* job,
+    thtk_error_t** error)
+{
+    ssize_t entry_count;
+    if ((entry_count = thdat_entry_count(job->state->thdat, error)) == -1)
+        return 0;
+
+    if (!job->file_count) {
+        job->entries = malloc(entry_count * sizeof(*job->entries));
+        for (ssize_t e = 0; e < entry_count; ++e)
+            job->entries[e] = e;
+        job->entry_count = entry_count;
+        return 1;
+    }
+
+    /* Extract every entry once, even if it's matched several times. */
+    char* selected = calloc(entry_count, 1);
+    size_t capacity = 0;
+    for (size_t a = 0; a < job->file_count; ++a) {
         thtk_error_t* error = NULL;
-        thtk_io_t* entry_stream;
-        off_t entry_size;
+        ssize_t e = -1;
+
+        if (dat_use_glob) {
+            while ((e = thdat_entry_by_glob(job->state->thdat, job->files[a], e+1, &error)) != -1) {
+                if (selected[e])
+                    continue;
+                selected[e] = 1;
+                util_vec_ensure(&job->entries, &capacity, job->entry_count+1, sizeof(*job->entries));
+                job->entries[job->entry_count++] = e;
+            }
+            if (error) {
+                print_error(error);
+                thtk_error_free(&error);
+            }
+        } else {
+            if ((e = thdat_entry_by_name(job->state->thdat, job->files[a], &error)) == -1) {
+                if (error) {
+                    print_error(error);
+                    thtk_error_free(&error);
+                } else {
+                    fprintf(stderr, "%s:%s not found\n", argv0, job->files[a]);
+                }
+                continue;
+            }
+            if (selected[e])
+                continue;
+            selected[e] = 1;
+            util_vec_ensure(&job->entries, &capacity, job->entry_count+1, sizeof(*job->entries));
+            job->entries[job->entry_count++] = e;
+        }
+    }
+    free(selected);
+
+    return 1;
+}
+
+static int
+thdat_job_run(
+    thdat_job_t* job,
+    size_t index,
+    thtk_error_t** error)
+{
+    if (job->mode == 'x')
+        return thdat_extract_file(job->state, job->entries[index], error);
+
+    thtk_io_t* entry_stream;
+    off_t entry_size;
+    const char* name;
+
+    if (!(name = thdat_entry_get_name(job->state->thdat, index, error)))
+        return 0;
+
+    printf("%s...\n", name);
+
+    // Is entry name set?
+    if (!name[0])
+        return 1;
+
+    if (!(entry_stream = thtk_io_open_file(job->realpaths[index], "rb", error)))
+        return 0;
+
+    if ((entry_size = thtk_io_seek(entry_stream, 0, SEEK_END, error)) == -1 ||
+        thtk_io_seek(entry_stream, 0, SEEK_SET, error) == -1 ||
+        thdat_entry_write_data(job->state->thdat, index, entry_stream, entry_size, error) == -1) {
+        thtk_io_close(entry_stream);
+        return 0;
+    }
+
+    thtk_io_close(entry_stream);
+    return 1;
+}
+
+static int
+thdat_job_close(
+    thdat_job_t* job,
+    thtk_error_t** error)
+{
+    int ret = 1;
+
+    if (job->mode == 'c' && job->state && job->state->thdat)
+        ret = thdat_close(job->state->thdat, error);
+    if (job->realpaths) {
+        for (size_t i = 0; i < job->entry_count; ++i)
+            free(job->realpaths[i]);
+        free(job->realpaths);
+    }
+    free(job->entries);
+    thdat_state_free(job->state);
+    job->state = NULL;
+
+    return ret;
+}
+
+/* A file written or read by the entries of a job. */
+typedef struct {
+    char* path;
+    const thdat_job_t* job;
+    int output;
+} thdat_job_path_t;
+
+/* Copies path in a form where equal files compare equal in most cases. */
+static char*
+thdat_job_path_normalize(
+    const char* path)
+{
+    while (path[0] == '.' && path[1] == '/')
+        path += 2;
+    char* copy = strdup(path);
+#ifdef _WIN32
+    for (char* p = copy; *p; ++p)
+        *p = *p == '\\' ? '/' : tolower((unsigned char)*p);
+#endif
+    return copy;
+}
+
+static int
+thdat_job_path_compar(
+    const void* a,
+    const void* b)
+{
+    return strcmp(((const thdat_job_path_t*)a)->path, ((const thdat_job_path_t*)b)->path);
+}
 
-        printf("%s...\n", thdat_entry_get_name(state->thdat, i, &error));
+/* All jobs share one directory, so two jobs must not extract the same file,
+ * nor extract a file which another job archives.  Prints every conflict and
+ * returns 0 if there are any. */
+static int
+thdat_jobs_check_paths(
+    thdat_job_t* jobs,
+    size_t job_count)
+{
+    thdat_job_path_t* paths = NULL;
+    size_t capacity = 0;
+    size_t path_count = 0;
 
-        // Is entry name set?
-        if (!(thdat_entry_get_name(state->thdat, i, &error))[0])
+    for (size_t j = 0; j < job_count; ++j) {
+        thdat_job_t* job = &jobs[j];
+        if (!job->state)
             continue;
+        for (size_t i = 0; i < job->entry_count; ++i) {
+            const char* path = job->mode == 'x'
+                ? thdat_entry_get_name(job->state->thdat, job->entries[i], NULL)
+                : job->realpaths[i];
+            if (!path)
+                continue;
+            util_vec_ensure(&paths, &capacity, path_count + 1, sizeof(*paths));
+            paths[path_count].path = thdat_job_path_normalize(path);
+            paths[path_count].job = job;
+            paths[path_count].output = job->mode == 'x';
+            ++path_count;
+        }
+    }
+    qsort(paths, path_count, sizeof(*paths), thdat_job_path_compar);
+
+    int ok = 1;
+    for (size_t run = 0; run < path_count; ) {
+        size_t end = run + 1;
+        while (end < path_count && !strcmp(paths[run].path, paths[end].path))
+            ++end;
+        int conflict = 0;
+        for (size_t a = run; a < end && !conflict; ++a)
+            for (size_t b = a + 1; b < end && !conflict; ++b)
+                conflict = paths[a].job != paths[b].job &&
+                    (paths[a].output || paths[b].output);
+        if (conflict) {
+            size_t outputs = 0;
+            for (size_t a = run; a < end; ++a)
+                outputs += paths[a].output;
+            fprintf(stderr, outputs > 1
+                ? "%s: %s is extracted by more than one job\n"
+                : "%s: %s is extracted while another job archives it\n",
+                argv0, paths[run].path);
+            ok = 0;
+        }
+        run = end;
+    }
+
+    for (size_t p = 0; p < path_count; ++p)
+        free(paths[p].path);
+    free(paths);
+    return ok;
+}
 
-        if (!(entry_stream = thtk_io_open_file(realpaths[i], "rb", &error))) {
+/* Opens all archives, changes the directory, and then processes the entries
+ * of all jobs in one parallel loop.  Returns the number of jobs which
+ * couldn't be opened or closed, or which weren't run because of conflicting
+ * paths. */
+static size_t
+thdat_run_jobs(
+    thdat_job_t* jobs,
+    size_t job_count)
+{
+    thtk_error_t* error = NULL;
+    size_t failed = 0;
+
+    for (size_t j = 0; j < job_count; ++j) {
+        if (!thdat_job_open(&jobs[j], &error)) {
             print_error(error);
             thtk_error_free(&error);
-            continue;
+            thdat_state_free(jobs[j].state);
+            jobs[j].state = NULL;
+            ++failed;
         }
+    }
 
-        if ((entry_size = thtk_io_seek(entry_stream, 0, SEEK_END, &error)) == -1) {
+    if (dat_chdir && util_chdir(dat_chdir) == -1) {
+        fprintf(stderr, "%s: couldn't change directory to %s: %s\n",
+            argv0, dat_chdir, strerror(errno));
+        exit(1);
+    }
+
+    size_t task_count = 0;
+    for (size_t j = 0; j < job_count; ++j) {
+        thdat_job_t* job = &jobs[j];
+        if (!job->state)
+            continue;
+        int ret = job->mode == 'x'
+            ? thdat_job_prepare_extract(job, &error)
+            : thdat_job_prepare_create(job, &error);
+        if (!ret) {
             print_error(error);
             thtk_error_free(&error);
+            thdat_job_close(job, NULL);
+            ++failed;
+            continue;
+        }
+        task_count += job->entry_count;
+    }
+
+    if (!thdat_jobs_check_paths(jobs, job_count)) {
+        for (size_t j = 0; j < job_count; ++j) {
+            if (!jobs[j].state)
+                continue;
+            /* Nothing has been written, so don't close the archive. */
+            thdat_free(jobs[j].state->thdat);
+            jobs[j].state->thdat = NULL;
+            thdat_job_close(&jobs[j], NULL);
+            ++failed;
+        }
+        return failed;
+    }
+
+    thdat_task_t* tasks = malloc(task_count * sizeof(*tasks));
+    size_t t = 0;
+    for (size_t j = 0; j < job_count; ++j) {
+        if (!jobs[j].state)
             continue;
+        for (size_t i = 0; i < jobs[j].entry_count; ++i) {
+            tasks[t].job = &jobs[j];
+            tasks[t].index = i;
+            ++t;
         }
+    }
 
-        if (thtk_io_seek(entry_stream, 0, SEEK_SET, &error) == -1) {
+    /* TODO: Properly indicate when insertion fails. */
+    ssize_t i;
+#pragma omp parallel for schedule(dynamic)
+    for (i = 0; i < task_count; ++i) {
+        thtk_error_t* error = NULL;
+        if (!thdat_job_run(tasks[i].job, tasks[i].index, &error)) {
             print_error(error);
             thtk_error_free(&error);
-            continue;
+#pragma omp atomic
+            tasks[i].job->failed++;
         }
+    }
+    free(tasks);
 
-        if (thdat_entry_write_data(state->thdat, i, entry_stream, entry_size, &error) == -1) {
+    for (size_t j = 0; j < job_count; ++j) {
+        if (!jobs[j].state)
+            continue;
+        if (!thdat_job_close(&jobs[j], &error)) {
             print_error(error);
             thtk_error_free(&error);
+            ++failed;
+        }
+    }
+
+    return failed;
+}
+
+/* Splits the next whitespace separated word off *line and returns it, or NULL
+ * at the end of the line.  Words can be enclosed in double quotes. */
+static char*
+thdat_batch_word(
+    char** line)
+{
+    char* p = *line;
+    while (*p == ' ' || *p == '\t' || *p == '\r')
+        ++p;
+    if (!*p || *p == '#') {
+        *line = p;
+        return NULL;
+    }
+
+    char* word = p;
+    if (*p == '"') {
+        word = ++p;
+        while (*p && *p != '"')
+            ++p;
+    } else {
+        while (*p && *p != ' ' && *p != '\t' && *p != '\r')
+            ++p;
+    }
+    if (*p)
+        *p++ = '\0';
+    *line = p;
+    return word;
+}
+
+/* Reads a job file, where each line has the form
+ *   c|x VERSION ARCHIVE [FILE...]
+ * Empty lines and lines starting with # are skipped. */
+static thdat_job_t*
+thdat_batch_read(
+    const char* path,
+    char** text,
+    size_t* job_count)
+{
+    thtk_error_t* error = NULL;
+    thtk_io_t* file;
+    off_t size;
+
+    if (!(file = thtk_io_open_file(path, "rb", &error)) ||
+        (size = thtk_io_seek(file, 0, SEEK_END, &error)) == -1 ||
+        thtk_io_seek(file, 0, SEEK_SET, &error) == -1) {
+        print_error(error);
+        thtk_error_free(&error);
+        if (file)
+            thtk_io_close(file);
+        return NULL;
+    }
+    *text = malloc(size + 1);
+    if (thtk_io_read(file, *text, size, &error) != size) {
+        print_error(error);
+        thtk_error_free(&error);
+        thtk_io_close(file);
+        free(*text);
+        return NULL;
+    }
+    thtk_io_close(file);
+    (*text)[size] = '\0';
+
+    thdat_job_t* jobs = NULL;
+    size_t capacity = 0;
+    unsigned int line_number = 0;
+    *job_count = 0;
+
+    for (char* line = *text; line; ) {
+        char* next = strchr(line, '\n');
+        if (next)
+            *next++ = '\0';
+        ++line_number;
+
+        char* mode = thdat_batch_word(&line);
+        if (!mode) {
+            line = next;
             continue;
         }
+        char* version = thdat_batch_word(&line);
+        char* archive = thdat_batch_word(&line);
+        if (!version || !archive || (strcmp(mode, "c") && strcmp(mode, "x"))) {
+            fprintf(stderr, "%s:%s:%u: expected c|x VERSION ARCHIVE [FILE...]\n",
+                argv0, path, line_number);
+            goto fail;
+        }
 
-        thtk_io_close(entry_stream);
-        free(realpaths[i]);
+        util_vec_ensure(&jobs, &capacity, *job_count + 1, sizeof(*jobs));
+        thdat_job_t* job = &jobs[(*job_count)++];
+        memset(job, 0, sizeof(*job));
+        job->mode = mode[0];
+        job->path = archive;
+        if (job->mode == 'x' && !strcmp(version, "d"))
+            job->version = ~0;
+        else
+            job->version = parse_version(version);
+
+        size_t file_capacity = 0;
+        char* file;
+        while ((file = thdat_batch_word(&line))) {
+            util_vec_ensure(&job->files, &file_capacity, job->file_count + 1, sizeof(*job->files));
+            job->files[job->file_count++] = file;
+        }
+
+        if (job->mode == 'c' && !job->file_count) {
+            fprintf(stderr, "%s:%s:%u: no files given for %s\n",
+                argv0, path, line_number, archive);
+            goto fail;
+        }
+
+        line = next;
     }
-    free(realpaths);
 
-    int ret = 1;
+    return jobs;
 
-    if (!thdat_close(state->thdat, error))
-        ret = 0;
+fail:
+    for (size_t j = 0; j < *job_count; ++j)
+        free(jobs[j].files);
+    free(jobs);
+    free(*text);
+    return NULL;
+}
 
-    thdat_state_free(state);
+static int
+thdat_batch(
+    const char* path)
+{
+    char* text;
+    size_t job_count;
+    thdat_job_t* jobs = thdat_batch_read(path, &text, &job_count);
+    if (!jobs)
+        return 0;
 
-    return ret;
+    size_t failed = thdat_run_jobs(jobs, job_count);
+
+    size_t entry_count = 0;
+    size_t failed_entries = 0;
+    for (size_t j = 0; j < job_count; ++j) {
+        entry_count += jobs[j].entry_count;
+        failed_entries += jobs[j].failed;
+        free(jobs[j].files);
+    }
+    printf("%zu archives (%zu failed), %zu entries (%zu failed)\n",
+        job_count, failed, entry_count, failed_entries);
+
+    free(jobs);
+    free(text);
+
+    return !failed && !failed_entries;
 }
 
 /* TODO: Make sure errors are printed in all cases. */
@@ -342,13 +893,13 @@ main(
     thtk_error_t* error = NULL;
     unsigned int version = 0;
     int mode = -1;
-    int dat_use_glob = 0;
+    const char* batch = NULL;
 
     argv0 = util_shortname(argv[0]);
     int opt;
     int ind=0;
     while(argv[util_optind]) {
-        switch(opt = util_getopt(argc, argv, "+:c:l:x:VdgC:")) {
+        switch(opt = util_getopt(argc, argv, "+:c:l:x:b:VdgDIC:")) {
         case 'c':
         case 'l':
         case 'x':
@@ -364,9 +915,24 @@ main(
             }
             else if(opt != 'd') version = parse_version(util_optarg);
             break;
+        case 'b':
+            if(mode != -1) {
+                fprintf(stderr,"%s: More than one mode specified\n",argv0);
+                print_usage();
+                exit(1);
+            }
+            mode = opt;
+            batch = util_optarg;
+            break;
         case 'g':
             dat_use_glob = 1;
             break;
+        case 'D':
+            dat_dedup = 1;
+            break;
+        case 'I':
+            dat_use_index = 1;
+            break;
         case 'C':
             dat_chdir = util_optarg;
             break;
@@ -379,36 +945,8 @@ main(
 
     /* detect version */
     if(argc && (mode == 'x' || mode == 'l') && version == ~0) {
-        thtk_io_t* file;
-        if(!(file = thtk_io_open_file(argv[0], "rb", &error))) {
-            print_error(error);
-            thtk_error_free(&error);
-            exit(1);
-        }
-        uint32_t out[4];
-        unsigned int heur;
-        printf("Detecting '%s'...\n",argv[0]);
-        if(-1 == thdat_detect(argv[0], file, out, &heur, &error)) {
-            thtk_io_close(file);
-            print_error(error);
-            thtk_error_free(&error);
-            exit(1);
-        }
-        if(heur == -1) {
-            const thdat_detect_entry_t* ent;
-            printf("Couldn't detect version!\nPossible versions: ");
-            while((ent = thdat_detect_iter(out))) {
-                printf("%d,",ent->alias);
-            }
-            printf("\n");
-            thtk_io_close(file);
+        if(!(version = thdat_detect_version(argv[0])))
             exit(1);
-        }
-        else {
-            printf("Detected version %d\n",heur);
-            version = heur;
-        }
-        thtk_io_close(file);
     }
 
     switch (mode) {
@@ -461,98 +999,29 @@ main(
 
         exit(0);
     }
-    case 'c': {
-        if (argc < 2) {
+    case 'c':
+    case 'x': {
+        if (argc < (mode == 'c' ? 2 : 1)) {
             print_usage();
             exit(1);
         }
 
-        if (!thdat_create_wrapper(version, argv[0], (const char**)&argv[1], argc - 1, &error)) {
-            print_error(error);
-            thtk_error_free(&error);
-            exit(1);
-        }
-
-        exit(0);
+        thdat_job_t job = {
+            .mode = mode,
+            .version = version,
+            .path = argv[0],
+            .files = (const char**)&argv[1],
+            .file_count = argc - 1,
+        };
+        exit(thdat_run_jobs(&job, 1) ? 1 : 0);
     }
-    case 'x': {
-        if (argc < 1) {
+    case 'b': {
+        if (argc) {
             print_usage();
             exit(1);
         }
 
-        thdat_state_t* state = thdat_open_file(version, argv[0], &error);
-        if (!state) {
-            print_error(error);
-            thtk_error_free(&error);
-            exit(1);
-        }
-
-        if (dat_chdir && util_chdir(dat_chdir) == -1) {
-            fprintf(stderr, "%s: couldn't change directory to %s: %s\n",
-                argv0, dat_chdir, strerror(errno));
-            exit(1);
-        }
-
-        if (argc > 1) {
-            ssize_t a;
-#pragma omp parallel for schedule(dynamic)
-            for (a = 1; a < argc; ++a) {
-                thtk_error_t* error = NULL;
-                int e = -1;
-
-                if (dat_use_glob) {
-                    for (;;) {
-                        if ((e = thdat_entry_by_glob(state->thdat, argv[a], e+1, &error)) == -1) {
-                            if (error) {
-                                print_error(error);
-                                thtk_error_free(&error);
-                            }
-                            break;
-                        }
-                        if (!thdat_extract_file(state, e, &error)) {
-                            print_error(error);
-                            thtk_error_free(&error);
-                        }
-                    }
-                } else {
-                    if ((e = thdat_entry_by_name(state->thdat, argv[a], &error)) == -1) {
-                        if (error) {
-                            print_error(error);
-                            thtk_error_free(&error);
-                        } else {
-                            fprintf(stderr, "%s:%s not found\n", argv0, argv[a]);
-                        }
-                        continue;
-                    }
-                    if (!thdat_extract_file(state, e, &error)) {
-                        print_error(error);
-                        thtk_error_free(&error);
-                    }
-                }
-            }
-        } else {
-            ssize_t entry_count;
-            if ((entry_count = thdat_entry_count(state->thdat, &error)) == -1) {
-                print_error(error);
-                thtk_error_free(&error);
-                exit(1);
-            }
-
-            ssize_t entry_index;
-#pragma omp parallel for schedule(dynamic)
-            for (entry_index = 0; entry_index < entry_count; ++entry_index) {
-                thtk_error_t* error = NULL;
-                if (!thdat_extract_file(state, entry_index, &error)) {
-                    print_error(error);
-                    thtk_error_free(&error);
-                    continue;
-                }
-            }
-        }
-
-        thdat_state_free(state);
-        exit(0);
+        exit(thdat_batch(batch) ? 0 : 1);
     }
     default:
     print_usage();
@@ -31,6 +31,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "datpath.h"
+#include "file.h"
 #include "program.h"
 #include "thecl.h"
 #include "util.h"
@@ -407,13 +409,22 @@ main(int argc, char* argv[])
             exit(1);
         }
 
+        unsigned char* map = NULL;
+        long map_size;
         if (0 < argc) {
             current_input = argv[0];
-            in = fopen(argv[0], "rb");
-            if (!in) {
-                fprintf(stderr, "%s: couldn't open %s for reading: %s\n",
-                    argv0, argv[0], strerror(errno));
-                exit(1);
+            if (mode == 'd') {
+                /* Files to dump can also be inside a .dat archive. */
+                map = datpath_map(argv[0], version, &map_size);
+                if (!map)
+                    exit(1);
+            } else {
+                in = fopen(argv[0], "rb");
+                if (!in) {
+                    fprintf(stderr, "%s: couldn't open %s for reading: %s\n",
+                        argv0, argv[0], strerror(errno));
+                    exit(1);
+                }
             }
             if (1 < argc) {
                 current_output = argv[1];
@@ -446,7 +457,12 @@ main(int argc, char* argv[])
 #ifdef _WIN32
             (void)_setmode(fileno(stdin), _O_BINARY);
 #endif
-            thecl_t* ecl = module->open(in, version);
+            if (!map) {
+                map_size = file_fsize(in);
+                if (map_size == -1 || !(map = file_mmap(in, map_size)))
+                    exit(1);
+            }
+            thecl_t* ecl = module->open(map, map_size, version);
             if (!ecl)
                 exit(1);
             module->trans(ecl);
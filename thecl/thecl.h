@@ -235,7 +235,8 @@ thecl_t* thecl_new(
     void);
 
 typedef struct {
-    thecl_t* (*open)(FILE* stream, unsigned int ver);
+    /* Reads a file mapped with file_mmap. */
+    thecl_t* (*open)(unsigned char* map, long map_size, unsigned int ver);
     /* Translates the data to a more general format. */
     /* TODO: Return it instead. */
     void (*trans)(thecl_t* ecl);
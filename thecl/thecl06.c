@@ -916,22 +916,12 @@ th06_insert_labels(
 
 static thecl_t*
 th06_open(
-    FILE* stream,
+    unsigned char* map,
+    long file_size,
     unsigned int version)
 {
-    long file_size;
-    unsigned char* map;
-
     const th06_header_t* header;
 
-    file_size = file_fsize(stream);
-    if (file_size == -1)
-        return NULL;
-
-    map = file_mmap(stream, file_size);
-    if (!map)
-        return NULL;
-
     /* TODO: Check magic. */
     if (version >= 8)
         header = (th06_header_t*)(map + sizeof(uint32_t));
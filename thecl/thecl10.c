@@ -1210,13 +1210,10 @@ th10_insert_labels(
 
 static thecl_t*
 th10_open(
-    FILE* stream,
+    unsigned char* map,
+    long file_size,
     unsigned int version)
 {
-    /* Input. */
-    long file_size;
-    unsigned char* map;
-
     /* Helpers. */
     const th10_header_t* header;
     const th10_list_t* anim_list;
@@ -1230,14 +1227,6 @@ th10_open(
     /* Output data. */
     thecl_t* ecl;
 
-    file_size = file_fsize(stream);
-    if (file_size == -1)
-        return NULL;
-
-    map = file_mmap(stream, file_size);
-    if (!map)
-        return NULL;
-
     ecl = thecl_new();
     ecl->version = version;
 
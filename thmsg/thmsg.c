@@ -30,6 +30,8 @@
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
+#include "datpath.h"
+#include "file.h"
 #include "program.h"
 #include "thmsg.h"
 #include "util.h"
@@ -139,14 +141,23 @@ main(int argc, char* argv[])
     case 'c':
     case 'd': {
         int ret;
+        unsigned char* map = NULL;
+        long map_size;
 
         if (argc > 0) {
             current_input = argv[0];
-            in = fopen(argv[0], "rb");
-            if (!in) {
-                fprintf(stderr, "%s: couldn't open %s for reading: %s\n",
-                    argv0, argv[0], strerror(errno));
-                return 1;
+            if (mode == 'd') {
+                /* Files to dump can also be inside a .dat archive. */
+                map = datpath_map(argv[0], version, &map_size);
+                if (!map)
+                    return 1;
+            } else {
+                in = fopen(argv[0], "rb");
+                if (!in) {
+                    fprintf(stderr, "%s: couldn't open %s for reading: %s\n",
+                        argv0, argv[0], strerror(errno));
+                    return 1;
+                }
             }
             if (argc > 1) {
                 current_output = argv[1];
@@ -169,7 +180,12 @@ main(int argc, char* argv[])
 #ifdef _WIN32
             _setmode(fileno(stdin), _O_BINARY);
 #endif
-            ret = module->read(in, out, version);
+            if (!map) {
+                map_size = file_fsize(in);
+                if (map_size == -1 || !(map = file_mmap(in, map_size)))
+                    return 1;
+            }
+            ret = module->read(map, map_size, out, version);
         }
 
         fclose(in);
@@ -35,8 +35,9 @@
 extern int thmsg_opt_end;
 
 typedef struct {
-    /* Reads a MSG file, writes a TXT file. */
-    int (*read)(FILE* in, FILE* out, unsigned int version);
+    /* Reads a MSG file mapped with file_mmap, releases it, and writes a TXT
+     * file. */
+    int (*read)(unsigned char* map, long map_size, FILE* out, unsigned int version);
     /* Reads a TXT file, writes a MSG file. */
     int (*write)(FILE* in, FILE* out, unsigned int version);
 } thmsg_module_t;
@@ -325,26 +325,16 @@ th06_find_format(unsigned int version, int id)
 }
 
 static int
-th06_read(FILE* in, FILE* out, unsigned int version)
+th06_read(unsigned char* map, long file_size, FILE* out, unsigned int version)
 {
     const size_t entry_offset_mul = version >= 9 ? 2 : 1;
     const size_t header_extra = version == 19 && !thmsg_opt_end ? 0x50 : 0;
-    long file_size;
     uint16_t time = -1;
     int entry_new = 1;
-    unsigned char* map;
     size_t entry_count;
     const int32_t* entry_offsets;
     const th06_msg_t* msg;
 
-    file_size = file_fsize(in);
-    if (file_size == -1)
-        return 0;
-
-    map = file_mmap(in, file_size);
-    if (!map)
-        return 0;
-
     entry_count = *((uint32_t*)map);
     entry_offsets = (int32_t*)(map + sizeof(uint32_t) + header_extra);
     msg = (th06_msg_t*)(map +
@@ -64,23 +64,50 @@ PACK_BEGIN
 PACK_END
 } PACK_ATTRIBUTE th125_msg_t;
 
+/* Copies size bytes at offset in the map, like file_read. */
 static int
-th95_read(FILE* in, FILE* out, unsigned int version)
+th95_read_at(
+    const unsigned char* map,
+    long map_size,
+    uint32_t offset,
+    void* buffer,
+    size_t size)
+{
+    if (offset > map_size || size > map_size - offset) {
+        fprintf(stderr,
+            "%s: failed reading %lu bytes: unexpected end of file\n",
+            argv0, (long unsigned int)size);
+        return 0;
+    }
+    memcpy(buffer, map + offset, size);
+    return 1;
+}
+
+static int
+th95_read(unsigned char* map, long map_size, FILE* out, unsigned int version)
 {
     uint32_t entry_count = 0;
-    uint32_t* entry_pointers;
+    uint32_t* entry_pointers = NULL;
     unsigned int i;
+    int ret = 0;
 
     if (version != 95 && version != 125)
-        return 0;
+        goto done;
 
-    if (!file_read(in, &entry_count, sizeof(uint32_t)))
-        return 0;
+    if (!th95_read_at(map, map_size, 0, &entry_count, sizeof(uint32_t)))
+        goto done;
+
+    if (entry_count > (map_size - sizeof(uint32_t)) / sizeof(uint32_t)) {
+        fprintf(stderr,
+            "%s: failed reading %lu bytes: unexpected end of file\n",
+            argv0, (long unsigned int)(entry_count * sizeof(uint32_t)));
+        goto done;
+    }
 
     entry_pointers = util_malloc(sizeof(uint32_t) * entry_count);
 
-    if (!file_read(in, entry_pointers, entry_count * sizeof(uint32_t)))
-        return 0;
+    if (!th95_read_at(map, map_size, sizeof(uint32_t), entry_pointers, entry_count * sizeof(uint32_t)))
+        goto done;
 
     for (i = 0; i < entry_count; ++i) {
         th95_msg_t msg95;
@@ -88,18 +115,15 @@ th95_read(FILE* in, FILE* out, unsigned int version)
         int line;
         int j;
 
-        if (!file_seek(in, entry_pointers[i]))
-            return 0;
-
         if (version == 95) {
-            if (!file_read(in, &msg95, sizeof(th95_msg_t)))
-                return 0;
+            if (!th95_read_at(map, map_size, entry_pointers[i], &msg95, sizeof(th95_msg_t)))
+                goto done;
 
             fprintf(out, "entry %u,%u,%u,%u\n",
                 msg95.stage, msg95.scene, msg95.face, msg95.point);
         } else {
-            if (!file_read(in, &msg125, sizeof(th125_msg_t)))
-                return 0;
+            if (!th95_read_at(map, map_size, entry_pointers[i], &msg125, sizeof(th125_msg_t)))
+                goto done;
 
             fprintf(out, "entry %u,%u,%u,%u,%u,%u,%u,%i,%i,%i,%i,%i,%i\n",
                 msg125.stage, msg125.scene, msg125.player,
@@ -130,9 +154,13 @@ th95_read(FILE* in, FILE* out, unsigned int version)
         }
     }
 
+    ret = 1;
+
+done:
     free(entry_pointers);
+    file_munmap(map, map_size);
 
-    return 1;
+    return ret;
 }
 
 static int
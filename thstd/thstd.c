@@ -33,6 +33,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include "datpath.h"
 #include "file.h"
 #include "thstd.h"
 #include "program.h"
@@ -107,9 +108,12 @@ static const id_format_pair_t formats_v2[] = {
     { 0, NULL }
 };
 
+/* Reads the named file, which can also be inside a .dat archive.  Returns
+ * NULL upon error. */
 static thstd_t*
 std_read_file(
-    FILE* in)
+    const char* filename,
+    unsigned int version)
 {
     /* Input. */
     long file_size;
@@ -128,13 +132,17 @@ std_read_file(
     unsigned int *quad_type;
     size_t i;
 
+    map_base = datpath_map(filename, version, &file_size);
+    if (!map_base)
+        return NULL;
+
     thstd_t* std = malloc(sizeof(*std));
     list_init(&std->entries);
     list_init(&std->instances);
     list_init(&std->instrs);
 
-    std->map_size = file_size = file_fsize(in);
-    std->map = map_base = file_mmap(in, file_size);
+    std->map_size = file_size;
+    std->map = map_base;
     map = map_base;
 
     std->header = header = (std_header_t*)map;
@@ -796,7 +804,6 @@ main(
     const char commands[] = "+:c:d:V";
     int command = -1;
 
-    FILE* in;
     FILE* out = stdout;
 
     thstd_t* std;
@@ -872,24 +879,20 @@ main(
         }
 
         current_input = argv[0];
-        in = fopen(argv[0], "rb");
-        if (!in) {
-            fprintf(stderr, "%s: couldn't open %s for reading\n", argv0, current_input);
+        std = std_read_file(argv[0], version);
+        if (!std)
             exit(1);
-        }
 
         if (argc > 1) {
             out = fopen(argv[1], "wb");
             if (!out) {
                 fprintf(stderr, "%s: couldn't open %s for writing: %s\n",
                         argv0, argv[1], strerror(errno));
-                fclose(in);
+                std_free(std);
                 exit(1);
             }
         }
 
-        std = std_read_file(in);
-        fclose(in);
         std_dump(out, std);
         std_free(std);
         fclose(out);
@@ -0,0 +1,118 @@
+/*
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+#include <config.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thtk/alloc.h>
+
+static void*
+thtk_libc_malloc(
+    void* user,
+    size_t size)
+{
+    (void)user;
+    return malloc(size);
+}
+
+static void*
+thtk_libc_realloc(
+    void* user,
+    void* ptr,
+    size_t size)
+{
+    (void)user;
+    return realloc(ptr, size);
+}
+
+static void
+thtk_libc_free(
+    void* user,
+    void* ptr)
+{
+    (void)user;
+    free(ptr);
+}
+
+static const thtk_allocator_t thtk_libc_allocator = {
+    thtk_libc_malloc,
+    thtk_libc_realloc,
+    thtk_libc_free,
+    NULL
+};
+
+static thtk_allocator_t thtk_allocator = {
+    thtk_libc_malloc,
+    thtk_libc_realloc,
+    thtk_libc_free,
+    NULL
+};
+
+void
+thtk_set_allocator(
+    const thtk_allocator_t* allocator)
+{
+    thtk_allocator = allocator ? *allocator : thtk_libc_allocator;
+}
+
+void*
+thtk_malloc(
+    size_t size)
+{
+    return thtk_allocator.malloc(thtk_allocator.user, size);
+}
+
+void*
+thtk_calloc(
+    size_t count,
+    size_t size)
+{
+    if (size && count > SIZE_MAX / size)
+        return NULL;
+    void* ptr = thtk_allocator.malloc(thtk_allocator.user, count * size);
+    if (ptr)
+        memset(ptr, 0, count * size);
+    return ptr;
+}
+
+void*
+thtk_realloc(
+    void* ptr,
+    size_t size)
+{
+    return thtk_allocator.realloc(thtk_allocator.user, ptr, size);
+}
+
+void
+thtk_free(
+    void* ptr)
+{
+    if (ptr && thtk_allocator.free)
+        thtk_allocator.free(thtk_allocator.user, ptr);
+}
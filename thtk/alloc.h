@@ -0,0 +1,79 @@
+/*
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+#ifndef THTK_ALLOC_H_
+#define THTK_ALLOC_H_
+
+#include <stddef.h>
+
+#ifndef THTK_EXPORT
+#define THTK_EXPORT /* */
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct thtk_allocator_t {
+    /* These work like malloc, realloc and free, user is passed as the first
+     * argument to each of them.  free may be NULL if memory is released some
+     * other way, such as by resetting an arena. */
+    void* (*malloc)(void* user, size_t size);
+    void* (*realloc)(void* user, void* ptr, size_t size);
+    void (*free)(void* user, void* ptr);
+    void* user;
+} thtk_allocator_t;
+
+/* Makes libthtk allocate all of its memory through allocator, which is
+ * copied.  NULL restores the C library functions.  Memory is always released
+ * through the allocator it came from, so this must not be called while any
+ * libthtk object or error is still alive, or while another thread is using
+ * libthtk.  Archives can be given an allocator of their own with
+ * thdat_open_with_allocator and thdat_create_with_allocator. */
+THTK_EXPORT void thtk_set_allocator(
+    const thtk_allocator_t* allocator);
+
+/* Allocation functions which use the current allocator.  Buffers passed to
+ * thtk_io_open_memory have to come from these, as they are freed with
+ * thtk_free. */
+THTK_EXPORT void* thtk_malloc(
+    size_t size);
+THTK_EXPORT void* thtk_calloc(
+    size_t count,
+    size_t size);
+THTK_EXPORT void* thtk_realloc(
+    void* ptr,
+    size_t size);
+THTK_EXPORT void thtk_free(
+    void* ptr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
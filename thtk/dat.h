@@ -32,6 +32,8 @@
 #ifdef HAVE_SYS_TYPES_H
 #include <sys/types.h>
 #endif
+#include <inttypes.h>
+#include <thtk/alloc.h>
 #include <thtk/error.h>
 #include <thtk/io.h>
 
@@ -58,6 +60,17 @@ THTK_EXPORT thdat_t* thdat_open(
     thtk_io_t* input,
     thtk_error_t** error);
 
+/* Like thdat_open, but the archive object, its entry table and names are
+ * allocated through allocator, which is copied.  This lets archives used by
+ * different threads draw from separate allocators or arenas.  Buffers that
+ * only live for the duration of a call still come from the allocator set
+ * with thtk_set_allocator.  NULL behaves like thdat_open. */
+THTK_EXPORT thdat_t* thdat_open_with_allocator(
+    unsigned int version,
+    thtk_io_t* input,
+    const thtk_allocator_t* allocator,
+    thtk_error_t** error);
+
 /* Creates an archive with entry_count empty entries.
  *
  * The stream has its reading position reset to zero before writing starts.
@@ -68,6 +81,14 @@ THTK_EXPORT thdat_t* thdat_create(
     size_t entry_count,
     thtk_error_t** error);
 
+/* Like thdat_create, with allocator used as by thdat_open_with_allocator. */
+THTK_EXPORT thdat_t* thdat_create_with_allocator(
+    unsigned int version,
+    thtk_io_t* output,
+    size_t entry_count,
+    const thtk_allocator_t* allocator,
+    thtk_error_t** error);
+
 /* Initializes the given archive.
  *
  * This function should be called manually when you create th105 archive,
@@ -88,6 +109,52 @@ THTK_EXPORT int thdat_close(
 THTK_EXPORT void thdat_free(
     thdat_t* thdat);
 
+/* Writes the entry table of an opened archive to output, in a format that can
+ * be loaded again by thdat_open_index without parsing the archive.
+ * archive_size and archive_mtime should describe the archive file, they are
+ * stored in the index and used to check whether it is still valid.  0
+ * indicates an error. */
+THTK_EXPORT int thdat_write_index(
+    thdat_t* thdat,
+    thtk_io_t* output,
+    uint64_t archive_size,
+    uint64_t archive_mtime,
+    thtk_error_t** error);
+
+/* Opens an archive like thdat_open, but loads the entry table from an index
+ * written by thdat_write_index.  NULL is returned if the index doesn't match
+ * the version, archive_size and archive_mtime passed, or if the header or
+ * file table read from input differ from when the index was written; the
+ * caller should then fall back to thdat_open.  A version of 0 accepts any version stored in the
+ * index. */
+THTK_EXPORT thdat_t* thdat_open_index(
+    unsigned int version,
+    thtk_io_t* input,
+    thtk_io_t* index,
+    uint64_t archive_size,
+    uint64_t archive_mtime,
+    thtk_error_t** error);
+
+/* Returns the archive version stored in an index written by
+ * thdat_write_index.  This can be used to skip version detection for
+ * archives with a valid index.  0 is returned if the index doesn't match
+ * archive_size and archive_mtime, or on error. */
+THTK_EXPORT unsigned int thdat_index_version(
+    thtk_io_t* index,
+    uint64_t archive_size,
+    uint64_t archive_mtime,
+    thtk_error_t** error);
+
+/* Makes entries with identical content share the same stored data when
+ * creating an archive.  Must be called before any data is written.  Only
+ * formats which store an offset for every entry (thdat08, thdat95 and
+ * thdat105) support this; note that the games might not expect several
+ * entries to point at the same data.  0 indicates an error. */
+THTK_EXPORT int thdat_set_dedup(
+    thdat_t* thdat,
+    int enable,
+    thtk_error_t** error);
+
 /* Returns the number of entries in in the archive.  -1 indicates an error. */
 THTK_EXPORT ssize_t thdat_entry_count(
     thdat_t* thdat,
@@ -99,7 +99,7 @@ static int detect_ver_to_idx(int ver) {
 
 #define SET_OUT(x) do { \
    int macrotemp = detect_ver_to_idx(x); \
-   out[macrotemp/32] |= 1 << (macrotemp%32); \
+   out[macrotemp/32] |= 1u << (macrotemp%32); \
 } while(0)
 
 /* Define a few things for filename strings:
@@ -120,11 +120,11 @@ static int detect_ver_to_idx(int ver) {
         int size = MultiByteToWideChar(CP_ACP, 0, str, -1, NULL, 0);
         assert(size);
         if(!size) return NULL;
-        wchar_t* wcs = malloc(sizeof(wchar_t) * size);
+        wchar_t* wcs = thtk_malloc(sizeof(wchar_t) * size);
         size = MultiByteToWideChar(CP_ACP, 0, str, -1, wcs, size);
         assert(size);
         if(!size) {
-            free(wcs);
+            thtk_free(wcs);
             return NULL;
         }
         return wcs;
@@ -141,7 +141,7 @@ static int detect_ver_to_idx(int ver) {
         wchar_t *wb = str2wcs(b);
         if(!wb) return !0;
         int rv = wcscmp(a,wb);
-        free(wb);
+        thtk_free(wb);
         return rv;
     }
 #endif
@@ -312,7 +312,7 @@ thdat_detect_filename(
     wchar_t* wfn = str2wcs(filename);
     if(!wfn) return -1;
     int rv = thdat_detect_filename_fn(wfn);
-    free(wfn);
+    thtk_free(wfn);
     return rv;
 }
 int
@@ -324,54 +324,162 @@ thdat_detect_filename_w(
 }
 #endif
 
-/* returns 0 if unknown, -1 on error */
+/* Returns the version identified by a name from the file list, 0 if the name
+ * isn't useful, or -2 if it means that the version can't be determined. */
+static int
+thdat_detect_08_95_name(
+    const char* name,
+    size_t len,
+    int is95)
+{
+    // thXX_YYYYY.ver
+    if (len > 4 && !strcmp(name+len-4, ".ver")) {
+        if (name[0] == 't' && name[1] == 'h') {
+            unsigned long n = strtoul(name+2, NULL, 10);
+            switch (n) {
+                case 8: case 9:
+                    if (!is95)
+                        return n;
+                    break;
+                case 95: case 10: case 11: case 12:
+                case 125: case 128: case 13: case 14:
+                case 143: case 15: case 16: case 165:
+                case 17: case 18: case 185: case 19:
+                case 20: /* NEWHU: 20 */
+                    if (is95)
+                        return n;
+                    break;
+            }
+        }
+        // finding any ver file means we can stop looking, even if we don't recognize it.
+        return -2;
+    }
+
+    // alcostg doesn't have a ver file
+    static const char albgmfmt[] = "albgm.fmt";
+    if (is95 && len == sizeof(albgmfmt)-1 && !strcmp(name, albgmfmt))
+        return 103;
+
+    return 0;
+}
+
+/* Reads the file list of a PBGZ or THA1 archive and looks for a name that
+ * identifies the game.  Instead of opening the archive, only as much of the
+ * list is decompressed as is needed to reach such a name.
+ *
+ * Returns 0 if unknown, -1 on error. */
 static int
 thdat_detect_08_95(
     thtk_io_t* input,
     int is95)
 {
-    // Encryption for file entries is the same across all thdat08/95 based games.
-    thdat_t *thdat = thdat_open(is95 ? 95 : 8, input, NULL);
-    if (thdat) {
-        // We go in reverse order, because that's where the files we look for usually are.
-        for (size_t i = thdat->entry_count-1; i+1 != 0; i--) {
-            const char *name = thdat->entries[i].name;
-            size_t len = strlen(name);
-
-            // thXX_YYYYY.ver
-            if (len > 4 && !strcmp(name+len-4, ".ver")) {
-                if (name[0] == 't' && name[1] == 'h') {
-                    unsigned long n = strtoul(name+2, NULL, 10);
-                    switch (n) {
-                        case 8: case 9:
-                            if (!is95)
-                                return n;
-                            break;
-                        case 95: case 10: case 11: case 12:
-                        case 125: case 128: case 13: case 14:
-                        case 143: case 15: case 16: case 165:
-                        case 17: case 18: case 185: case 19:
-                        case 20: /* NEWHU: 20 */
-                            if (is95)
-                                return n;
-                            break;
-                    }
-                }
-                // finding any ver file means we can stop looking, even if we don't recognize it.
-                return 0;
-            }
+    off_t filesize = thtk_io_seek(input, 0, SEEK_END, NULL);
+    if (filesize == -1 || thtk_io_seek(input, 0, SEEK_SET, NULL) == -1)
+        return -1;
 
-            // alcostg doesn't have a ver file
-            static const char albgmfmt[] = "albgm.fmt";
-            if (is95 && len == sizeof(albgmfmt)-1 && !strcmp(name, albgmfmt)) {
-                return 103;
-            }
-        }
-        thdat_free(thdat);
-        return 0;
+    /* Encryption for the file list is the same across all thdat08/95 based
+     * games. */
+    uint32_t list_size, list_count;
+    size_t zsize;
+    if (is95) {
+        th95_archive_header_t header;
+        if (thtk_io_read(input, &header, sizeof(header), NULL) != sizeof(header))
+            return -1;
+        th_decrypt((unsigned char*)&header, sizeof(header), 0x1b, 0x37,
+            sizeof(header), sizeof(header));
+        list_size = header.size - 123456789;
+        zsize = header.zsize - 987654321;
+        list_count = header.entry_count - 135792468;
+        if (zsize > (uint64_t)filesize - sizeof(header) ||
+            thtk_io_seek(input, filesize - zsize, SEEK_SET, NULL) == -1)
+            return -1;
     } else {
+        th08_archive_header_t header;
+        if (thtk_io_read(input, &header, sizeof(header), NULL) != sizeof(header))
+            return -1;
+        th_decrypt((unsigned char*)&header + 4, sizeof(header) - 4, 0x1b, 0x37,
+            sizeof(header) - 4, 0x400);
+        list_count = header.count - 123456;
+        list_size = header.size - 567891;
+        const uint32_t offset = header.offset - 345678;
+        if (offset > filesize ||
+            thtk_io_seek(input, offset, SEEK_SET, NULL) == -1)
+            return -1;
+        zsize = filesize - offset;
+    }
+
+    unsigned char* zdata = thtk_malloc(zsize);
+    if (!zdata)
+        return -1;
+    if (thtk_io_read(input, zdata, zsize, NULL) != (ssize_t)zsize) {
+        thtk_free(zdata);
         return -1;
     }
+    th_decrypt(zdata, zsize, 0x3e, 0x9b, 0x80, is95 ? zsize : 0x400);
+
+    /* th_unlzss can't be resumed, so growing prefixes of the list are
+     * decompressed until the name is found, while entries already looked at
+     * are skipped. */
+    int ret = 0;
+    size_t pos = 0;
+    uint32_t entry = 0;
+    size_t want = 0;
+    while (ret == 0 && entry < list_count && want < list_size) {
+        want = want ? want * 4 : 16384;
+        if (want > list_size)
+            want = list_size;
+
+        /* LZSS needs at most 9 bits per output byte. */
+        size_t zwant = want + want / 8 + 16;
+        if (zwant > zsize)
+            zwant = zsize;
+        unsigned char* zcopy = thtk_malloc(zwant);
+        if (!zcopy) {
+            ret = -1;
+            break;
+        }
+        memcpy(zcopy, zdata, zwant);
+        /* zstream owns zcopy once it's open. */
+        thtk_io_t* zstream = thtk_io_open_memory(zcopy, zwant, NULL);
+        thtk_io_t* stream = zstream ? thtk_io_open_growing_memory(NULL) : NULL;
+        if (!zstream || !stream) {
+            if (zstream)
+                thtk_io_close(zstream);
+            else
+                thtk_free(zcopy);
+            ret = -1;
+            break;
+        }
+        ssize_t got = th_unlzss(zstream, stream, want, NULL);
+        thtk_io_close(zstream);
+        unsigned char* data = got > 0 ? thtk_io_map(stream, 0, got, NULL) : NULL;
+        if (!data) {
+            thtk_io_close(stream);
+            ret = got == -1 ? -1 : 0;
+            break;
+        }
+
+        while (ret == 0 && entry < list_count && pos < (size_t)got) {
+            const char* name = (const char*)data + pos;
+            const char* nul = memchr(name, 0, got - pos);
+            if (!nul)
+                break;
+            const size_t len = nul - name;
+            ret = thdat_detect_08_95_name(name, len, is95);
+            pos += (is95 ? len + (4 - len % 4) : len + 1) + sizeof(uint32_t) * 3;
+            ++entry;
+        }
+
+        thtk_io_unmap(stream, data);
+        thtk_io_close(stream);
+
+        /* The compressed data ended early. */
+        if ((size_t)got < want)
+            break;
+    }
+
+    thtk_free(zdata);
+    return ret == -2 ? 0 : ret;
 }
 
 static int
@@ -627,7 +735,7 @@ thdat_detect_iter(
         uint32_t v = out[i];
         int j=0;
         for(;!(v&1);v>>=1, j++);
-        out[i] &= ~0u << (j+1);
+        out[i] &= out[i] - 1; /* clear the lowest bit, j can be 31 */
         int entry_num = i*32 + j;
         if(entry_num >= DETECT_ENTRIES) { /* non-existent entry */
             out[0]=out[1]=out[2]=out[3] = 0;
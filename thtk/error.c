@@ -31,12 +31,83 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <thtk/alloc.h>
 #include <thtk/error.h>
+#include "util.h"
+
+#if defined(_MSC_VER)
+# define THTK_THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__)
+# define THTK_THREAD_LOCAL __thread
+#endif
 
 struct thtk_error_t {
+    /* Set for errors allocated with malloc which may become the cached error
+     * of the thread that frees them. */
+    int cached;
+    const char* function;
+    /* A message without arguments, only formatted when it's asked for. */
+    const char* format;
+    /* Points at text, or at an allocation for messages which don't fit. */
     char* message;
+    char text[256];
 };
 
+#ifdef THTK_THREAD_LOCAL
+/* An unused error kept by each thread.  It's taken out of the cache while in
+ * use, so errors freed on another thread than the one that created them are
+ * never shared between threads.  Allocated with malloc rather than
+ * thtk_malloc, as it must survive allocator changes; the one left in the
+ * cache isn't freed when the thread exits. */
+static THTK_THREAD_LOCAL thtk_error_t* thtk_error_cache;
+#endif
+
+static thtk_error_t*
+thtk_error_get(void)
+{
+    thtk_error_t* error;
+#ifdef THTK_THREAD_LOCAL
+    if ((error = thtk_error_cache)) {
+        thtk_error_cache = NULL;
+        return error;
+    }
+    error = malloc(sizeof(*error));
+    if (error)
+        error->cached = 1;
+#else
+    error = thtk_malloc(sizeof(*error));
+    if (error)
+        error->cached = 0;
+#endif
+    return error;
+}
+
+static void
+thtk_error_format(
+    thtk_error_t* e,
+    const char* function,
+    const char* message,
+    va_list ap)
+{
+    va_list aq;
+    int funlen, msglen;
+
+    funlen = strlen(function);
+    va_copy(aq, ap);
+    msglen = vsnprintf(NULL, 0, message, aq);
+    va_end(aq);
+
+    if ((size_t)(funlen + 2 + msglen + 1) <= sizeof(e->text))
+        e->message = e->text;
+    else if (!(e->message = thtk_malloc(funlen + 2 + msglen + 1))) {
+        e->function = "thtk_error_format";
+        e->format = "out of memory";
+        return;
+    }
+    sprintf(e->message, "%s: ", function);
+    vsnprintf(e->message + funlen + 2, msglen + 1, message, ap);
+}
+
 void
 thtk_error_func_new(
     thtk_error_t** error,
@@ -45,23 +116,46 @@ thtk_error_func_new(
     ...)
 {
     va_list ap;
-    int funlen, msglen;
-    char *buf;
-    if (error) {
-        funlen = strlen(function);
-        va_start(ap, message);
-        msglen = vsnprintf(NULL, 0, message, ap);
-        va_end(ap);
-
-        buf = malloc(funlen + 2 + msglen + 1);
-        sprintf(buf, "%s: ", function);
-        va_start(ap, message);
-        vsnprintf(buf + funlen + 2, msglen + 1, message, ap);
-        va_end(ap);
-
-        *error = malloc(sizeof(**error));
-        (*error)->message = buf;
+    thtk_error_t* e;
+    if (!error || !(e = thtk_error_get()))
+        return;
+
+    /* Neither string has to outlive the call, so the message is always
+     * formatted right away. */
+    e->format = NULL;
+    e->message = NULL;
+    *error = e;
+
+    va_start(ap, message);
+    thtk_error_format(e, function, message, ap);
+    va_end(ap);
+}
+
+void
+thtk_error_func_literal(
+    thtk_error_t** error,
+    const char* function,
+    const char* message,
+    ...)
+{
+    va_list ap;
+    thtk_error_t* e;
+    if (!error || !(e = thtk_error_get()))
+        return;
+
+    e->function = function;
+    e->format = NULL;
+    e->message = NULL;
+    *error = e;
+
+    if (!strchr(message, '%')) {
+        e->format = message;
+        return;
     }
+
+    va_start(ap, message);
+    thtk_error_format(e, function, message, ap);
+    va_end(ap);
 }
 
 const char*
@@ -70,6 +164,14 @@ thtk_error_message(
 {
     if (!error)
         return "(error is NULL)";
+    if (!error->message) {
+        const size_t size = strlen(error->function) + 2 + strlen(error->format) + 1;
+        if (size <= sizeof(error->text))
+            error->message = error->text;
+        else if (!(error->message = thtk_malloc(size)))
+            return error->format;
+        sprintf(error->message, "%s: %s", error->function, error->format);
+    }
     return error->message;
 }
 
@@ -77,10 +179,18 @@ void
 thtk_error_free(
     thtk_error_t** error)
 {
-    if (error && *error)
-        free((*error)->message);
-    if (error) {
-        free(*error);
+    if (error && *error) {
+        thtk_error_t* e = *error;
+        if (e->message != e->text)
+            thtk_free(e->message);
+#ifdef THTK_THREAD_LOCAL
+        if (e->cached && !thtk_error_cache)
+            thtk_error_cache = e;
+        else if (e->cached)
+            free(e);
+        else
+#endif
+            thtk_free(e);
         *error = NULL;
     }
 }
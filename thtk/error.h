@@ -42,7 +42,10 @@ typedef struct thtk_error_t thtk_error_t;
 /* Creates a new error for the current function. */
 #define thtk_error_new(error, ...) thtk_error_func_new(error, __func__, __VA_ARGS__)
 
-/* Stores a pointer to an error structure if error is not NULL. */
+/* Stores a pointer to an error structure if error is not NULL.  message is a
+ * printf format.  Creating and freeing an error doesn't allocate memory in
+ * the common case: each thread keeps the last error it freed for reuse,
+ * which is not released when the thread exits. */
 THTK_EXPORT void thtk_error_func_new(
     thtk_error_t** error,
     const char* function,
@@ -32,7 +32,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <thtk/alloc.h>
 #include <thtk/io.h>
+#include "trace.h"
+#include "util.h"
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
@@ -130,9 +134,9 @@ thtk_io_map(
     if (io->v->map) {
         return io->v->map(io, offset, count, error);
     } else {
-        unsigned char* map = malloc(count);
+        unsigned char* map = thtk_malloc(count);
         if (thtk_io_pread(io, map, count, offset, error) != (ssize_t)count) {
-            free(map);
+            thtk_free(map);
             return NULL;
         }
         return map;
@@ -151,7 +155,7 @@ thtk_io_unmap(
         if (io->v->unmap)
             io->v->unmap(io, map);
     } else {
-        free(map);
+        thtk_free(map);
     }
 }
 
@@ -164,7 +168,7 @@ thtk_io_close(
         return 0;
     }
     ret = io->v->close(io);
-    free(io);
+    thtk_free(io);
     return ret;
 }
 
@@ -184,8 +188,10 @@ thtk_io_pread(
     if (io->v->pread) {
         ret = io->v->pread(io, buf, count, offset, error);
     } else {
+        TRACE_BEGIN(wait);
 #pragma omp critical
         {
+            TRACE_END(wait, "lock wait", NULL);
             off_t old;
             ret = -1;
             if ((old = thtk_io_seek(io, 0, SEEK_CUR, error)) != -1)
@@ -221,8 +227,10 @@ thtk_io_pwrite(
     if (io->v->pwrite) {
         ret = io->v->pwrite(io, buf, count, offset, error);
     } else {
+        TRACE_BEGIN(wait);
 #pragma omp critical
         {
+            TRACE_END(wait, "lock wait", NULL);
             off_t old;
             ret = -1;
             if ((old = thtk_io_seek(io, 0, SEEK_CUR, error)) != -1)
@@ -287,13 +295,12 @@ thtk_io_file_seek(
     thtk_error_t** error)
 {
     struct thtk_io_file *private = (void *)io;
-    /* TODO: use fseeko on Unix, _fseeki64 on Windows */
-    if (fseek(private->stream, (long)offset, whence) == -1) {
+    if (fseeko(private->stream, offset, whence) == -1) {
         thtk_error_new(error, "error while seeking: %s", strerror(errno));
         return (off_t)-1;
     }
 
-    return ftell(private->stream);
+    return ftello(private->stream);
 }
 
 #if defined(HAVE_MMAP) && (defined(MAP_ANON) || defined(MAP_ANONYMOUS))
@@ -456,7 +463,8 @@ thtk_io_file_pread(
     struct thtk_io_file *private = (void *)io;
     OVERLAPPED ovl;
     memset(&ovl, 0, sizeof(ovl));
-    ovl.Offset = offset; /* TODO: OffsetHigh */
+    ovl.Offset = (DWORD)offset;
+    ovl.OffsetHigh = (DWORD)((uint64_t)offset >> 32);
     DWORD nread;
     BOOL ret = ReadFile((HANDLE)_get_osfhandle(fileno_unlocked(private->stream)), buf, count, &nread, &ovl);
     if (!ret) {
@@ -482,7 +490,8 @@ thtk_io_file_pwrite(
     struct thtk_io_file *private = (void *)io;
     OVERLAPPED ovl;
     memset(&ovl, 0, sizeof(ovl));
-    ovl.Offset = offset; /* TODO: OffsetHigh */
+    ovl.Offset = (DWORD)offset;
+    ovl.OffsetHigh = (DWORD)((uint64_t)offset >> 32);
     DWORD nwritten;
     BOOL ret = WriteFile((HANDLE)_get_osfhandle(fileno_unlocked(private->stream)), buf, count, &nwritten, &ovl);
     if (!ret) {
@@ -520,13 +529,13 @@ thtk_io_open_file(
     const char* mode,
     thtk_error_t** error)
 {
-    struct thtk_io_file *private = malloc(sizeof(*private));
+    struct thtk_io_file *private = thtk_malloc(sizeof(*private));
     private->io.v = &thtk_io_file_vtable;
     private->stream = fopen(path, mode);
 
     if (!private->stream) {
         thtk_error_new(error, "error while opening file `%s': %s", path, strerror(errno));
-        free(private);
+        thtk_free(private);
         return NULL;
     }
 
@@ -540,13 +549,13 @@ thtk_io_open_file_w(
     const wchar_t* mode,
     thtk_error_t** error)
 {
-    struct thtk_io_file *private = malloc(sizeof(*private));
+    struct thtk_io_file *private = thtk_malloc(sizeof(*private));
     private->io.v = &thtk_io_file_vtable;
     private->stream = _wfopen(path, mode);
 
     if (!private->stream) {
         thtk_error_new(error, "error while opening file `%S': %s", path, strerror(errno));
-        free(private);
+        thtk_free(private);
         return NULL;
     }
 
@@ -554,6 +563,96 @@ thtk_io_open_file_w(
 }
 #endif
 
+#ifdef HAVE_COPY_FILE_RANGE
+/* Returns -2 if the file system can't copy between these files. */
+static ssize_t
+thtk_io_file_copy(
+    thtk_io_t* output,
+    thtk_io_t* input,
+    off_t offset,
+    size_t count,
+    thtk_error_t** error)
+{
+    struct thtk_io_file *out = (void *)output;
+    struct thtk_io_file *in = (void *)input;
+    loff_t in_offset = offset;
+    loff_t out_offset;
+    size_t done = 0;
+
+    /* Buffered data has to reach the file before the kernel appends to it. */
+    if (fflush(out->stream) != 0 || (out_offset = ftello(out->stream)) == -1) {
+        thtk_error_new(error, "error while writing: %s", strerror(errno));
+        return -1;
+    }
+
+    while (done < count) {
+        ssize_t ret = copy_file_range(fileno_unlocked(in->stream), &in_offset,
+            fileno_unlocked(out->stream), &out_offset, count - done, 0);
+        if (ret == -1) {
+            if (!done && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+                return -2;
+            thtk_error_new(error, "error while copying: %s", strerror(errno));
+            return -1;
+        }
+        if (ret == 0) {
+            thtk_error_new(error, "short read");
+            return -1;
+        }
+        done += ret;
+    }
+
+    if (fseeko(out->stream, out_offset, SEEK_SET) == -1) {
+        thtk_error_new(error, "error while seeking: %s", strerror(errno));
+        return -1;
+    }
+
+    return done;
+}
+#endif
+
+/* Size of the buffer used when the data can't be copied directly. */
+#define THTK_IO_COPY_CHUNK (256 * 1024)
+
+ssize_t
+thtk_io_copy(
+    thtk_io_t* output,
+    thtk_io_t* input,
+    off_t offset,
+    size_t count,
+    thtk_error_t** error)
+{
+    if (!output || !input) {
+        thtk_error_new(error, "invalid parameter passed");
+        return -1;
+    }
+    if (!count)
+        return 0;
+
+#ifdef HAVE_COPY_FILE_RANGE
+    if (output->v == &thtk_io_file_vtable && input->v == &thtk_io_file_vtable) {
+        ssize_t ret = thtk_io_file_copy(output, input, offset, count, error);
+        if (ret != -2)
+            return ret;
+    }
+#endif
+
+    const size_t chunk = count < THTK_IO_COPY_CHUNK ? count : THTK_IO_COPY_CHUNK;
+    unsigned char* buf = thtk_malloc(chunk);
+    size_t done = 0;
+    while (done < count) {
+        const size_t n = count - done < chunk ? count - done : chunk;
+        if (thtk_io_pread(input, buf, n, offset + done, error) != (ssize_t)n ||
+            thtk_io_write(output, buf, n, error) != (ssize_t)n) {
+            thtk_free(buf);
+            return -1;
+        }
+        done += n;
+    }
+    thtk_free(buf);
+
+    return done;
+}
+
 struct thtk_io_memory {
     thtk_io_t io;
     off_t offset;
@@ -652,7 +751,7 @@ thtk_io_memory_close(
     thtk_io_t* io)
 {
     struct thtk_io_memory *private = (void *)io;
-    free(private->memory);
+    thtk_free(private->memory);
     return 1;
 }
 
@@ -671,8 +770,11 @@ thtk_io_open_memory(
     size_t size,
     thtk_error_t** error)
 {
-    (void)error;
-    struct thtk_io_memory *private = malloc(sizeof(*private));
+    struct thtk_io_memory *private = thtk_malloc(sizeof(*private));
+    if (!private) {
+        thtk_error_new(error, "out of memory");
+        return NULL;
+    }
     private->io.v = &thtk_io_memory_vtable;
     private->offset = 0;
     private->size = size;
@@ -724,7 +826,7 @@ thtk_io_growing_memory_write(
                     private->memory_size <<= 1;
                 }
             }
-            private->memory = realloc(private->memory, private->memory_size);
+            private->memory = thtk_realloc(private->memory, private->memory_size);
         }
     }
     memcpy((unsigned char*)(private->memory) + private->offset, buf, count);
@@ -791,7 +893,7 @@ thtk_io_growing_memory_close(
     thtk_io_t* io)
 {
     struct thtk_io_growing_memory *private = (void *)io;
-    free(private->memory);
+    thtk_free(private->memory);
     return 1;
 }
 
@@ -808,8 +910,11 @@ thtk_io_t*
 thtk_io_open_growing_memory(
     thtk_error_t** error)
 {
-    (void)error;
-    struct thtk_io_growing_memory *private = malloc(sizeof(*private));
+    struct thtk_io_growing_memory *private = thtk_malloc(sizeof(*private));
+    if (!private) {
+        thtk_error_new(error, "out of memory");
+        return NULL;
+    }
     private->io.v = &thtk_io_growing_memory_vtable;
     private->offset = 0;
     private->size = 0;
@@ -818,3 +923,89 @@ thtk_io_open_growing_memory(
 
     return &private->io;
 }
+
+struct thtk_io_callback {
+    thtk_io_t io;
+    off_t offset;
+    ssize_t (*write)(void *data, const void *buf, size_t count, thtk_error_t **error);
+    void *data;
+};
+
+static ssize_t
+thtk_io_callback_read(
+    thtk_io_t* io,
+    void* buf,
+    size_t count,
+    thtk_error_t** error)
+{
+    (void)io;
+    (void)buf;
+    (void)count;
+    thtk_error_new(error, "reading is not supported");
+    return -1;
+}
+
+static ssize_t
+thtk_io_callback_write(
+    thtk_io_t* io,
+    const void* buf,
+    size_t count,
+    thtk_error_t** error)
+{
+    struct thtk_io_callback *private = (void *)io;
+    ssize_t ret = private->write(private->data, buf, count, error);
+    if (ret > 0)
+        private->offset += ret;
+    return ret;
+}
+
+static off_t
+thtk_io_callback_seek(
+    thtk_io_t* io,
+    off_t offset,
+    int whence,
+    thtk_error_t** error)
+{
+    struct thtk_io_callback *private = (void *)io;
+    if (whence != SEEK_CUR || offset != 0) {
+        thtk_error_new(error, "seeking is not supported");
+        return (off_t)-1;
+    }
+    return private->offset;
+}
+
+static int
+thtk_io_callback_close(
+    thtk_io_t* io)
+{
+    (void)io;
+    return 1;
+}
+
+static const struct thtk_io_vtable
+thtk_io_callback_vtable = {
+    .read   = thtk_io_callback_read,
+    .write  = thtk_io_callback_write,
+    .seek   = thtk_io_callback_seek,
+    .close  = thtk_io_callback_close,
+};
+
+thtk_io_t*
+thtk_io_open_write_callback(
+    ssize_t (*write)(void* data, const void* buf, size_t count, thtk_error_t** error),
+    void* data,
+    thtk_error_t** error)
+{
+    struct thtk_io_callback *private;
+    if (!write) {
+        thtk_error_new(error, "invalid parameter passed");
+        return NULL;
+    }
+    private = thtk_malloc(sizeof(*private));
+    private->io.v = &thtk_io_callback_vtable;
+    private->offset = 0;
+    private->write = write;
+    private->data = data;
+
+    return &private->io;
+}
@@ -29,6 +29,16 @@
 #ifndef THTK_IO_H_
 #define THTK_IO_H_
 
+/* libthtk uses a 64-bit off_t.  Elsewhere it takes -D_FILE_OFFSET_BITS=64,
+ * as listed in thtk.pc, but the VCRT only has a 32-bit one, which is
+ * replaced here; this header must then be included before sys/types.h.
+ * config.h does the same for libthtk itself. */
+#if defined(_MSC_VER) && !defined(_OFF_T_DEFINED)
+# define _OFF_T_DEFINED
+typedef long _off_t;
+typedef __int64 off_t;
+#endif
+
 #ifdef HAVE_SYS_TYPES_H
 #include <sys/types.h>
 #endif
@@ -39,6 +49,9 @@
 extern "C" {
 #endif
 
+/* Fails to compile if off_t doesn't match the one libthtk was built with. */
+typedef char thtk_off_t_is_64_bits[sizeof(off_t) == 8 ? 1 : -1];
+
 typedef struct thtk_io_t thtk_io_t;
 
 /* See the documentation for read(2).  Returns the number of bytes read, or -1
@@ -62,16 +75,26 @@ THTK_EXPORT ssize_t thtk_io_pread(thtk_io_t* io, void* buf, size_t count, off_t
 /* See the documentation for pwrite(2).  Returns the number of bytes written, or
  * -1 on error. */
 THTK_EXPORT ssize_t thtk_io_pwrite(thtk_io_t* io, const void* buf, size_t count, off_t offset, thtk_error_t** error);
+/* Writes count bytes from input, starting at offset, to the current position
+ * of output.  The data is copied inside the kernel when both objects are
+ * files and the system supports it.  Returns the number of bytes written, or
+ * -1 on error. */
+THTK_EXPORT ssize_t thtk_io_copy(thtk_io_t* output, thtk_io_t* input, off_t offset, size_t count, thtk_error_t** error);
 
 /* Opens a file in the mode specified, the mode works as it does for fopen. */
 THTK_EXPORT thtk_io_t* thtk_io_open_file(const char* path, const char* mode, thtk_error_t** error);
 #ifdef _WIN32
 THTK_EXPORT thtk_io_t* thtk_io_open_file_w(const wchar_t* path, const wchar_t* mode, thtk_error_t** error);
 #endif
-/* Opens a memory buffer for IO. */
+/* Opens a memory buffer for IO.  The buffer is released with thtk_free when
+ * the object is closed. */
 THTK_EXPORT thtk_io_t* thtk_io_open_memory(void* buf, size_t size, thtk_error_t** error);
 /* Creates a new memory buffer that automatically expands. */
 THTK_EXPORT thtk_io_t* thtk_io_open_growing_memory(thtk_error_t** error);
+/* Creates a write-only object which passes everything written to it on to the
+ * write function.  Seeking is limited to thtk_io_seek(io, 0, SEEK_CUR), which
+ * returns the number of bytes written so far. */
+THTK_EXPORT thtk_io_t* thtk_io_open_write_callback(ssize_t (*write)(void* data, const void* buf, size_t count, thtk_error_t** error), void* data, thtk_error_t** error);
 
 #ifdef __cplusplus
 }
@@ -30,6 +30,7 @@
 #include <config.h>
 #include <stdlib.h>
 #include "rng_mt.h"
+#include "simd.h"
 
 #define N 624
 #define M 397
@@ -50,37 +51,123 @@ rng_mt_init(
     rng->mti = N;
 }
 
+static uint32_t
+rng_mt_twist(
+    uint32_t a,
+    uint32_t b,
+    uint32_t m)
+{
+    static const uint32_t mag01[2] = {0x0UL, 0x9908b0dfUL};
+    uint32_t t = (a&UPPER_MASK) | (b&LOWER_MASK);
+    return m ^ (t>>1) ^ mag01[t&1];
+}
+
+#ifdef THTK_SSE2
+/* Computes four consecutive words at once.  a is mt[i..i+3], b is
+ * mt[i+1..i+4] and m is the word M positions ahead. */
+static __m128i
+rng_mt_twist4(
+    __m128i a,
+    __m128i b,
+    __m128i m)
+{
+    const __m128i t = _mm_or_si128(
+        _mm_and_si128(a, _mm_set1_epi32((int)UPPER_MASK)),
+        _mm_and_si128(b, _mm_set1_epi32(LOWER_MASK)));
+    const __m128i odd = _mm_cmpeq_epi32(
+        _mm_and_si128(t, _mm_set1_epi32(1)), _mm_set1_epi32(1));
+    return _mm_xor_si128(_mm_xor_si128(m, _mm_srli_epi32(t, 1)),
+        _mm_and_si128(odd, _mm_set1_epi32((int)0x9908b0dfUL)));
+}
+#endif
+
+/* Generates the next N words.  Each word only depends on words that come
+ * after it, or on ones that were already replaced at least M-N words
+ * before, so a few can be computed at once. */
+static void
+rng_mt_generate(
+    uint32_t *mt)
+{
+    int i = 0;
+
+#ifdef THTK_SSE2
+    for (; i + 4 <= N-M; i += 4) {
+        const __m128i v = rng_mt_twist4(
+            _mm_loadu_si128((const __m128i*)(mt + i)),
+            _mm_loadu_si128((const __m128i*)(mt + i + 1)),
+            _mm_loadu_si128((const __m128i*)(mt + i + M)));
+        _mm_storeu_si128((__m128i*)(mt + i), v);
+    }
+#endif
+    for (; i < N-M; ++i)
+        mt[i] = rng_mt_twist(mt[i], mt[i+1], mt[i+M]);
+#ifdef THTK_SSE2
+    for (; i + 4 <= N-1; i += 4) {
+        const __m128i v = rng_mt_twist4(
+            _mm_loadu_si128((const __m128i*)(mt + i)),
+            _mm_loadu_si128((const __m128i*)(mt + i + 1)),
+            _mm_loadu_si128((const __m128i*)(mt + i + (M-N))));
+        _mm_storeu_si128((__m128i*)(mt + i), v);
+    }
+#endif
+    for (; i < N-1; i++)
+        mt[i] = rng_mt_twist(mt[i], mt[i+1], mt[i+(M-N)]);
+    mt[N-1] = rng_mt_twist(mt[N-1], mt[0], mt[M-1]);
+}
+
+static uint32_t
+rng_mt_temper(
+    uint32_t y)
+{
+    y ^= (y>>11);
+    y ^= (y<<7) & 0x9d2c5680UL;
+    y ^= (y<<15) & 0xefc60000UL;
+    y ^= (y>>18);
+    return y;
+}
+
 uint32_t
 rng_mt_nextint(
     struct rng_mt *rng)
 {
-    uint32_t *mt = rng->mt;
-    uint32_t ret;
-    static uint32_t mag01[2] = {0x0UL, 0x9908b0dfUL};
     if (rng->mti >= N) {
-        int i;
-        uint32_t t;
-
-        for (i = 0; i < N-M; ++i) {
-            t = (mt[i]&UPPER_MASK) | (mt[i+1]&LOWER_MASK);
-            mt[i] = mt[i+M] ^ (t>>1) ^ mag01[t&1];
-        }
-        for (; i < N-1; i++) {
-            t = (mt[i]&UPPER_MASK) | (mt[i+1]&LOWER_MASK);
-            mt[i] = mt[i+(M-N)] ^ (t>>1) ^ mag01[t&1];
-        }
-        t = (mt[N-1]&UPPER_MASK) | (mt[0]&LOWER_MASK);
-        mt[N-1] = mt[M-1] ^ (t>>1) ^ mag01[t&1];
-
+        rng_mt_generate(rng->mt);
         rng->mti = 0;
     }
 
-    ret = mt[rng->mti++];
+    return rng_mt_temper(rng->mt[rng->mti++]);
+}
+
+void
+rng_mt_fill(
+    struct rng_mt *rng,
+    uint32_t *out,
+    size_t count)
+{
+    while (count) {
+        if (rng->mti >= N) {
+            rng_mt_generate(rng->mt);
+            rng->mti = 0;
+        }
 
-    ret ^= (ret>>11);
-    ret ^= (ret<<7) & 0x9d2c5680UL;
-    ret ^= (ret<<15) & 0xefc60000UL;
-    ret ^= (ret>>18);
+        const uint32_t *mt = rng->mt + rng->mti;
+        const size_t n = count < (size_t)(N - rng->mti) ? count : (size_t)(N - rng->mti);
+        size_t i = 0;
+#ifdef THTK_SSE2
+        for (; i + 4 <= n; i += 4) {
+            __m128i y = _mm_loadu_si128((const __m128i*)(mt + i));
+            y = _mm_xor_si128(y, _mm_srli_epi32(y, 11));
+            y = _mm_xor_si128(y, _mm_and_si128(_mm_slli_epi32(y, 7), _mm_set1_epi32((int)0x9d2c5680UL)));
+            y = _mm_xor_si128(y, _mm_and_si128(_mm_slli_epi32(y, 15), _mm_set1_epi32((int)0xefc60000UL)));
+            y = _mm_xor_si128(y, _mm_srli_epi32(y, 18));
+            _mm_storeu_si128((__m128i*)(out + i), y);
+        }
+#endif
+        for (; i < n; ++i)
+            out[i] = rng_mt_temper(mt[i]);
 
-    return ret;
+        rng->mti += n;
+        out += n;
+        count -= n;
+    }
 }
@@ -31,6 +31,7 @@
 #define RNG_MT_H_
 
 #include <inttypes.h>
+#include <stddef.h>
 
 struct rng_mt {
     uint32_t mt[624];
@@ -46,4 +47,12 @@ uint32_t
 rng_mt_nextint(
     struct rng_mt *rng);
 
+/* Stores the next count numbers in out, the same as calling rng_mt_nextint
+ * count times. */
+void
+rng_mt_fill(
+    struct rng_mt *rng,
+    uint32_t *out,
+    size_t count);
+
 #endif
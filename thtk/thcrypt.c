@@ -30,7 +30,9 @@
 #include <string.h>
 #include <stddef.h>
 #include <stdlib.h>
+#include <thtk/alloc.h>
 #include "thcrypt.h"
+#include "trace.h"
 
 void
 th_encrypt(
@@ -42,8 +44,9 @@ th_encrypt(
     unsigned int limit)
 {
     const unsigned char* end;
-    unsigned char* temp = malloc(block);
+    unsigned char* temp = thtk_malloc(block);
     unsigned int increment = (block >> 1) + (block & 1);
+    TRACE_BEGIN(span);
 
     if (size < block >> 2)
         size = 0;
@@ -80,7 +83,8 @@ th_encrypt(
         data += block;
     }
 
-    free(temp);
+    thtk_free(temp);
+    TRACE_END(span, "th_encrypt", NULL);
 }
 
 void
@@ -93,8 +97,9 @@ th_decrypt(
     unsigned int limit)
 {
     const unsigned char* end;
-    unsigned char* temp = malloc(block);
+    unsigned char* temp = thtk_malloc(block);
     unsigned int increment = (block >> 1) + (block & 1);
+    TRACE_BEGIN(span);
 
     if (size < block >> 2)
         size = 0;
@@ -131,5 +136,6 @@ th_decrypt(
         data += block;
     }
 
-    free(temp);
+    thtk_free(temp);
+    TRACE_END(span, "th_decrypt", NULL);
 }
@@ -32,6 +32,8 @@
 #include <stdlib.h>
 #include "thcrypt105.h"
 #include "rng_mt.h"
+#include "simd.h"
+#include "thxor.h"
 
 /* These function can be used for encrypting and decrypting. */
 void
@@ -42,11 +44,7 @@ th_crypt75_list(
     unsigned char step1,
     unsigned char step2)
 {
-    while (size-- > 0) {
-        *data++ ^= key;
-        key += step1;
-        step1 += step2;
-    }
+    th_xor(data, size, key, step1, step2);
 }
 
 void
@@ -56,9 +54,32 @@ th_crypt105_list(
     unsigned int key)
 {
     struct rng_mt rng;
+    uint32_t keys[624];
     rng_mt_init(&rng, key);
-    while (size-- > 0)
-        *data++ ^= rng_mt_nextint(&rng) & 0xff;
+    while (size > 0) {
+        const unsigned int n = size < 624 ? size : 624;
+        unsigned int i = 0;
+        rng_mt_fill(&rng, keys, n);
+#ifdef THTK_SSE2
+        /* Pack the low bytes of 16 numbers and XOR them at once. */
+        const __m128i mask = _mm_set1_epi32(0xff);
+        for (; i + 16 <= n; i += 16) {
+            const __m128i k01 = _mm_packs_epi32(
+                _mm_and_si128(_mm_loadu_si128((const __m128i*)(keys + i)), mask),
+                _mm_and_si128(_mm_loadu_si128((const __m128i*)(keys + i + 4)), mask));
+            const __m128i k23 = _mm_packs_epi32(
+                _mm_and_si128(_mm_loadu_si128((const __m128i*)(keys + i + 8)), mask),
+                _mm_and_si128(_mm_loadu_si128((const __m128i*)(keys + i + 12)), mask));
+            const __m128i d = _mm_loadu_si128((const __m128i*)(data + i));
+            _mm_storeu_si128((__m128i*)(data + i),
+                _mm_xor_si128(d, _mm_packus_epi16(k01, k23)));
+        }
+#endif
+        for (; i < n; ++i)
+            data[i] ^= keys[i] & 0xff;
+        data += n;
+        size -= n;
+    }
 }
 
 void
@@ -68,9 +89,5 @@ th_crypt105_file(
     unsigned int offset,
     unsigned char or_key)
 {
-    unsigned char key = ((offset>>1) | or_key) & 0xff;
-    unsigned int i;
-    for (i = 0; i < size; i++) {
-        data[i] ^= key;
-    }
+    th_xor(data, size, ((offset>>1) | or_key) & 0xff, 0, 0);
 }
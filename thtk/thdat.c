@@ -28,11 +28,14 @@
  */
 #include <config.h>
 #include <ctype.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <thtk/thtk.h>
 #include "thdat.h"
 #include "thrle.h"
+#include "trace.h"
+#include "util.h"
 
 extern const thdat_module_t archive_th02;
 extern const thdat_module_t archive_th06;
@@ -41,6 +44,33 @@ extern const thdat_module_t archive_th08;
 extern const thdat_module_t archive_th95;
 extern const thdat_module_t archive_th105;
 
+struct thdat_dedup_t {
+    /* Open addressing hash table of entry indices plus one, zero marks a free
+     * slot.  The size is a power of two. */
+    size_t table_size;
+    size_t table_used;
+    size_t* table;
+    /* Per entry. */
+    uint64_t* hashes;
+    size_t* sizes;
+    uint32_t* keys;
+    /* Index of the entry whose data is shared, or -1. */
+    ssize_t* copy_of;
+};
+
+/* The entry table, names and dedup tables are packed into large blocks which
+ * are never moved, so entries can keep pointers into them. */
+#define THDAT_ARENA_BLOCK_SIZE 16384
+/* Enough for anything stored in the entry tables. */
+#define THDAT_ARENA_ALIGN 16
+
+struct thdat_arena_block_t {
+    thdat_arena_block_t* next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+
 static const thdat_module_t*
 thdat_version_to_module(
     unsigned int version,
@@ -97,42 +127,176 @@ thdat_entry_init(
     thdat_entry_t* entry)
 {
     if (entry) {
-        memset(entry->name, 0, sizeof(entry->name));
+        entry->name = "";
         entry->extra = 0;
         entry->offset = entry->zsize = entry->size = -1;
     }
 }
 
-static thdat_t*
+static void*
+thdat_allocator_malloc(
+    const thtk_allocator_t* allocator,
+    size_t size)
+{
+    if (allocator->malloc)
+        return allocator->malloc(allocator->user, size);
+    return thtk_malloc(size);
+}
+
+static void
+thdat_allocator_free(
+    const thtk_allocator_t* allocator,
+    void* ptr)
+{
+    if (!allocator->malloc)
+        thtk_free(ptr);
+    else if (allocator->free)
+        allocator->free(allocator->user, ptr);
+}
+
+thdat_t*
 thdat_new(
     unsigned int version,
     thtk_io_t* stream,
+    const thtk_allocator_t* allocator,
     thtk_error_t** error)
 {
+    static const thtk_allocator_t global_allocator = { NULL, NULL, NULL, NULL };
     thdat_t* thdat;
     if (!stream) {
         thtk_error_new(error, "invalid parameter passed");
         return 0;
     }
-    thdat = malloc(sizeof(*thdat));
+    if (!allocator)
+        allocator = &global_allocator;
+    if (!(thdat = thdat_allocator_malloc(allocator, sizeof(*thdat)))) {
+        thtk_error_new(error, "out of memory");
+        return NULL;
+    }
+    thdat->allocator = *allocator;
     thdat->version = version;
     if (!(thdat->module = thdat_version_to_module(version, error))) {
-        free(thdat);
+        thdat_allocator_free(allocator, thdat);
         return NULL;
     }
     thdat->stream = stream;
     thdat->entry_count = 0;
     thdat->entries = NULL;
+    thdat->arena = NULL;
     thdat->offset = 0;
     thdat->inited = 0;
+    thdat->dedup = NULL;
     return thdat;
 }
 
+static void*
+thdat_arena_alloc(
+    thdat_t* thdat,
+    size_t size,
+    size_t align)
+{
+    thdat_arena_block_t* block = thdat->arena;
+    size_t pad = block ? -(uintptr_t)(block->data + block->used) & (align - 1) : 0;
+    if (!block || block->size - block->used < pad + size) {
+        const size_t block_size = (size > THDAT_ARENA_BLOCK_SIZE ? size : THDAT_ARENA_BLOCK_SIZE) + align - 1;
+        block = thdat_allocator_malloc(&thdat->allocator, sizeof(*block) + block_size);
+        if (!block)
+            return NULL;
+        block->size = block_size;
+        block->used = 0;
+        /* Keep a partially used block at the head when an oversized request
+         * gets a block of its own. */
+        if (thdat->arena && size > THDAT_ARENA_BLOCK_SIZE) {
+            block->next = thdat->arena->next;
+            thdat->arena->next = block;
+        } else {
+            block->next = thdat->arena;
+            thdat->arena = block;
+        }
+        pad = -(uintptr_t)block->data & (align - 1);
+    }
+    char* ret = block->data + block->used + pad;
+    block->used += pad + size;
+    return ret;
+}
+
+void*
+thdat_alloc(
+    thdat_t* thdat,
+    size_t size)
+{
+    return thdat_arena_alloc(thdat, size, THDAT_ARENA_ALIGN);
+}
+
+void*
+thdat_calloc(
+    thdat_t* thdat,
+    size_t count,
+    size_t size)
+{
+    if (size && count > SIZE_MAX / size)
+        return NULL;
+    void* ret = thdat_arena_alloc(thdat, count * size, THDAT_ARENA_ALIGN);
+    if (ret)
+        memset(ret, 0, count * size);
+    return ret;
+}
+
+char*
+thdat_name_alloc(
+    thdat_t* thdat,
+    size_t size)
+{
+    return thdat_arena_alloc(thdat, size, 1);
+}
+
+char*
+thdat_name_dup(
+    thdat_t* thdat,
+    const char* name,
+    size_t length)
+{
+    size_t name_length = 0;
+    while (name_length < length && name[name_length])
+        ++name_length;
+    char* ret = thdat_name_alloc(thdat, name_length + 1);
+    if (!ret)
+        return NULL;
+    memcpy(ret, name, name_length);
+    ret[name_length] = '\0';
+    return ret;
+}
+
+off_t
+thdat_reserve(
+    thdat_t* thdat,
+    off_t size,
+    thtk_error_t** error)
+{
+    const off_t offset = thdat->offset;
+    if (size < 0 || (uint64_t)offset + (uint64_t)size > UINT32_MAX) {
+        thtk_error_new(error, "archive is too large for this format");
+        return -1;
+    }
+    thdat->offset += size;
+    return offset;
+}
+
 thdat_t*
 thdat_open(
     unsigned int version,
     thtk_io_t* input,
     thtk_error_t** error)
+{
+    return thdat_open_with_allocator(version, input, NULL, error);
+}
+
+thdat_t*
+thdat_open_with_allocator(
+    unsigned int version,
+    thtk_io_t* input,
+    const thtk_allocator_t* allocator,
+    thtk_error_t** error)
 {
     thdat_t* thdat;
     if (!input) {
@@ -141,12 +305,14 @@ thdat_open(
     }
     if (thtk_io_seek(input, 0, SEEK_SET, error) == -1)
         return NULL;
-    if (!(thdat = thdat_new(version, input, error)))
+    if (!(thdat = thdat_new(version, input, allocator, error)))
         return NULL;
+    TRACE_BEGIN(span);
     if (!thdat->module->open(thdat, error)) {
         thdat_free(thdat);
         return NULL;
     }
+    TRACE_END(span, "thdat_open", NULL);
     return thdat;
 }
 
@@ -171,6 +337,17 @@ thdat_create(
     thtk_io_t* output,
     size_t entry_count,
     thtk_error_t** error)
+{
+    return thdat_create_with_allocator(version, output, entry_count, NULL, error);
+}
+
+thdat_t*
+thdat_create_with_allocator(
+    unsigned int version,
+    thtk_io_t* output,
+    size_t entry_count,
+    const thtk_allocator_t* allocator,
+    thtk_error_t** error)
 {
     thdat_t* thdat;
     if (!output) {
@@ -179,10 +356,17 @@ thdat_create(
     }
     if (thtk_io_seek(output, 0, SEEK_SET, error) == -1)
         return NULL;
-    if (!(thdat = thdat_new(version, output, error)))
+    if (!(thdat = thdat_new(version, output, allocator, error)))
         return NULL;
     thdat->entry_count = entry_count;
-    thdat->entries = calloc(entry_count, sizeof(thdat_entry_t));
+    thdat->entries = thdat_calloc(thdat, entry_count, sizeof(thdat_entry_t));
+    if (entry_count && !thdat->entries) {
+        thtk_error_new(error, "out of memory");
+        thdat_free(thdat);
+        return NULL;
+    }
+    for (size_t e = 0; e < entry_count; ++e)
+        thdat->entries[e].name = "";
     if (!(thdat->module->flags & THDAT_LATE_INIT))
         if (!thdat_init(thdat, error))
             return NULL;
@@ -196,7 +380,7 @@ thdat_entry_compar(
 {
     const thdat_entry_t* ea = a;
     const thdat_entry_t* eb = b;
-    return (int)ea->offset - eb->offset;
+    return (ea->offset > eb->offset) - (ea->offset < eb->offset);
 }
 
 int
@@ -208,6 +392,16 @@ thdat_close(
         thtk_error_new(error, "invalid parameter passed");
         return 0;
     }
+    if (thdat->dedup) {
+        for (size_t e = 0; e < thdat->entry_count; ++e) {
+            const ssize_t copy_of = thdat->dedup->copy_of[e];
+            if (copy_of != -1) {
+                thdat->entries[e].offset = thdat->entries[copy_of].offset;
+                thdat->entries[e].zsize = thdat->entries[copy_of].zsize;
+                thdat->entries[e].extra = thdat->entries[copy_of].extra;
+            }
+        }
+    }
     qsort(thdat->entries, thdat->entry_count, sizeof(thdat_entry_t), thdat_entry_compar);
     return thdat->module->close(thdat, error);
 }
@@ -217,11 +411,174 @@ thdat_free(
     thdat_t* thdat)
 {
     if (thdat) {
-        free(thdat->entries);
-        free(thdat);
+        while (thdat->arena) {
+            thdat_arena_block_t* next = thdat->arena->next;
+            thdat_allocator_free(&thdat->allocator, thdat->arena);
+            thdat->arena = next;
+        }
+        thdat_allocator_free(&thdat->allocator, thdat);
     }
 }
 
+int
+thdat_set_dedup(
+    thdat_t* thdat,
+    int enable,
+    thtk_error_t** error)
+{
+    if (!thdat) {
+        thtk_error_new(error, "invalid parameter passed");
+        return 0;
+    }
+
+    if (!enable) {
+        /* The tables stay in the arena until the archive is freed. */
+        thdat->dedup = NULL;
+        return 1;
+    }
+
+    if (!(thdat->module->flags & THDAT_SHARED_DATA)) {
+        thtk_error_new(error, "deduplication is not supported by this format");
+        return 0;
+    }
+
+    if (thdat->dedup)
+        return 1;
+
+    thdat_dedup_t* dedup = thdat_alloc(thdat, sizeof(*dedup));
+    if (!dedup) {
+        thtk_error_new(error, "out of memory");
+        return 0;
+    }
+    /* Keep the table at most half full. */
+    dedup->table_size = 16;
+    while (dedup->table_size < thdat->entry_count * 2)
+        dedup->table_size *= 2;
+    dedup->table_used = 0;
+    dedup->table = thdat_calloc(thdat, dedup->table_size, sizeof(*dedup->table));
+    dedup->hashes = thdat_calloc(thdat, thdat->entry_count, sizeof(*dedup->hashes));
+    dedup->sizes = thdat_calloc(thdat, thdat->entry_count, sizeof(*dedup->sizes));
+    dedup->keys = thdat_calloc(thdat, thdat->entry_count, sizeof(*dedup->keys));
+    dedup->copy_of = thdat_calloc(thdat, thdat->entry_count, sizeof(*dedup->copy_of));
+    if (!dedup->table || !dedup->hashes || !dedup->sizes || !dedup->keys || !dedup->copy_of) {
+        thtk_error_new(error, "out of memory");
+        return 0;
+    }
+    for (size_t e = 0; e < thdat->entry_count; ++e)
+        dedup->copy_of[e] = -1;
+    thdat->dedup = dedup;
+
+    return 1;
+}
+
+/* 64-bit FNV-1a. */
+uint64_t
+thdat_hash(
+    uint64_t hash,
+    const void* data,
+    size_t size)
+{
+    const unsigned char* bytes = data;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= UINT64_C(0x100000001b3);
+    }
+    return hash;
+}
+
+static int
+thdat_dedup_insert(
+    thdat_t* thdat,
+    int entry_index,
+    uint64_t hash,
+    size_t size,
+    uint32_t key)
+{
+    thdat_dedup_t* dedup = thdat->dedup;
+    int found = 0;
+
+    /* Entries are only compared by hash, size and key, a collision of the
+     * 64-bit hash is not considered to be a realistic possibility. */
+#pragma omp critical(thdat_dedup)
+    {
+        const size_t mask = dedup->table_size - 1;
+        for (size_t i = hash & mask; dedup->table_used < mask; i = (i + 1) & mask) {
+            size_t e = dedup->table[i];
+            if (!e) {
+                dedup->table[i] = entry_index + 1;
+                dedup->table_used++;
+                dedup->hashes[entry_index] = hash;
+                dedup->sizes[entry_index] = size;
+                dedup->keys[entry_index] = key;
+                break;
+            }
+            --e;
+            if (dedup->hashes[e] == hash &&
+                dedup->sizes[e] == size &&
+                dedup->keys[e] == key &&
+                dedup->copy_of[e] == -1 &&
+                e != (size_t)entry_index) {
+                dedup->copy_of[entry_index] = e;
+                found = 1;
+                break;
+            }
+        }
+    }
+
+    return found;
+}
+
+int
+thdat_dedup_data(
+    thdat_t* thdat,
+    int entry_index,
+    const void* data,
+    size_t size,
+    uint32_t key)
+{
+    if (!thdat->dedup)
+        return 0;
+    return thdat_dedup_insert(thdat, entry_index,
+        thdat_hash(THDAT_HASH_INIT, data, size), size, key);
+}
+
+int
+thdat_dedup_stream(
+    thdat_t* thdat,
+    int entry_index,
+    thtk_io_t* input,
+    size_t size,
+    uint32_t key,
+    thtk_error_t** error)
+{
+    if (!thdat->dedup)
+        return 0;
+
+    off_t first_offset = thtk_io_seek(input, 0, SEEK_CUR, error);
+    if (first_offset == -1)
+        return -1;
+
+    const size_t buffer_size = 65536;
+    unsigned char* buffer = thtk_malloc(buffer_size);
+    uint64_t hash = THDAT_HASH_INIT;
+    size_t remaining = size;
+    while (remaining) {
+        const size_t chunk = remaining < buffer_size ? remaining : buffer_size;
+        if (thtk_io_read(input, buffer, chunk, error) != (ssize_t)chunk) {
+            thtk_free(buffer);
+            return -1;
+        }
+        hash = thdat_hash(hash, buffer, chunk);
+        remaining -= chunk;
+    }
+    thtk_free(buffer);
+
+    if (thtk_io_seek(input, first_offset, SEEK_SET, error) == -1)
+        return -1;
+
+    return thdat_dedup_insert(thdat, entry_index, hash, size, key);
+}
+
 ssize_t
 thdat_entry_count(
     thdat_t* thdat,
@@ -303,7 +660,12 @@ thdat_entry_set_name(
             }
         }
 
-        strcpy(thdat->entries[entry_index].name, temp_name);
+        const char* name = thdat_name_dup(thdat, temp_name, 255);
+        if (!name) {
+            thtk_error_new(error, "out of memory");
+            return 0;
+        }
+        thdat->entries[entry_index].name = name;
 
         return 1;
     }
@@ -364,7 +726,10 @@ thdat_entry_write_data(
         thtk_error_new(error, "invalid parameter passed");
         return -1;
     }
-    return thdat->module->write(thdat, entry_index, input, input_length, error);
+    TRACE_BEGIN(span);
+    ssize_t ret = thdat->module->write(thdat, entry_index, input, input_length, error);
+    TRACE_END(span, "thdat_entry_write_data", thdat->entries[entry_index].name);
+    return ret;
 }
 
 ssize_t
@@ -378,5 +743,8 @@ thdat_entry_read_data(
         thtk_error_new(error, "invalid parameter passed");
         return -1;
     }
-    return thdat->module->read(thdat, entry_index, output, error);
+    TRACE_BEGIN(span);
+    ssize_t ret = thdat->module->read(thdat, entry_index, output, error);
+    TRACE_END(span, "thdat_entry_read_data", thdat->entries[entry_index].name);
+    return ret;
 }
@@ -35,7 +35,8 @@
 #include <thtk/thtk.h>
 
 typedef struct {
-    char name[260];
+    /* Points into the archive's arena, or at a static empty string. */
+    const char* name;
     /* Format-specific data. */
     uint32_t extra;
     /* These fields are -1 before being filled out. */
@@ -44,12 +45,14 @@ typedef struct {
     /* Compressed file size. */
     ssize_t zsize;
     /* Offset in archive. */
-    ssize_t offset;
+    off_t offset;
 } thdat_entry_t;
 
 void thdat_entry_init(thdat_entry_t* entry);
 
 typedef struct thdat_module_t thdat_module_t;
+typedef struct thdat_dedup_t thdat_dedup_t;
+typedef struct thdat_arena_block_t thdat_arena_block_t;
 
 struct thdat_t {
     unsigned int version;
@@ -57,8 +60,18 @@ struct thdat_t {
     thtk_io_t* stream;
     size_t entry_count;
     thdat_entry_t* entries;
-    uint32_t offset;
+    /* Storage for the entry table, names and other data that lives as long
+     * as the archive, freed all at once by thdat_free. */
+    thdat_arena_block_t* arena;
+    /* Allocator for this object and the arena, malloc is NULL if the
+     * process-wide one is used. */
+    thtk_allocator_t allocator;
+    /* Write position while creating an archive. */
+    off_t offset;
     int inited;
+    /* Content hashes of written entries, NULL unless enabled with
+     * thdat_set_dedup. */
+    thdat_dedup_t* dedup;
 };
 
 /* Strip path names. */
@@ -71,6 +84,8 @@ struct thdat_t {
 #define THDAT_NO_COMPRESSION 8
 /* thdat_init must be called _after_ setting the filenames. */
 #define THDAT_LATE_INIT 16
+/* Several entries may point at the same stored data. */
+#define THDAT_SHARED_DATA 32
 
 struct thdat_module_t {
     /* THDAT_ flags. */
@@ -84,12 +99,39 @@ struct thdat_module_t {
     ssize_t (*write)(thdat_t* thdat, int entry, thtk_io_t* input, size_t length, thtk_error_t** error);
 };
 
-#define ARRAY_GROW(counter, array, target) \
-    do { \
-        ++(counter); \
-        (array) = realloc((array), (counter) * sizeof(*(array))); \
-        (target) = &(array)[(counter) - 1]; \
-    } while (0)
+/* Allocates an empty archive object for the given version. */
+thdat_t* thdat_new(unsigned int version, thtk_io_t* stream, const thtk_allocator_t* allocator, thtk_error_t** error);
+
+/* Allocates size bytes from the archive's arena.  The memory stays valid
+ * until thdat_free and can't be freed separately. */
+void* thdat_alloc(thdat_t* thdat, size_t size);
+/* Like thdat_alloc, but for count zeroed elements. */
+void* thdat_calloc(thdat_t* thdat, size_t count, size_t size);
+/* Like thdat_alloc, but without alignment, for strings. */
+char* thdat_name_alloc(thdat_t* thdat, size_t size);
+/* Copies at most length characters of name into the arena and
+ * terminates the copy. */
+char* thdat_name_dup(thdat_t* thdat, const char* name, size_t length);
+
+/* Reserves size bytes at the archive's write position and returns the
+ * offset they start at.  All formats store offsets and sizes in 32 bits, so
+ * this fails with -1 once the archive grows past that. */
+off_t thdat_reserve(thdat_t* thdat, off_t size, thtk_error_t** error);
+
+/* Continues a 64-bit hash of data, start with THDAT_HASH_INIT. */
+uint64_t thdat_hash(uint64_t hash, const void* data, size_t size);
+#define THDAT_HASH_INIT UINT64_C(0xcbf29ce484222325)
+
+/* Looks for an entry that has already been written with the same content.
+ * key must differ for data which is stored differently despite having the
+ * same content, such as data encrypted with name-dependent keys.  Returns 1
+ * if the entry was recorded as a copy of another entry, in which case the
+ * caller must not write it; its offset and stored size are filled in by
+ * thdat_close.  Returns 0 if the entry has to be written normally. */
+int thdat_dedup_data(thdat_t* thdat, int entry_index, const void* data, size_t size, uint32_t key);
+/* Like thdat_dedup_data, but hashes the next size bytes of input and seeks
+ * back to the starting position afterwards.  -1 indicates an error. */
+int thdat_dedup_stream(thdat_t* thdat, int entry_index, thtk_io_t* input, size_t size, uint32_t key, thtk_error_t** error);
 
 /* detect.c */
 const char *detect_basename(const char *path);
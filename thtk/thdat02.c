@@ -28,11 +28,14 @@
  */
 #include <config.h>
 #include <stdlib.h>
+#include <string.h>
 #include <thtk/thtk.h>
 #include "thdat.h"
 #include "thrle.h"
+#include "thxor.h"
 #include "util.h"
 #include "dattypes.h"
+#include "trace.h"
 
 static int
 th02_open(
@@ -63,15 +66,19 @@ th02_open(
         thdat->entry_count = th03_archive_header.count;
     }
 
-    thdat->entries = malloc(thdat->entry_count * sizeof(thdat_entry_t));
+    thdat->entries = thdat_calloc(thdat, thdat->entry_count, sizeof(thdat_entry_t));
+    if (!thdat->entries) {
+        thtk_error_new(error, "out of memory");
+        return 0;
+    }
 
     if (thdat->version <= 2) {
-        th02_entry_headers = malloc(thdat->entry_count * sizeof(th02_entry_header_t));
+        th02_entry_headers = thtk_malloc(thdat->entry_count * sizeof(th02_entry_header_t));
         if (thtk_io_read(thdat->stream, th02_entry_headers, thdat->entry_count * sizeof(th02_entry_header_t), error) !=
             (ssize_t)(thdat->entry_count * sizeof(th02_entry_header_t)))
             return 0;
     } else {
-        th03_entry_headers = malloc(thdat->entry_count * sizeof(th03_entry_header_t));
+        th03_entry_headers = thtk_malloc(thdat->entry_count * sizeof(th03_entry_header_t));
         if (thtk_io_read(thdat->stream, th03_entry_headers, thdat->entry_count * sizeof(th03_entry_header_t), error) !=
             (ssize_t)(thdat->entry_count * sizeof(th03_entry_header_t)))
             return 0;
@@ -94,9 +101,15 @@ th02_open(
             for (unsigned int i = 0; i < 13 && th02_entry_headers[e].name[i]; ++i)
                 th02_entry_headers[e].name[i] ^= 0xff;
         }
-        memcpy(entry->name, thdat->version <= 2
-            ? th02_entry_headers[e].name
-            : th03_entry_headers[e].name, 13);
+        entry->name = thdat_name_dup(thdat, thdat->version <= 2
+            ? (const char*)th02_entry_headers[e].name
+            : (const char*)th03_entry_headers[e].name, 13);
+        if (!entry->name) {
+            thtk_error_new(error, "out of memory");
+            thtk_free(th02_entry_headers);
+            thtk_free(th03_entry_headers);
+            return 0;
+        }
         entry->zsize = thdat->version <= 2
             ? th02_entry_headers[e].zsize
             : th03_entry_headers[e].zsize;
@@ -108,8 +121,8 @@ th02_open(
             : th03_entry_headers[e].offset;
     }
 
-    free(th02_entry_headers);
-    free(th03_entry_headers);
+    thtk_free(th02_entry_headers);
+    thtk_free(th03_entry_headers);
 
     return 1;
 }
@@ -122,30 +135,35 @@ th02_read(
     thtk_error_t** error)
 {
     thdat_entry_t* entry = &thdat->entries[entry_index];
-    unsigned char* data = malloc(entry->zsize);
+    unsigned char* data = thtk_malloc(entry->zsize);
     ssize_t ret;
 
+    TRACE_BEGIN(wait);
 #pragma omp critical
     {
+        TRACE_END(wait, "lock wait", NULL);
         ret = thtk_io_pread(thdat->stream, data, entry->zsize, entry->offset, error);
     }
     if (ret != (ssize_t)entry->zsize) {
-        free(data);
+        thtk_free(data);
         return -1;
     }
 
-    for (ssize_t i = 0; i < entry->zsize; ++i)
-        data[i] ^= entry->extra;
+    th_xor(data, entry->zsize, entry->extra, 0, 0);
 
     if (entry->size == entry->zsize) {
         ret = thtk_io_write(output, data, entry->zsize, error);
-        free(data);
+        thtk_free(data);
     } else {
-        thtk_io_t* data_stream = thtk_io_open_memory(data, entry->zsize, error);
-        if (!data_stream)
-            return -1;
-        ret = thtk_unrle(data_stream, entry->zsize, output, error);
-        thtk_io_close(data_stream);
+        unsigned char* raw = thtk_malloc(entry->size);
+        ret = thtk_unrle_buffer(data, entry->zsize, raw, entry->size, error);
+        thtk_free(data);
+        if (ret != -1) {
+            if (ret > entry->size)
+                ret = entry->size;
+            ret = thtk_io_write(output, raw, ret, error);
+        }
+        thtk_free(raw);
     }
 
     return ret;
@@ -177,59 +195,43 @@ th02_write(
     thdat_entry_t* entry = &thdat->entries[entry_index];
     entry->size = input_length;
 
-    off_t input_offset = thtk_io_seek(input, 0, SEEK_CUR, error);
-    if (input_offset == -1)
+    unsigned char* raw = thtk_malloc(entry->size);
+    if (thtk_io_read(input, raw, entry->size, error) != entry->size) {
+        thtk_free(raw);
         return -1;
-
-    if (thdat->version <= 2) {
-        for (unsigned int i = 0; i < 13; ++i)
-            if (entry->name[i])
-                entry->name[i] ^= 0xff;
     }
 
-    thtk_io_t* output = thtk_io_open_growing_memory(error);
-    if (!output)
-        return -1;
-
-    if ((entry->zsize = thtk_rle(input, entry->size, output, error)) == -1)
+    /* Data that doesn't get smaller is stored uncompressed. */
+    unsigned char* data = thtk_malloc(entry->size);
+    if ((entry->zsize = thtk_rle_buffer(raw, entry->size, data, entry->size, error)) == -1) {
+        thtk_free(raw);
+        thtk_free(data);
         return -1;
+    }
 
     if (entry->zsize >= entry->size) {
         entry->zsize = entry->size;
-        thtk_io_close(output);
-        if (thtk_io_seek(input, input_offset, SEEK_SET, error) == -1)
-            return -1;
-        output = input;
-    }
-
-    unsigned char* data = malloc(entry->zsize);
-    ssize_t ret = thtk_io_pread(output, data, entry->zsize, 0, error);
-    if (ret != entry->zsize) {
-        free(data);
-        if (output != input)
-            thtk_io_close(output);
-        return -1;
+        thtk_free(data);
+        data = raw;
+    } else {
+        thtk_free(raw);
     }
 
-    for (ssize_t i = 0; i < entry->zsize; ++i)
-        data[i] ^= thdat->version <= 2 ? th02_keys[thdat->version - 1] : entry_key;
-
+    th_xor(data, entry->zsize, thdat->version <= 2 ? th02_keys[thdat->version - 1] : entry_key, 0, 0);
 
+    ssize_t ret = -1;
+    TRACE_BEGIN(wait);
 #pragma omp critical
     {
+        TRACE_END(wait, "lock wait", NULL);
         entry->offset = thtk_io_seek(thdat->stream, 0, SEEK_CUR, error);
 
-        if (entry->offset != -1)
+        if (entry->offset != -1 &&
+            thdat_reserve(thdat, entry->zsize, error) != -1)
             ret = thtk_io_write(thdat->stream, data, entry->zsize, error);
-
-        if (ret != -1)
-            thdat->offset += ret;
     }
 
-    free(data);
-
-    if (output != input)
-        thtk_io_close(output);
+    thtk_free(data);
 
     return ret;
 }
@@ -255,7 +257,7 @@ th02_close(
     }
 
     size_t buffer_size = (thdat->entry_count + 1) * (thdat->version <= 2 ? sizeof(th02_entry_header_t) : sizeof(th03_entry_header_t));
-    unsigned char* buffer = malloc(buffer_size);
+    unsigned char* buffer = thtk_malloc(buffer_size);
     unsigned char* buffer_ptr = buffer;
 
     memset(buffer, 0, buffer_size);
@@ -271,7 +273,11 @@ th02_close(
                 .offset = entry->offset
             };
 
-            memcpy(eh2.name, entry->name, 13);
+            /* The initializer zeroes the rest of the name. */
+            memcpy(eh2.name, entry->name, strnlen(entry->name, sizeof(eh2.name)));
+            for (unsigned int i = 0; i < 13; ++i)
+                if (eh2.name[i])
+                    eh2.name[i] ^= 0xff;
 
             buffer_ptr = MEMPCPY(buffer_ptr, &eh2, sizeof(eh2));
         } else {
@@ -283,7 +289,8 @@ th02_close(
                 .offset = entry->offset
             };
 
-            memcpy(eh3.name, entry->name, 13);
+            /* The initializer zeroes the rest of the name. */
+            memcpy(eh3.name, entry->name, strnlen(entry->name, sizeof(eh3.name)));
 
             buffer_ptr = MEMPCPY(buffer_ptr, &eh3, sizeof(eh3));
         }
@@ -299,11 +306,11 @@ th02_close(
     }
 
     if (thtk_io_write(thdat->stream, buffer, buffer_size, error) == -1) {
-        free(buffer);
+        thtk_free(buffer);
         return 0;
     }
 
-    free(buffer);
+    thtk_free(buffer);
 
     return 1;
 }
@@ -34,6 +34,8 @@
 #include "thdat.h"
 #include "thlzss.h"
 #include "dattypes.h"
+#include "trace.h"
+#include "util.h"
 
 static uint32_t
 th06_read_uint32(
@@ -81,7 +83,7 @@ static void
 th06_write_string(
     struct bitstream* b,
     unsigned int length,
-    char* data)
+    const char* data)
 {
     unsigned int i;
     for (i = 0; i < length; ++i)
@@ -107,17 +109,28 @@ th06_open(
         if (thtk_io_seek(thdat->stream, thdat->offset, SEEK_SET, error) == -1)
             return 0;
 
+        thdat->entry_count = entry_count;
+        thdat->entries = thdat_calloc(thdat, entry_count, sizeof(thdat_entry_t));
+        if (!thdat->entries) {
+            thtk_error_new(error, "out of memory");
+            return 0;
+        }
+
         bitstream_init(&b, thdat->stream);
         for (unsigned int i = 0; i < entry_count; ++i) {
-            thdat_entry_t* entry;
-            ARRAY_GROW(thdat->entry_count, thdat->entries, entry);
+            thdat_entry_t* entry = &thdat->entries[i];
+            char name[256] = { 0 };
             thdat_entry_init(entry);
             th06_read_uint32(&b);
             th06_read_uint32(&b);
             entry->extra = th06_read_uint32(&b);
             entry->offset = th06_read_uint32(&b);
             entry->size = th06_read_uint32(&b);
-            th06_read_string(&b, 255, entry->name);
+            th06_read_string(&b, 255, name);
+            if (!(entry->name = thdat_name_dup(thdat, name, 255))) {
+                thtk_error_new(error, "out of memory");
+                return 0;
+            }
         }
     } else if (strncmp(magic, "PBG4", 4) == 0) {
         th07_header_t header;
@@ -137,22 +150,31 @@ th06_open(
         if (th_unlzss(thdat->stream, entry_headers, header.size, error) == -1)
             return 0;
 
-        const uint32_t* ptr = (uint32_t*)thtk_io_map(entry_headers, 0, header.size, error);
-        if (!ptr)
+        unsigned char* map = thtk_io_map(entry_headers, 0, header.size, error);
+        if (!map)
             return 0;
-        for (unsigned int i = 0; i < header.count; ++i) {
-            thdat_entry_t* entry = NULL;
-            ARRAY_GROW(thdat->entry_count, thdat->entries, entry);
+        const uint32_t* ptr = (uint32_t*)map;
+        thdat->entry_count = header.count;
+        thdat->entries = thdat_calloc(thdat, header.count, sizeof(thdat_entry_t));
+        for (unsigned int i = 0; thdat->entries && i < header.count; ++i) {
+            thdat_entry_t* entry = &thdat->entries[i];
             thdat_entry_init(entry);
-            strcpy(entry->name, (char*)ptr);
-            ptr = (uint32_t*)((char*)ptr + strlen(entry->name) + 1);
+            if (!(entry->name = thdat_name_dup(thdat, (char*)ptr, 255))) {
+                thdat->entries = NULL;
+                break;
+            }
+            ptr = (uint32_t*)((char*)ptr + strlen((char*)ptr) + 1);
             entry->offset = *ptr++;
             entry->size = *ptr++;
             entry->extra = *ptr++;
         }
 
-        thtk_io_unmap(entry_headers, (unsigned char*)ptr);
+        thtk_io_unmap(entry_headers, map);
         thtk_io_close(entry_headers);
+        if (!thdat->entries) {
+            thtk_error_new(error, "out of memory");
+            return 0;
+        }
     } else {
         thtk_error_new(error, "magic string not recognized");
         return 0;
@@ -184,11 +206,13 @@ th06_read(
     thtk_error_t** error)
 {
     thdat_entry_t* entry = &thdat->entries[entry_index];
-    unsigned char* zdata = malloc(entry->zsize);
+    unsigned char* zdata = thtk_malloc(entry->zsize);
 
     int failed;
+    TRACE_BEGIN(wait);
 #pragma omp critical
     {
+        TRACE_END(wait, "lock wait", NULL);
         failed = (thtk_io_seek(thdat->stream, entry->offset, SEEK_SET, error) == -1) ||
                  (thtk_io_read(thdat->stream, zdata, entry->zsize, error) != entry->zsize);
     }
@@ -247,13 +271,15 @@ th06_write(
             entry->extra += zdata[i];
     }
 
-    int ret;
+    int ret = -1;
 
+    TRACE_BEGIN(wait);
 #pragma omp critical
     {
-        ret = thtk_io_write(thdat->stream, zdata, entry->zsize, error);
-        entry->offset = thdat->offset;
-        thdat->offset += entry->zsize;
+        TRACE_END(wait, "lock wait", NULL);
+        entry->offset = thdat_reserve(thdat, entry->zsize, error);
+        if (entry->offset != -1)
+            ret = thtk_io_write(thdat->stream, zdata, entry->zsize, error);
     }
 
     thtk_io_unmap(zdata_stream, zdata);
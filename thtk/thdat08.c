@@ -35,6 +35,7 @@
 #include "thlzss.h"
 #include "util.h"
 #include "dattypes.h"
+#include "trace.h"
 
 static void
 tolowerstr(
@@ -79,7 +80,7 @@ th08_open(
         return 0;
 
     unsigned int zsize = filesize - header.offset;
-    zdata = malloc(zsize);
+    zdata = thtk_malloc(zsize);
 
     if (thtk_io_read(thdat->stream, zdata, zsize, error) == -1)
         return 0;
@@ -97,38 +98,47 @@ th08_open(
 
     thtk_io_close(compressed_data);
 
-    data = malloc(header.size);
+    data = thtk_malloc(header.size);
     if (thtk_io_seek(raw_data, 0, SEEK_SET, error) == -1)
         return 0;
     if (thtk_io_read(raw_data, data, header.size, error) != header.size)
         return 0;
     thtk_io_close(raw_data);
 
+    thdat->entry_count = header.count;
+    thdat->entries = thdat_calloc(thdat, header.count, sizeof(thdat_entry_t));
+    if (!thdat->entries) {
+        thtk_error_new(error, "out of memory");
+        thtk_free(data);
+        return 0;
+    }
+
     const uint32_t* ptr = (uint32_t*)data;
     for (unsigned int i = 0; i < header.count; ++i) {
-        thdat_entry_t* entry;
-        ARRAY_GROW(thdat->entry_count, thdat->entries, entry);
+        thdat_entry_t* entry = &thdat->entries[i];
         thdat_entry_init(entry);
 
-        strcpy(entry->name, (char*)ptr);
-        ptr = (uint32_t*)((char*)ptr + strlen(entry->name) + 1);
+        if (!(entry->name = thdat_name_dup(thdat, (char*)ptr, 255))) {
+            thtk_error_new(error, "out of memory");
+            thtk_free(data);
+            return 0;
+        }
+        ptr = (uint32_t*)((char*)ptr + strlen((char*)ptr) + 1);
         entry->offset = *ptr++;
         entry->size = *ptr++;
         entry->extra = *ptr++;
     }
 
-    if (header.count) {
-        thdat_entry_t* prev = NULL;
-        for (unsigned int i = 0; i < header.count; ++i) {
-            thdat_entry_t* entry = &thdat->entries[i];
-            if (prev)
-                prev->zsize = entry->offset - prev->offset;
-            prev = entry;
-        }
-        prev->zsize = (filesize - zsize) - prev->offset;
+    /* See th95_open. */
+    off_t end = filesize - zsize;
+    for (unsigned int i = header.count; i--; ) {
+        thdat_entry_t* entry = &thdat->entries[i];
+        if (i + 1 < header.count && thdat->entries[i + 1].offset != entry->offset)
+            end = thdat->entries[i + 1].offset;
+        entry->zsize = end - entry->offset;
     }
 
-    free(data);
+    thtk_free(data);
 
     return 1;
 }
@@ -149,11 +159,13 @@ th08_read(
     thtk_io_t* raw_entry = thtk_io_open_growing_memory(error);
     if (!raw_entry)
         return -1;
-    unsigned char* zdata = malloc(entry->zsize);
+    unsigned char* zdata = thtk_malloc(entry->zsize);
 
     int failed = 0;
+    TRACE_BEGIN(wait);
 #pragma omp critical
     {
+        TRACE_END(wait, "lock wait", NULL);
         failed = (thtk_io_seek(thdat->stream, entry->offset, SEEK_SET, error) == -1) ||
                  (thtk_io_read(thdat->stream, zdata, entry->zsize, error) != entry->zsize);
     }
@@ -277,7 +289,7 @@ th08_write(
     thdat_entry_t* entry = &thdat->entries[entry_index];
     const crypt_params* crypt_params = find_crypt_params(thdat->version, entry->name);
     entry->size = input_length + 4;
-    unsigned char* data = malloc(entry->size);
+    unsigned char* data = thtk_malloc(entry->size);
 
     data[0] = 'e';
     data[1] = 'd';
@@ -286,6 +298,11 @@ th08_write(
     if (thtk_io_read(input, data + 4, input_length, error) != (ssize_t)input_length)
         return -1;
 
+    if (thdat_dedup_data(thdat, entry_index, data + 4, input_length, crypt_params->type)) {
+        thtk_free(data);
+        return 0;
+    }
+
     th_encrypt(data + 4, input_length, crypt_params->key, crypt_params->step, crypt_params->block, crypt_params->limit);
 
     thtk_io_t* data_stream = thtk_io_open_memory(data, entry->size, error);
@@ -303,17 +320,22 @@ th08_write(
     if (!zdata)
         return -1;
 
+    ssize_t ret = -1;
+    TRACE_BEGIN(wait);
 #pragma omp critical
     {
-        /* TODO: Handle error. */
-        thtk_io_write(thdat->stream, zdata, entry->zsize, error);
-        entry->offset = thdat->offset;
-        thdat->offset += entry->zsize;
+        TRACE_END(wait, "lock wait", NULL);
+        entry->offset = thdat_reserve(thdat, entry->zsize, error);
+        if (entry->offset != -1)
+            ret = thtk_io_write(thdat->stream, zdata, entry->zsize, error);
     }
 
     thtk_io_unmap(zdata_stream, zdata);
     thtk_io_close(zdata_stream);
 
+    if (ret != entry->zsize)
+        return -1;
+
     return entry->zsize;
 }
 
@@ -337,7 +359,7 @@ th08_close(
     /* XXX: I'm adding some padding here to satisfy pbgzmlt.
      * The games work fine without it. */
     list_size += 4;
-    buffer = malloc(list_size);
+    buffer = thtk_malloc(list_size);
     memset(buffer, 0, list_size);
 
     buffer_ptr = buffer;
@@ -364,7 +386,7 @@ th08_close(
     if (thtk_io_seek(zbuffer_stream, 0, SEEK_SET, error) == -1)
         return 0;
 
-    zbuffer = malloc(list_zsize);
+    zbuffer = thtk_malloc(list_zsize);
     if (thtk_io_read(zbuffer_stream, zbuffer, list_zsize, error) == -1)
         return 0;
     thtk_io_close(zbuffer_stream);
@@ -372,10 +394,10 @@ th08_close(
     th_encrypt(zbuffer, list_zsize, 0x3e, 0x9b, 0x80, 0x400);
 
     if (thtk_io_write(thdat->stream, zbuffer, list_zsize, error) == -1) {
-        free(zbuffer);
+        thtk_free(zbuffer);
         return 0;
     }
-    free(zbuffer);
+    thtk_free(zbuffer);
 
     header[0] = 0x5a474250; /* ZGBP */
     header[1] = thdat->entry_count + 123456;
@@ -395,7 +417,7 @@ th08_close(
 }
 
 const thdat_module_t archive_th08 = {
-    THDAT_BASENAME,
+    THDAT_BASENAME|THDAT_SHARED_DATA,
     th08_open,
     th08_create,
     th08_close,
@@ -32,6 +32,7 @@
 #include "thcrypt105.h"
 #include "thdat.h"
 #include "util.h"
+#include "trace.h"
 
 #define th75_name_len_from_thdat(thdat) ((thdat)->version == 75 ? 100 : 260)
 
@@ -63,30 +64,40 @@ th75_open(
         return 0;
 
     size_t header_size = (8+name_len)*entry_count;
-    uint8_t *header_buf = malloc(header_size);
+    uint8_t *header_buf = thtk_malloc(header_size);
     if (thtk_io_read(thdat->stream, header_buf, header_size, error) !=
             header_size)
         return 0;
     th_crypt75_list(header_buf, header_size, 0x64, 0x64, 0x4d);
 
     thdat->entry_count = entry_count;
-    thdat->entries = calloc(entry_count, sizeof(thdat_entry_t));
+    thdat->entries = thdat_calloc(thdat, entry_count, sizeof(thdat_entry_t));
+    if (!thdat->entries) {
+        thtk_error_new(error, "out of memory");
+        thtk_free(header_buf);
+        return 0;
+    }
 
     uint8_t *ptr = header_buf;
     for (uint16_t i = 0; i < entry_count; i++) {
         thdat_entry_t *entry = &thdat->entries[i];
         thdat_entry_init(entry);
 
-        strncpy(entry->name, (char *)ptr, name_len);
-        entry->name[name_len-1] = 0;
-        th75_path_normalize((char *)entry->name, '\\', '/');
+        char *name = thdat_name_dup(thdat, (char *)ptr, name_len - 1);
+        if (!name) {
+            thtk_error_new(error, "out of memory");
+            thtk_free(header_buf);
+            return 0;
+        }
+        th75_path_normalize(name, '\\', '/');
+        entry->name = name;
         ptr += name_len;
         entry->size = *((uint32_t *)ptr);
         ptr += 4;
         entry->offset = *((uint32_t *)ptr);
         ptr += 4;
     }
-    free(header_buf);
+    thtk_free(header_buf);
 
     return 1;
 }
@@ -109,7 +120,7 @@ th105_open(
     header.entry_count = entry_count;
     header.size = header_size;
 
-    unsigned char* header_buf = malloc(header_size);
+    unsigned char* header_buf = thtk_malloc(header_size);
     if (thtk_io_read(thdat->stream, header_buf, header_size, error) !=
             header_size)
         return 0;
@@ -118,7 +129,12 @@ th105_open(
         th_crypt75_list(header_buf, header_size, 0xc5, 0x83, 0x53);
 
     thdat->entry_count = entry_count;
-    thdat->entries = calloc(entry_count, sizeof(thdat_entry_t));
+    thdat->entries = thdat_calloc(thdat, entry_count, sizeof(thdat_entry_t));
+    if (!thdat->entries) {
+        thtk_error_new(error, "out of memory");
+        thtk_free(header_buf);
+        return 0;
+    }
 
     if (header.entry_count) {
         unsigned char* ptr = header_buf;
@@ -133,11 +149,15 @@ th105_open(
             // zsize and extra are not used.
 
             unsigned char name_length = *(ptr++);
-            strncpy(entry->name, (char*)ptr, name_length);
+            if (!(entry->name = thdat_name_dup(thdat, (char*)ptr, name_length))) {
+                thtk_error_new(error, "out of memory");
+                thtk_free(header_buf);
+                return 0;
+            }
             ptr += name_length;
         }
     }
-    free(header_buf);
+    thtk_free(header_buf);
 
     return 1;
 }
@@ -146,23 +166,27 @@ static void
 th105_data_crypt(
     thdat_t *thdat,
     thdat_entry_t *entry,
-    uint8_t *data)
+    uint8_t *data,
+    unsigned int size)
 {
     switch (thdat->version) {
     case 75:
         break;
     case 7575:
-        th_crypt105_file(data, entry->size, entry->offset, THCRYPT_MEGAMARI_KEY);
+        th_crypt105_file(data, size, entry->offset, THCRYPT_MEGAMARI_KEY);
         break;
     case 105105:
     case 105:
     case 123:
     default:
-        th_crypt105_file(data, entry->size, entry->offset, THCRYPT_PATCHCON_KEY);
+        th_crypt105_file(data, size, entry->offset, THCRYPT_PATCHCON_KEY);
         break;
     }
 }
 
+/* Encrypted entries are decrypted in pieces of this size. */
+#define TH105_READ_CHUNK (256 * 1024)
+
 static ssize_t
 th105_read(
     thdat_t* thdat,
@@ -171,22 +195,36 @@ th105_read(
     thtk_error_t** error)
 {
     thdat_entry_t *entry = &thdat->entries[entry_index];
-    uint8_t *data = malloc(entry->size);
 
-    if (thtk_io_pread(thdat->stream, data, entry->size, entry->offset, error) == -1) {
-        free(data);
-        return -1;
-    }
+    /* IaMP data is stored as is. */
+    if (thdat->version == 75)
+        return thtk_io_copy(output, thdat->stream, entry->offset, entry->size, error);
 
-    th105_data_crypt(thdat, entry, data);
+    const size_t chunk = entry->size < TH105_READ_CHUNK ? entry->size : TH105_READ_CHUNK;
+    uint8_t *data = thtk_malloc(chunk);
+    ssize_t done = 0;
 
-    if (thtk_io_write(output, data, entry->size, error) == -1) {
-        free(data);
-        return -1;
+    while (done < entry->size) {
+        const size_t size = entry->size - done < chunk ? entry->size - done : chunk;
+
+        if (thtk_io_pread(thdat->stream, data, size, entry->offset + done, error) != (ssize_t)size) {
+            thtk_free(data);
+            return -1;
+        }
+
+        /* The key only depends on the offset of the entry. */
+        th105_data_crypt(thdat, entry, data, size);
+
+        if (thtk_io_write(output, data, size, error) == -1) {
+            thtk_free(data);
+            return -1;
+        }
+
+        done += size;
     }
 
-    free(data);
-    return 1;
+    thtk_free(data);
+    return done;
 }
 
 static int
@@ -232,32 +270,42 @@ th105_write(
     thdat_entry_t *entry = &thdat->entries[entry_index];
 
     entry->size = input_length;
-    uint8_t *data = malloc(entry->size);
+    uint8_t *data = thtk_malloc(entry->size);
 
     if (thtk_io_seek(input, 0, SEEK_SET, error) == -1) {
-        free(data);
+        thtk_free(data);
         return -1;
     }
     int ret = thtk_io_read(input, data, entry->size, error);
     if (ret != entry->size) {
-        free(data);
+        thtk_free(data);
         return -1;
     }
 
+    if (thdat_dedup_data(thdat, entry_index, data, entry->size, 0)) {
+        thtk_free(data);
+        return 0;
+    }
+
+    TRACE_BEGIN(wait);
 #pragma omp critical
     {
-        entry->offset = thdat->offset;
-        thdat->offset += entry->size;
+        TRACE_END(wait, "lock wait", NULL);
+        entry->offset = thdat_reserve(thdat, entry->size, error);
+    }
+    if (entry->offset == -1) {
+        thtk_free(data);
+        return -1;
     }
 
-    th105_data_crypt(thdat, entry, data);
+    th105_data_crypt(thdat, entry, data, entry->size);
 
     if (thtk_io_pwrite(thdat->stream, data, entry->size, entry->offset, error) == -1) {
-        free(data);
+        thtk_free(data);
         return -1;
     }
 
-    free(data);
+    thtk_free(data);
     return entry->size;
 }
 
@@ -270,7 +318,7 @@ th75_close(
     uint16_t entry_count = thdat->entry_count;
 
     size_t header_size = (8+name_len)*entry_count;
-    uint8_t *header_buf = calloc(1, header_size);
+    uint8_t *header_buf = thtk_calloc(1, header_size);
 
     uint8_t *ptr = header_buf;
     for (uint16_t i = 0; i < entry_count; i++) {
@@ -295,7 +343,7 @@ th75_close(
             header_size)
         return 0;
 
-    free(header_buf);
+    thtk_free(header_buf);
 
     return 1;
 }
@@ -319,7 +367,7 @@ th105_close(
         return 0;
     }
 
-    buffer = malloc(header_size);
+    buffer = thtk_malloc(header_size);
 
     unsigned char* buffer_ptr = buffer;
     for (unsigned i = 0; i < entry_count; i++) {
@@ -347,13 +395,13 @@ th105_close(
     if (thtk_io_write(thdat->stream, buffer, header_size, error) == -1)
         return 0;
 
-    free(buffer);
+    thtk_free(buffer);
 
     return 1;
 }
 
 const thdat_module_t archive_th75 = {
-    THDAT_NO_COMPRESSION,
+    THDAT_NO_COMPRESSION|THDAT_SHARED_DATA,
     th75_open,
     th75_create,
     th75_close,
@@ -362,7 +410,7 @@ const thdat_module_t archive_th75 = {
 };
 
 const thdat_module_t archive_th105 = {
-    THDAT_NO_COMPRESSION|THDAT_LATE_INIT,
+    THDAT_NO_COMPRESSION|THDAT_LATE_INIT|THDAT_SHARED_DATA,
     th105_open,
     th105_create,
     th105_close,
@@ -27,13 +27,16 @@
  * DAMAGE.
  */
 #include <config.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <thtk/thtk.h>
 #include "thcrypt.h"
 #include "thdat.h"
 #include "thlzss.h"
 #include "util.h"
 #include "dattypes.h"
+#include "trace.h"
 
 static unsigned int
 th95_get_crypt_param_index(
@@ -103,9 +106,9 @@ th95_open(
     if (thtk_io_seek(thdat->stream, -(off_t)header.zsize, SEEK_END, error) == -1)
         return 0;
 
-    unsigned char* zdata = malloc(header.zsize);
+    unsigned char* zdata = thtk_malloc(header.zsize);
     if (thtk_io_read(thdat->stream, zdata, header.zsize, error) != header.zsize) {
-        free(zdata);
+        thtk_free(zdata);
         return 0;
     }
 
@@ -120,7 +123,7 @@ th95_open(
     if (th_unlzss(zdata_stream, data_stream, header.size, error) == -1)
         return 0;
     thtk_io_close(zdata_stream);
-    unsigned char* data = malloc(header.size);
+    unsigned char* data = thtk_malloc(header.size);
     if (thtk_io_seek(data_stream, 0, SEEK_SET, error) == -1)
         return 0;
     if (thtk_io_read(data_stream, data, header.size, error) != header.size)
@@ -128,33 +131,46 @@ th95_open(
     thtk_io_close(data_stream);
 
     thdat->entry_count = header.entry_count;
-    thdat->entries = calloc(header.entry_count, sizeof(thdat_entry_t));
+    thdat->entries = thdat_calloc(thdat, header.entry_count, sizeof(thdat_entry_t));
+    if (!thdat->entries) {
+        thtk_error_new(error, "out of memory");
+        thtk_free(data);
+        return 0;
+    }
 
     if (header.entry_count) {
-        thdat_entry_t* prev = NULL;
         const uint32_t* ptr = (uint32_t*)data;
         for (uint32_t i = 0; i < header.entry_count; ++i) {
             thdat_entry_t* entry = &thdat->entries[i];
             thdat_entry_init(entry);
 
-            strcpy(entry->name, (char*)ptr);
-            ptr = (uint32_t*)((char*)ptr + strlen(entry->name) + (4 - strlen(entry->name) % 4));
+            const size_t name_length = strlen((char*)ptr);
+            if (!(entry->name = thdat_name_dup(thdat, (char*)ptr, 255))) {
+                thtk_error_new(error, "out of memory");
+                thtk_free(data);
+                return 0;
+            }
+            ptr = (uint32_t*)((char*)ptr + name_length + (4 - name_length % 4));
             entry->offset = *ptr++;
             entry->size = *ptr++;
             /* Zero. */
             entry->extra = *ptr++;
-
-            if (prev)
-                prev->zsize = entry->offset - prev->offset;
-            prev = entry;
         }
         off_t filesize = thtk_io_seek(thdat->stream, 0, SEEK_END, error);
         if (filesize == -1)
             return 0;
-        prev->zsize = (filesize - header.zsize) - prev->offset;
+        /* The stored size is the distance to the next entry, entries sharing
+         * their data with the following one have the same size. */
+        off_t end = filesize - header.zsize;
+        for (uint32_t i = header.entry_count; i--; ) {
+            thdat_entry_t* entry = &thdat->entries[i];
+            if (i + 1 < header.entry_count && thdat->entries[i + 1].offset != entry->offset)
+                end = thdat->entries[i + 1].offset;
+            entry->zsize = end - entry->offset;
+        }
     }
 
-    free(data);
+    thtk_free(data);
 
     return 1;
 }
@@ -168,11 +184,13 @@ th95_read(
 {
     thdat_entry_t* entry = &thdat->entries[entry_index];
     unsigned char* data;
-    unsigned char* zdata = malloc(entry->zsize);
+    unsigned char* zdata = thtk_malloc(entry->zsize);
 
     int failed = 0;
+    TRACE_BEGIN(wait);
 #pragma omp critical
     {
+        TRACE_END(wait, "lock wait", NULL);
         failed = (thtk_io_seek(thdat->stream, entry->offset, SEEK_SET, error) == -1) ||
                  (thtk_io_read(thdat->stream, zdata, entry->zsize, error) != entry->zsize);
     }
@@ -199,7 +217,7 @@ th95_read(
 
         if (thtk_io_seek(data_stream, 0, SEEK_SET, error) == -1)
             return -1;
-        data = malloc(entry->size);
+        data = thtk_malloc(entry->size);
         if (thtk_io_read(data_stream, data, entry->size, error) != entry->size)
             return -1;
         thtk_io_close(data_stream);
@@ -208,7 +226,7 @@ th95_read(
     if (thtk_io_write(output, data, entry->size, error) == -1)
         return -1;
 
-    free(data);
+    thtk_free(data);
 
     return 1;
 }
@@ -224,6 +242,179 @@ th95_create(
     return 1;
 }
 
+/* Entries at least this large are compressed straight into the archive
+ * instead of in memory. */
+#define TH95_STREAM_SIZE (16 * 1024 * 1024)
+#define TH95_STREAM_WINDOW (64 * 1024)
+
+typedef struct {
+    thtk_io_t* stream;
+    const crypt_params_t* crypt_params;
+    /* Output is discarded once it reaches this size. */
+    size_t max_size;
+    size_t size;
+    int overflow;
+    /* th_encrypt only touches the start of the data, the head is buffered
+     * until it's large enough that encrypting it gives the same result as
+     * encrypting everything. */
+    unsigned char* head;
+    size_t head_size;
+    size_t head_used;
+    unsigned char* window;
+    size_t window_used;
+} th95_stream_t;
+
+static void
+th95_stream_init(
+    th95_stream_t* s,
+    thtk_io_t* stream,
+    const crypt_params_t* crypt_params,
+    size_t max_size)
+{
+    const unsigned int block = crypt_params->block;
+    const unsigned int limit = (crypt_params->limit + block - 1) / block * block;
+
+    s->stream = stream;
+    s->crypt_params = crypt_params;
+    s->max_size = max_size;
+    s->size = 0;
+    s->overflow = 0;
+    s->head_size = limit + block + 1;
+    s->head_used = 0;
+    s->window_used = 0;
+}
+
+static int
+th95_stream_flush_head(
+    th95_stream_t* s,
+    thtk_error_t** error)
+{
+    th_encrypt(s->head, s->head_used, s->crypt_params->key,
+        s->crypt_params->step, s->crypt_params->block,
+        s->crypt_params->limit);
+    return thtk_io_write(s->stream, s->head, s->head_used, error) == (ssize_t)s->head_used;
+}
+
+static ssize_t
+th95_stream_write(
+    void* data,
+    const void* buf,
+    size_t count,
+    thtk_error_t** error)
+{
+    th95_stream_t* s = data;
+    const unsigned char* in = buf;
+    size_t remaining = count;
+
+    s->size += count;
+    if (s->overflow)
+        return count;
+    if (s->size >= s->max_size) {
+        s->overflow = 1;
+        return count;
+    }
+
+    while (remaining) {
+        size_t n;
+        if (s->head_used < s->head_size) {
+            n = s->head_size - s->head_used;
+            if (n > remaining)
+                n = remaining;
+            memcpy(s->head + s->head_used, in, n);
+            s->head_used += n;
+            if (s->head_used == s->head_size &&
+                !th95_stream_flush_head(s, error))
+                return -1;
+        } else {
+            n = TH95_STREAM_WINDOW - s->window_used;
+            if (n > remaining)
+                n = remaining;
+            memcpy(s->window + s->window_used, in, n);
+            s->window_used += n;
+            if (s->window_used == TH95_STREAM_WINDOW) {
+                if (thtk_io_write(s->stream, s->window, TH95_STREAM_WINDOW, error) != TH95_STREAM_WINDOW)
+                    return -1;
+                s->window_used = 0;
+            }
+        }
+        in += n;
+        remaining -= n;
+    }
+
+    return count;
+}
+
+static int
+th95_stream_finish(
+    th95_stream_t* s,
+    thtk_error_t** error)
+{
+    if (s->head_used < s->head_size)
+        return th95_stream_flush_head(s, error);
+    if (s->window_used)
+        return thtk_io_write(s->stream, s->window, s->window_used, error) == (ssize_t)s->window_used;
+    return 1;
+}
+
+/* Must be called with the archive stream locked, the entry is written at the
+ * current position. */
+static ssize_t
+th95_write_stream(
+    thdat_t* thdat,
+    thdat_entry_t* entry,
+    thtk_io_t* input,
+    off_t first_offset,
+    thtk_error_t** error)
+{
+    const crypt_params_t* crypt_params = th95_get_crypt_param(thdat->version, entry->name);
+    th95_stream_t s;
+    ssize_t ret = -1;
+
+    unsigned char* buffer = NULL;
+    th95_stream_init(&s, thdat->stream, crypt_params, entry->size);
+    s.head = thtk_malloc(s.head_size);
+    s.window = thtk_malloc(TH95_STREAM_WINDOW);
+
+    thtk_io_t* sink = thtk_io_open_write_callback(th95_stream_write, &s, error);
+    if (!sink)
+        goto end;
+    entry->offset = thdat->offset;
+    entry->zsize = th_lzss(input, entry->size, sink, error);
+    thtk_io_close(sink);
+    if (entry->zsize == -1)
+        goto end;
+
+    if (s.overflow) {
+        /* Compression didn't help, so overwrite what has been written so far
+         * with the uncompressed data.  Less than entry->size bytes have been
+         * written, so nothing is left behind. */
+        if (thtk_io_seek(thdat->stream, entry->offset, SEEK_SET, error) == -1 ||
+            thtk_io_seek(input, first_offset, SEEK_SET, error) == -1)
+            goto end;
+        th95_stream_init(&s, thdat->stream, crypt_params, SIZE_MAX);
+        buffer = thtk_malloc(TH95_STREAM_WINDOW);
+        size_t remaining = entry->size;
+        while (remaining) {
+            const size_t n = remaining < TH95_STREAM_WINDOW ? remaining : TH95_STREAM_WINDOW;
+            if (thtk_io_read(input, buffer, n, error) != (ssize_t)n ||
+                th95_stream_write(&s, buffer, n, error) == -1)
+                goto end;
+            remaining -= n;
+        }
+        entry->zsize = entry->size;
+    }
+    if (!th95_stream_finish(&s, error) ||
+        thdat_reserve(thdat, entry->zsize, error) == -1)
+        goto end;
+
+    ret = entry->zsize;
+end:
+    thtk_free(buffer);
+    thtk_free(s.head);
+    thtk_free(s.window);
+    return ret;
+}
+
 static ssize_t
 th95_write(
     thdat_t* thdat,
@@ -240,6 +431,26 @@ th95_write(
         return -1;
 
     entry->size = input_length;
+
+    switch (thdat_dedup_stream(thdat, entry_index, input, input_length,
+            th95_get_crypt_param_index(entry->name), error)) {
+    case -1:
+        return -1;
+    case 1:
+        return 0;
+    }
+
+    if (entry->size >= TH95_STREAM_SIZE) {
+        ssize_t ret;
+        TRACE_BEGIN(wait);
+#pragma omp critical
+        {
+            TRACE_END(wait, "lock wait", NULL);
+            ret = th95_write_stream(thdat, entry, input, first_offset, error);
+        }
+        return ret;
+    }
+
     thtk_io_t* data_stream = thtk_io_open_growing_memory(error);
     if (!data_stream)
         return -1;
@@ -251,13 +462,13 @@ th95_write(
 
         if (thtk_io_seek(input, first_offset, SEEK_SET, error) == -1)
             return -1;
-        data = malloc(entry->size);
+        data = thtk_malloc(entry->size);
         if (thtk_io_read(input, data, entry->size, error) != entry->size)
             return -1;
 
         entry->zsize = entry->size;
     } else {
-        data = malloc(entry->zsize);
+        data = thtk_malloc(entry->zsize);
         if (thtk_io_seek(data_stream, 0, SEEK_SET, error) == -1)
             return -1;
         int ret = thtk_io_read(data_stream, data, entry->zsize, error);
@@ -271,16 +482,16 @@ th95_write(
         crypt_params->block, crypt_params->limit);
 
     int failed = 0;
+    TRACE_BEGIN(wait);
 #pragma omp critical
     {
-        failed = (thtk_io_write(thdat->stream, data, entry->zsize, error) != entry->zsize);
-        if (!failed) {
-            entry->offset = thdat->offset;
-            thdat->offset += entry->zsize;
-        }
+        TRACE_END(wait, "lock wait", NULL);
+        entry->offset = thdat_reserve(thdat, entry->zsize, error);
+        failed = entry->offset == -1 ||
+            thtk_io_write(thdat->stream, data, entry->zsize, error) != entry->zsize;
     }
 
-    free(data);
+    thtk_free(data);
 
     if (failed)
         return -1;
@@ -310,14 +521,15 @@ th95_close(
         return 0;
     }
 
-    buffer = malloc(list_size);
+    buffer = thtk_malloc(list_size);
 
     uint32_t* buffer_ptr = (uint32_t*)buffer;
     for (i = 0; i < thdat->entry_count; ++i) {
         const thdat_entry_t* entry = &thdat->entries[i];
         const size_t namelen = strlen(entry->name);
-        buffer_ptr = MEMPCPY(buffer_ptr, entry->name,
-            namelen + (4 - namelen % 4));
+        unsigned char* name_ptr = MEMPCPY(buffer_ptr, entry->name, namelen);
+        memset(name_ptr, 0, 4 - namelen % 4);
+        buffer_ptr = (uint32_t*)(name_ptr + 4 - namelen % 4);
         *buffer_ptr++ = entry->offset;
         *buffer_ptr++ = entry->size;
         *buffer_ptr++ = 0;
@@ -334,7 +546,7 @@ th95_close(
         return 0;
 
     thtk_io_close(buffer_stream);
-    zbuffer = malloc(list_zsize);
+    zbuffer = thtk_malloc(list_zsize);
     if (thtk_io_seek(zbuffer_stream, 0, SEEK_SET, error) == -1)
         return 0;
     if (thtk_io_read(zbuffer_stream, zbuffer, list_zsize, error) == -1)
@@ -344,10 +556,10 @@ th95_close(
     th_encrypt(zbuffer, list_zsize, 0x3e, 0x9b, 0x80, list_size);
 
     if (thtk_io_write(thdat->stream, zbuffer, list_zsize, error) == -1) {
-        free(zbuffer);
+        thtk_free(zbuffer);
         return 0;
     }
-    free(zbuffer);
+    thtk_free(zbuffer);
 
     if (thtk_io_seek(thdat->stream, 0, SEEK_SET, error) == -1)
         return 0;
@@ -367,7 +579,7 @@ th95_close(
 }
 
 const thdat_module_t archive_th95 = {
-    THDAT_BASENAME,
+    THDAT_BASENAME|THDAT_SHARED_DATA,
     th95_open,
     th95_create,
     th95_close,
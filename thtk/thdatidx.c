@@ -0,0 +1,384 @@
+/*
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+#include <config.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thtk/thtk.h>
+#include "thdat.h"
+#include "util.h"
+
+/* The index is a snapshot of the parsed entry table of an archive, it is
+ * stored in native byte order and laid out so that it can be used directly
+ * from a mapping of the file.
+ *
+ * Size and modification time alone can't tell apart archives rewritten in
+ * place within the timestamp resolution, so the index also records the
+ * regions of the archive which aren't entry data, its header and file table,
+ * along with a hash of their contents.  Those have to be unchanged for the
+ * index to be used. */
+
+#define THDAT_INDEX_FORMAT 2
+
+typedef struct {
+PACK_BEGIN
+    char magic[4];
+    uint32_t format;
+    uint32_t version;
+    uint32_t entry_count;
+    /* Identifies the state of the archive the index was created for. */
+    uint64_t archive_size;
+    uint64_t archive_mtime;
+    uint64_t table_hash;
+    uint32_t region_count;
+    uint32_t names_size;
+PACK_END
+} PACK_ATTRIBUTE thdat_index_header_t;
+
+typedef struct {
+PACK_BEGIN
+    uint64_t offset;
+    uint64_t size;
+PACK_END
+} PACK_ATTRIBUTE thdat_index_region_t;
+
+typedef struct {
+PACK_BEGIN
+    /* Offset into the name table following the entries. */
+    uint32_t name;
+    uint32_t extra;
+    int64_t size;
+    int64_t zsize;
+    int64_t offset;
+PACK_END
+} PACK_ATTRIBUTE thdat_index_entry_t;
+
+static int
+thdat_index_region_compar(
+    const void* a,
+    const void* b)
+{
+    const thdat_index_region_t* ra = a;
+    const thdat_index_region_t* rb = b;
+    return (ra->offset > rb->offset) - (ra->offset < rb->offset);
+}
+
+/* Finds the parts of the archive between the data of the entries.  regions
+ * must have room for entry_count + 1 regions, the number of regions is
+ * returned. */
+static uint32_t
+thdat_index_regions(
+    const thdat_t* thdat,
+    uint64_t archive_size,
+    thdat_index_region_t* regions)
+{
+    /* The entry data ranges are sorted in place, then replaced by the gaps
+     * between them. */
+    size_t count = 0;
+    for (size_t e = 0; e < thdat->entry_count; ++e) {
+        const thdat_entry_t* entry = &thdat->entries[e];
+        const ssize_t stored = entry->zsize != -1 ? entry->zsize : entry->size;
+        if (entry->offset < 0 || stored <= 0)
+            continue;
+        regions[count].offset = entry->offset;
+        regions[count].size = stored;
+        ++count;
+    }
+    qsort(regions, count, sizeof(*regions), thdat_index_region_compar);
+
+    uint64_t pos = 0;
+    uint32_t gaps = 0;
+    for (size_t r = 0; r < count; ++r) {
+        const uint64_t begin = regions[r].offset < archive_size ? regions[r].offset : archive_size;
+        const uint64_t end = regions[r].size < archive_size - begin ? begin + regions[r].size : archive_size;
+        if (begin > pos) {
+            regions[gaps].offset = pos;
+            regions[gaps].size = begin - pos;
+            ++gaps;
+        }
+        if (end > pos)
+            pos = end;
+    }
+    if (archive_size > pos) {
+        regions[gaps].offset = pos;
+        regions[gaps].size = archive_size - pos;
+        ++gaps;
+    }
+    return gaps;
+}
+
+/* Hashes the given regions of the archive.  0 indicates an error. */
+static int
+thdat_index_hash(
+    thtk_io_t* stream,
+    const thdat_index_region_t* regions,
+    uint32_t region_count,
+    uint64_t* hash,
+    thtk_error_t** error)
+{
+    const size_t buffer_size = 65536;
+    unsigned char* buffer = thtk_malloc(buffer_size);
+    if (!buffer) {
+        thtk_error_new(error, "out of memory");
+        return 0;
+    }
+
+    *hash = THDAT_HASH_INIT;
+    for (uint32_t r = 0; r < region_count; ++r) {
+        uint64_t done = 0;
+        while (done < regions[r].size) {
+            const size_t chunk = regions[r].size - done < buffer_size ? regions[r].size - done : buffer_size;
+            if (thtk_io_pread(stream, buffer, chunk, regions[r].offset + done, error) != (ssize_t)chunk) {
+                thtk_free(buffer);
+                return 0;
+            }
+            *hash = thdat_hash(*hash, buffer, chunk);
+            done += chunk;
+        }
+    }
+
+    thtk_free(buffer);
+    return 1;
+}
+
+int
+thdat_write_index(
+    thdat_t* thdat,
+    thtk_io_t* output,
+    uint64_t archive_size,
+    uint64_t archive_mtime,
+    thtk_error_t** error)
+{
+    if (!thdat || !output) {
+        thtk_error_new(error, "invalid parameter passed");
+        return 0;
+    }
+
+    size_t names_size = 0;
+    for (size_t e = 0; e < thdat->entry_count; ++e)
+        names_size += strlen(thdat->entries[e].name) + 1;
+
+    thdat_index_region_t* regions = thtk_malloc((thdat->entry_count + 1) * sizeof(*regions));
+    if (!regions) {
+        thtk_error_new(error, "out of memory");
+        return 0;
+    }
+    const uint32_t region_count = thdat_index_regions(thdat, archive_size, regions);
+    uint64_t table_hash;
+    if (!thdat_index_hash(thdat->stream, regions, region_count, &table_hash, error)) {
+        thtk_free(regions);
+        return 0;
+    }
+
+    const size_t size = sizeof(thdat_index_header_t) +
+        region_count * sizeof(thdat_index_region_t) +
+        thdat->entry_count * sizeof(thdat_index_entry_t) + names_size;
+    unsigned char* buffer = thtk_malloc(size);
+    if (!buffer) {
+        thtk_free(regions);
+        thtk_error_new(error, "out of memory");
+        return 0;
+    }
+
+    thdat_index_header_t* header = (thdat_index_header_t*)buffer;
+    memcpy(header->magic, "THIX", 4);
+    header->format = THDAT_INDEX_FORMAT;
+    header->version = thdat->version;
+    header->entry_count = thdat->entry_count;
+    header->archive_size = archive_size;
+    header->archive_mtime = archive_mtime;
+    header->table_hash = table_hash;
+    header->region_count = region_count;
+    header->names_size = names_size;
+
+    thdat_index_region_t* index_regions = (thdat_index_region_t*)(header + 1);
+    memcpy(index_regions, regions, region_count * sizeof(*regions));
+    thtk_free(regions);
+
+    thdat_index_entry_t* records = (thdat_index_entry_t*)(index_regions + region_count);
+    char* names = (char*)(records + thdat->entry_count);
+    char* name = names;
+    for (size_t e = 0; e < thdat->entry_count; ++e) {
+        const thdat_entry_t* entry = &thdat->entries[e];
+        records[e].name = name - names;
+        records[e].extra = entry->extra;
+        records[e].size = entry->size;
+        records[e].zsize = entry->zsize;
+        records[e].offset = entry->offset;
+        name = MEMPCPY(name, entry->name, strlen(entry->name) + 1);
+    }
+
+    int ret = thtk_io_write(output, buffer, size, error) == (ssize_t)size;
+    thtk_free(buffer);
+    return ret;
+}
+
+/* Maps an index and checks that it matches the archive, NULL indicates an
+ * error.  The contents of the archive are only checked if input is given. */
+static unsigned char*
+thdat_index_map(
+    unsigned int version,
+    thtk_io_t* input,
+    thtk_io_t* index,
+    uint64_t archive_size,
+    uint64_t archive_mtime,
+    off_t* size,
+    thtk_error_t** error)
+{
+    if ((*size = thtk_io_seek(index, 0, SEEK_END, error)) == -1)
+        return NULL;
+    if ((size_t)*size < sizeof(thdat_index_header_t)) {
+        thtk_error_new(error, "index is truncated");
+        return NULL;
+    }
+
+    unsigned char* map = thtk_io_map(index, 0, *size, error);
+    if (!map)
+        return NULL;
+
+    const thdat_index_header_t* header = (const thdat_index_header_t*)map;
+    const thdat_index_region_t* regions = (const thdat_index_region_t*)(header + 1);
+    uint64_t table_hash;
+
+    if (memcmp(header->magic, "THIX", 4) != 0 ||
+        header->format != THDAT_INDEX_FORMAT) {
+        thtk_error_new(error, "not an index file");
+    } else if ((version && header->version != version) ||
+        header->archive_size != archive_size ||
+        header->archive_mtime != archive_mtime) {
+        thtk_error_new(error, "index is out of date");
+    } else if ((uint64_t)*size != sizeof(thdat_index_header_t) +
+            (uint64_t)header->region_count * sizeof(thdat_index_region_t) +
+            (uint64_t)header->entry_count * sizeof(thdat_index_entry_t) +
+            header->names_size ||
+        (header->names_size && map[*size - 1] != '\0')) {
+        thtk_error_new(error, "index is corrupt");
+    } else if (!input) {
+        return map;
+    } else {
+        uint32_t r;
+        for (r = 0; r < header->region_count; ++r)
+            if (regions[r].size > archive_size ||
+                regions[r].offset > archive_size - regions[r].size)
+                break;
+        if (r != header->region_count) {
+            thtk_error_new(error, "index is corrupt");
+        } else if (thdat_index_hash(input, regions, header->region_count, &table_hash, error)) {
+            if (table_hash == header->table_hash)
+                return map;
+            thtk_error_new(error, "index is out of date");
+        }
+    }
+
+    thtk_io_unmap(index, map);
+    return NULL;
+}
+
+unsigned int
+thdat_index_version(
+    thtk_io_t* index,
+    uint64_t archive_size,
+    uint64_t archive_mtime,
+    thtk_error_t** error)
+{
+    off_t size;
+    if (!index) {
+        thtk_error_new(error, "invalid parameter passed");
+        return 0;
+    }
+    unsigned char* map = thdat_index_map(0, NULL, index, archive_size, archive_mtime, &size, error);
+    if (!map)
+        return 0;
+    const unsigned int version = ((const thdat_index_header_t*)map)->version;
+    thtk_io_unmap(index, map);
+    return version;
+}
+
+/* The entry table is still copied out of the mapping: the modules index
+ * thdat->entries directly and fill in fields while reading, and the mapping
+ * can't outlive the index stream, which the caller may close right after.
+ * The names are copied in one piece. */
+thdat_t*
+thdat_open_index(
+    unsigned int version,
+    thtk_io_t* input,
+    thtk_io_t* index,
+    uint64_t archive_size,
+    uint64_t archive_mtime,
+    thtk_error_t** error)
+{
+    off_t size;
+    if (!input || !index) {
+        thtk_error_new(error, "invalid parameter passed");
+        return NULL;
+    }
+
+    unsigned char* map = thdat_index_map(version, input, index, archive_size, archive_mtime, &size, error);
+    if (!map)
+        return NULL;
+
+    const thdat_index_header_t* header = (const thdat_index_header_t*)map;
+    const thdat_index_region_t* regions = (const thdat_index_region_t*)(header + 1);
+    const thdat_index_entry_t* records = (const thdat_index_entry_t*)(regions + header->region_count);
+    const char* names = (const char*)(records + header->entry_count);
+    char* names_copy;
+    thdat_t* thdat;
+
+    if (!(thdat = thdat_new(header->version, input, NULL, error)))
+        goto out;
+
+    thdat->entry_count = header->entry_count;
+    thdat->entries = thdat_calloc(thdat, header->entry_count, sizeof(thdat_entry_t));
+    names_copy = thdat_name_alloc(thdat, header->names_size);
+    if ((header->entry_count && !thdat->entries) || (header->names_size && !names_copy)) {
+        thtk_error_new(error, "out of memory");
+        thdat_free(thdat);
+        thdat = NULL;
+        goto out;
+    }
+    memcpy(names_copy, names, header->names_size);
+    for (uint32_t e = 0; e < header->entry_count; ++e) {
+        thdat_entry_t* entry = &thdat->entries[e];
+        thdat_entry_init(entry);
+        if (records[e].name >= header->names_size) {
+            thtk_error_new(error, "index is corrupt");
+            thdat_free(thdat);
+            thdat = NULL;
+            goto out;
+        }
+        entry->name = names_copy + records[e].name;
+        entry->extra = records[e].extra;
+        entry->size = records[e].size;
+        entry->zsize = records[e].zsize;
+        entry->offset = records[e].offset;
+    }
+
+out:
+    thtk_io_unmap(index, map);
+    return thdat;
+}
@@ -35,6 +35,8 @@
 
 #include "bits.h"
 #include "thlzss.h"
+#include "trace.h"
+#include "util.h"
 
 /* Compression specification:
  *
@@ -128,6 +130,7 @@ th_lzss(
     size_t bytes_read = 0;
     unsigned int i;
     unsigned char c;
+    TRACE_BEGIN(span);
 
     if (!input || !output) {
         thtk_error_new(error, "input or output is NULL");
@@ -235,6 +238,7 @@ th_lzss(
 
     bitstream_finish(&bs);
 
+    TRACE_END(span, "th_lzss", NULL);
     return bs.byte_count;
 }
 
@@ -250,6 +254,7 @@ th_unlzss(
     unsigned int i;
     size_t bytes_written = 0;
     struct bitstream bs;
+    TRACE_BEGIN(span);
 
     if (!input || !output) {
         thtk_error_new(error, "input or output is NULL");
@@ -270,8 +275,10 @@ th_unlzss(
             dict_head = (dict_head + 1) & LZSS_DICTSIZE_MASK;
         } else {
             unsigned int match_offset = bitstream_read(&bs, 13);
-            if (!match_offset)
+            if (!match_offset) {
+                TRACE_END(span, "th_unlzss", NULL);
                 return bytes_written;
+            }
 
             unsigned int match_len = bitstream_read(&bs, 4) + LZSS_MIN_MATCH;
 
@@ -286,5 +293,6 @@ th_unlzss(
         }
     }
 
+    TRACE_END(span, "th_unlzss", NULL);
     return bytes_written;
 }
@@ -32,61 +32,204 @@
 #include <stdlib.h>
 #include <string.h>
 #include <thtk/thtk.h>
+#include "simd.h"
 #include "thrle.h"
+#include "util.h"
+
+/* The format stores bytes literally.  When a byte is equal to the byte
+ * before it, it's followed by the number of additional repetitions, at most
+ * 255.  The first byte never starts a run. */
+
+/* Returns the first position from start on where a byte is equal to the one
+ * before it, or size.  start must be at least 1. */
+static size_t
+rle_find_pair(
+    const unsigned char* data,
+    size_t start,
+    size_t size)
+{
+    size_t i = start;
+#ifdef THTK_SSE2
+    for (; i + 16 <= size; i += 16) {
+        const __m128i cur = _mm_loadu_si128((const __m128i*)(data + i));
+        const __m128i prev = _mm_loadu_si128((const __m128i*)(data + i - 1));
+        const unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(cur, prev));
+        if (mask)
+            return i + thtk_ctz(mask);
+    }
+#endif
+    for (; i < size; ++i)
+        if (data[i] == data[i - 1])
+            return i;
+    return size;
+}
+
+/* Returns the number of bytes equal to c from start on, at most limit. */
+static size_t
+rle_run_length(
+    const unsigned char* data,
+    size_t start,
+    size_t size,
+    unsigned char c,
+    size_t limit)
+{
+    const size_t end = size - start < limit ? size : start + limit;
+    size_t i = start;
+#ifdef THTK_SSE2
+    const __m128i cv = _mm_set1_epi8((char)c);
+    for (; i + 16 <= end; i += 16) {
+        const __m128i cur = _mm_loadu_si128((const __m128i*)(data + i));
+        const unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(cur, cv));
+        if (mask != 0xffff)
+            return i + thtk_ctz(~mask) - start;
+    }
+#endif
+    for (; i < end && data[i] == c; ++i)
+        ;
+    return i - start;
+}
+
+/* Copies as much of the data as fits into the output. */
+static void
+rle_put(
+    unsigned char* output,
+    size_t output_size,
+    size_t pos,
+    const unsigned char* data,
+    size_t size)
+{
+    if (pos < output_size)
+        memcpy(output + pos, data, output_size - pos < size ? output_size - pos : size);
+}
+
+static void
+rle_fill(
+    unsigned char* output,
+    size_t output_size,
+    size_t pos,
+    unsigned char c,
+    size_t size)
+{
+    if (pos < output_size)
+        memset(output + pos, c, output_size - pos < size ? output_size - pos : size);
+}
 
 ssize_t
-thtk_rle(
-    thtk_io_t* input,
+thtk_rle_buffer(
+    const unsigned char* input,
     size_t input_size,
-    thtk_io_t* output,
+    unsigned char* output,
+    size_t output_size,
     thtk_error_t** error)
 {
-    size_t bytes_read = 0;
-    size_t bytes_written = 0;
-    unsigned char prevc = 0;
-    unsigned char c = 0;
-    unsigned int rl = 0;
+    size_t pos = 0;
+    size_t i = 0;
 
-    if (!input || !output) {
+    if ((!input && input_size) || (!output && output_size)) {
         thtk_error_new(error, "input or output is NULL");
         return -1;
     }
 
-    while (bytes_read < input_size) {
-        if (thtk_io_read(input, &c, 1, error) != 1)
-            return -1;
-        if (bytes_read == 0) {
-            prevc = ~c;
+    while (i < input_size) {
+        const size_t pair = rle_find_pair(input, i ? i : 1, input_size);
+        if (pair == input_size) {
+            rle_put(output, output_size, pos, input + i, input_size - i);
+            pos += input_size - i;
+            break;
         }
-        ++bytes_read;
-        if (rl) {
-            if (c != prevc || rl == 0x100) {
-                unsigned char rle[2] = { rl - 1, c };
-                if (thtk_io_write(output, rle, 2, error) != 2)
-                    return -1;
-                bytes_written += 2;
-                rl = 0;
-            }
-        } else {
-            if (thtk_io_write(output, &c, 1, error) != 1)
-                return -1;
-            ++bytes_written;
+
+        rle_put(output, output_size, pos, input + i, pair + 1 - i);
+        pos += pair + 1 - i;
+
+        const unsigned char count = rle_run_length(input, pair + 1, input_size, input[pair], 0xff);
+        rle_put(output, output_size, pos, &count, 1);
+        ++pos;
+
+        i = pair + 1 + count;
+    }
+
+    return pos;
+}
+
+ssize_t
+thtk_unrle_buffer(
+    const unsigned char* input,
+    size_t input_size,
+    unsigned char* output,
+    size_t output_size,
+    thtk_error_t** error)
+{
+    size_t pos = 0;
+    size_t i = 0;
+
+    if ((!input && input_size) || (!output && output_size)) {
+        thtk_error_new(error, "input or output is NULL");
+        return -1;
+    }
+
+    if (!input_size)
+        return 0;
+
+    size_t pair = rle_find_pair(input, 1, input_size);
+    for (;;) {
+        if (pair >= input_size) {
+            rle_put(output, output_size, pos, input + i, input_size - i);
+            pos += input_size - i;
+            break;
         }
 
-        if (c == prevc)
-            ++rl;
+        rle_put(output, output_size, pos, input + i, pair + 1 - i);
+        pos += pair + 1 - i;
+
+        /* A repeated byte at the very end has no count. */
+        if (pair + 1 == input_size)
+            break;
+
+        const unsigned char c = input[pair];
+        const unsigned char count = input[pair + 1];
+        rle_fill(output, output_size, pos, c, count);
+        pos += count;
+
+        i = pair + 2;
+        if (i == input_size)
+            break;
 
-        prevc = c;
+        /* The byte after the count continues the run if it's equal. */
+        pair = input[i] == c ? i : rle_find_pair(input, i + 1, input_size);
     }
 
-    if (rl) {
-        unsigned char len = rl - 1;
-        if (thtk_io_write(output, &len, 1, error) != 1)
-            return -1;
-        ++bytes_written;
+    return pos;
+}
+
+ssize_t
+thtk_rle(
+    thtk_io_t* input,
+    size_t input_size,
+    thtk_io_t* output,
+    thtk_error_t** error)
+{
+    if (!input || !output) {
+        thtk_error_new(error, "input or output is NULL");
+        return -1;
     }
 
-    return bytes_written;
+    unsigned char* data = thtk_malloc(input_size);
+    if (thtk_io_read(input, data, input_size, error) != (ssize_t)input_size) {
+        thtk_free(data);
+        return -1;
+    }
+
+    /* Every count byte follows at least two bytes. */
+    const size_t bound = input_size + input_size / 2 + 1;
+    unsigned char* rle = thtk_malloc(bound);
+    ssize_t ret = thtk_rle_buffer(data, input_size, rle, bound, error);
+    thtk_free(data);
+
+    if (ret != -1 && thtk_io_write(output, rle, ret, error) != ret)
+        ret = -1;
+    thtk_free(rle);
+
+    return ret;
 }
 
 ssize_t
@@ -96,65 +239,26 @@ thtk_unrle(
     thtk_io_t* output,
     thtk_error_t** error)
 {
-    size_t bytes_read = 0;
-    size_t bytes_written = 0;
-    unsigned int i;
-
     if (!input || !output) {
         thtk_error_new(error, "input or output is NULL");
         return -1;
     }
 
-    if (input_size < 3) {
-        for (i = 0; i < input_size; ++i) {
-            unsigned char c;
-            if (thtk_io_read(input, &c, 1, error) != 1)
-                return -1;
-            ++bytes_read;
-            if (thtk_io_write(output, &c, 1, error) != 1)
-                return -1;
-            ++bytes_written;
-        }
-        return bytes_written;
-    } else if (input_size >= 3) {
-        unsigned char prev, cur;
-        if (thtk_io_read(input, &prev, 1, error) != 1)
-            return -1;
-        ++bytes_read;
-        if (thtk_io_write(output, &prev, 1, error) != 1)
-            return -1;
-        ++bytes_written;
-        if (thtk_io_read(input, &cur, 1, error) != 1)
-            return -1;
-        ++bytes_read;
-        if (thtk_io_write(output, &cur, 1, error) != 1)
-            return -1;
-        ++bytes_written;
-        while (bytes_read < input_size) {
-            if (prev == cur) {
-                unsigned char count;
-                if (thtk_io_read(input, &count, 1, error) != 1)
-                    return -1;
-                ++bytes_read;
-                for (i = 0; i < count; ++i) {
-                    if (thtk_io_write(output, &cur, 1, error) != 1)
-                        return -1;
-                    ++bytes_written;
-                }
-
-                if (bytes_read == input_size)
-                    break;
-            }
-
-            prev = cur;
-            if (thtk_io_read(input, &cur, 1, error) != 1)
-                return -1;
-            ++bytes_read;
-            if (thtk_io_write(output, &cur, 1, error) != 1)
-                return -1;
-            ++bytes_written;
-        }
+    unsigned char* data = thtk_malloc(input_size);
+    if (thtk_io_read(input, data, input_size, error) != (ssize_t)input_size) {
+        thtk_free(data);
+        return -1;
+    }
+
+    ssize_t ret = thtk_unrle_buffer(data, input_size, NULL, 0, error);
+    if (ret != -1) {
+        unsigned char* raw = thtk_malloc(ret);
+        thtk_unrle_buffer(data, input_size, raw, ret, error);
+        if (thtk_io_write(output, raw, ret, error) != ret)
+            ret = -1;
+        thtk_free(raw);
     }
+    thtk_free(data);
 
-    return bytes_written;
+    return ret;
 }
@@ -35,13 +35,33 @@
 #endif
 #include <thtk/thtk.h>
 
-ssize_t thtk_rle(
+/* These are exported for thtk_bench, but not part of the installed API. */
+
+/* Compresses input_size bytes from input.  At most output_size bytes are
+ * written to output; the return value is the full size of the compressed
+ * data, so the output was cut short if it's larger than output_size. */
+THTK_EXPORT ssize_t thtk_rle_buffer(
+    const unsigned char* input,
+    size_t input_size,
+    unsigned char* output,
+    size_t output_size,
+    thtk_error_t** error);
+
+/* Like thtk_rle_buffer, but decompresses. */
+THTK_EXPORT ssize_t thtk_unrle_buffer(
+    const unsigned char* input,
+    size_t input_size,
+    unsigned char* output,
+    size_t output_size,
+    thtk_error_t** error);
+
+THTK_EXPORT ssize_t thtk_rle(
     thtk_io_t* input,
     size_t input_size,
     thtk_io_t* output,
     thtk_error_t** error);
 
-ssize_t thtk_unrle(
+THTK_EXPORT ssize_t thtk_unrle(
     thtk_io_t* input,
     size_t input_size,
     thtk_io_t* output,
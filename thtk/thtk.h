@@ -29,6 +29,7 @@
 #ifndef THTK_H_
 #define THTK_H_
 
+#include <thtk/alloc.h>
 #include <thtk/io.h>
 #include <thtk/error.h>
 
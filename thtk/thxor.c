@@ -0,0 +1,76 @@
+/*
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+#include <config.h>
+#include <stddef.h>
+#include "simd.h"
+#include "thxor.h"
+
+void
+th_xor(
+    unsigned char* data,
+    size_t size,
+    unsigned char key,
+    unsigned char step1,
+    unsigned char step2)
+{
+#ifdef THTK_SSE2
+    if (size >= 16) {
+        /* The key for byte i+16 differs from the key for byte i by
+         * 16*step1 + 120*step2, with step1 as it is at byte i.  Modulo 256,
+         * that is the same for i and i+16, so each block of 16 keys is the
+         * previous block plus a constant vector. */
+        unsigned char keys[16], delta[16];
+        for (unsigned int i = 0; i < 16; ++i) {
+            keys[i] = key;
+            delta[i] = 16*step1 + 120*step2;
+            key += step1;
+            step1 += step2;
+        }
+
+        __m128i k = _mm_loadu_si128((const __m128i*)keys);
+        const __m128i d = _mm_loadu_si128((const __m128i*)delta);
+        size_t i = 0;
+        for (; i + 16 <= size; i += 16) {
+            const __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+            _mm_storeu_si128((__m128i*)(data + i), _mm_xor_si128(v, k));
+            k = _mm_add_epi8(k, d);
+        }
+
+        _mm_storeu_si128((__m128i*)keys, k);
+        for (unsigned int j = 0; i < size; ++i, ++j)
+            data[i] ^= keys[j];
+        return;
+    }
+#endif
+    while (size-- > 0) {
+        *data++ ^= key;
+        key += step1;
+        step1 += step2;
+    }
+}
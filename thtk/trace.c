@@ -0,0 +1,186 @@
+/*
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+#include <config.h>
+#ifdef WITH_TRACE
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#include "trace.h"
+
+typedef struct {
+    const char* name;
+    char* detail;
+    uint64_t start;
+    uint64_t end;
+    int tid;
+} thtk_trace_event_t;
+
+enum {
+    TRACE_UNKNOWN,
+    TRACE_OFF,
+    TRACE_ON
+};
+
+/* The events are kept with the C library allocator, so that they survive
+ * whatever happens to the one set by thtk_set_allocator. */
+static int thtk_trace_state = TRACE_UNKNOWN;
+static char* thtk_trace_path;
+static uint64_t thtk_trace_epoch;
+static thtk_trace_event_t* thtk_trace_events;
+static size_t thtk_trace_count;
+static size_t thtk_trace_size;
+
+/* Microseconds from an arbitrary point. */
+static uint64_t
+thtk_trace_now(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER counter, frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (uint64_t)counter.QuadPart * 1000000 / (uint64_t)frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+static void
+thtk_trace_write_string(
+    FILE* stream,
+    const char* s)
+{
+    putc('"', stream);
+    for (; *s; ++s) {
+        const unsigned char c = *s;
+        if (c == '"' || c == '\\')
+            fprintf(stream, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(stream, "\\u%04x", c);
+        else
+            putc(c, stream);
+    }
+    putc('"', stream);
+}
+
+static void
+thtk_trace_write(void)
+{
+    FILE* stream = fopen(thtk_trace_path, "w");
+    if (!stream) {
+        fprintf(stderr, "thtk: couldn't open %s for writing the trace\n", thtk_trace_path);
+        return;
+    }
+    fputs("{\"traceEvents\":[\n", stream);
+    for (size_t i = 0; i < thtk_trace_count; ++i) {
+        const thtk_trace_event_t* event = &thtk_trace_events[i];
+        fprintf(stream, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+            "\"ts\":%" PRIu64 ",\"dur\":%" PRIu64,
+            event->name, event->tid,
+            event->start - thtk_trace_epoch, event->end - event->start);
+        if (event->detail) {
+            fputs(",\"args\":{\"detail\":", stream);
+            thtk_trace_write_string(stream, event->detail);
+            putc('}', stream);
+        }
+        fputs(i + 1 < thtk_trace_count ? "},\n" : "}\n", stream);
+    }
+    fputs("],\"displayTimeUnit\":\"ms\"}\n", stream);
+    fclose(stream);
+}
+
+uint64_t
+thtk_trace_begin(void)
+{
+    if (thtk_trace_state == TRACE_UNKNOWN) {
+#pragma omp critical(thtk_trace)
+        if (thtk_trace_state == TRACE_UNKNOWN) {
+            const char* path = getenv("THTK_TRACE");
+            if (path && *path && (thtk_trace_path = malloc(strlen(path) + 1))) {
+                strcpy(thtk_trace_path, path);
+                thtk_trace_epoch = thtk_trace_now();
+                atexit(thtk_trace_write);
+                thtk_trace_state = TRACE_ON;
+            } else {
+                thtk_trace_state = TRACE_OFF;
+            }
+        }
+    }
+    return thtk_trace_state == TRACE_ON ? thtk_trace_now() : 0;
+}
+
+void
+thtk_trace_end(
+    uint64_t start,
+    const char* name,
+    const char* detail)
+{
+    if (thtk_trace_state != TRACE_ON)
+        return;
+
+    thtk_trace_event_t event;
+    event.end = thtk_trace_now();
+    event.start = start;
+    event.name = name;
+    event.detail = NULL;
+    if (detail && (event.detail = malloc(strlen(detail) + 1)))
+        strcpy(event.detail, detail);
+#ifdef _OPENMP
+    event.tid = omp_get_thread_num();
+#else
+    event.tid = 0;
+#endif
+
+#pragma omp critical(thtk_trace)
+    {
+        if (thtk_trace_count == thtk_trace_size) {
+            const size_t size = thtk_trace_size ? thtk_trace_size * 2 : 1024;
+            thtk_trace_event_t* events = realloc(thtk_trace_events, size * sizeof(*events));
+            if (events) {
+                thtk_trace_events = events;
+                thtk_trace_size = size;
+            }
+        }
+        if (thtk_trace_count < thtk_trace_size)
+            thtk_trace_events[thtk_trace_count++] = event;
+        else
+            free(event.detail);
+    }
+}
+#endif
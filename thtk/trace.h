@@ -0,0 +1,52 @@
+/*
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <config.h>
+
+/* Spans recorded when thtk is built with WITH_TRACE and the THTK_TRACE
+ * environment variable names an output file.  The file is written in the
+ * Chrome trace event format when the program exits.  name must be a string
+ * literal, detail is copied and may be NULL.  Without WITH_TRACE the macros
+ * expand to nothing. */
+#ifdef WITH_TRACE
+#include <inttypes.h>
+
+uint64_t thtk_trace_begin(void);
+void thtk_trace_end(uint64_t start, const char* name, const char* detail);
+
+# define TRACE_BEGIN(span) uint64_t span = thtk_trace_begin()
+# define TRACE_END(span, name, detail) thtk_trace_end(span, name, detail)
+#else
+# define TRACE_BEGIN(span) ((void)0)
+# define TRACE_END(span, name, detail) ((void)0)
+#endif
+
+#endif
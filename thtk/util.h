@@ -31,7 +31,20 @@
 
 #include <config.h>
 #include <string.h>
+#include <thtk/error.h>
 
 #define MEMPCPY(d,s,n) ((void*)((char*)memcpy((d),(s),(n))+(n)))
 
+/* Like thtk_error_func_new, but function and a message without conversions
+ * are only referenced.  libthtk passes __func__ and string literals, which
+ * outlive any error, so its errors are only formatted when read. */
+void thtk_error_func_literal(
+    thtk_error_t** error,
+    const char* function,
+    const char* message,
+    ...);
+
+#undef thtk_error_new
+#define thtk_error_new(error, ...) thtk_error_func_literal(error, __func__, __VA_ARGS__)
+
 #endif
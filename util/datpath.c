@@ -0,0 +1,201 @@
+/*
+ * Redistribution and use in source and binary forms, with
+ * or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain this list
+ *    of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce this
+ *    list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+#include <config.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thtk/thtk.h>
+#include "datpath.h"
+#include "file.h"
+#include "program.h"
+
+static void
+print_error(
+    thtk_error_t* error)
+{
+    fprintf(stderr, "%s:%s\n", argv0, thtk_error_message(error));
+}
+
+/* Splits path into the name of an existing archive and the name of a file
+ * inside of it.  Names that refer to an existing file, including ones that
+ * start with a drive letter, are never split. */
+static char*
+datpath_split(
+    const char* path,
+    const char** entry_name)
+{
+    FILE* stream;
+    const char* colon;
+
+    if ((stream = fopen(path, "rb"))) {
+        fclose(stream);
+        return NULL;
+    }
+
+    for (colon = strchr(path, ':'); colon; colon = strchr(colon + 1, ':')) {
+        if (colon == path || !colon[1])
+            continue;
+        char* archive_name = malloc(colon - path + 1);
+        memcpy(archive_name, path, colon - path);
+        archive_name[colon - path] = '\0';
+        if ((stream = fopen(archive_name, "rb"))) {
+            fclose(stream);
+            *entry_name = colon + 1;
+            return archive_name;
+        }
+        free(archive_name);
+    }
+
+    return NULL;
+}
+
+static unsigned char*
+datpath_read(
+    const char* archive_name,
+    const char* entry_name,
+    unsigned int version,
+    long* size)
+{
+    thtk_error_t* error = NULL;
+    thtk_io_t* input;
+    thtk_io_t* output = NULL;
+    thdat_t* thdat = NULL;
+    unsigned char* map = NULL;
+    uint32_t out[4];
+    unsigned int heur;
+    ssize_t entry_index;
+    off_t entry_size;
+
+    if (!(input = thtk_io_open_file(archive_name, "rb", &error)))
+        goto fail;
+
+    /* The version given for the file decides between the versions the
+     * archive could be, as -l d of thdat would report them. */
+    if (thdat_detect(archive_name, input, out, &heur, &error) == -1)
+        goto fail;
+    /* Detection leaves the errors of the formats it ruled out behind. */
+    if (error)
+        thtk_error_free(&error);
+    if (heur != (unsigned int)-1) {
+        version = heur;
+    } else {
+        const thdat_detect_entry_t* ent;
+        int found = 0;
+        while ((ent = thdat_detect_iter(out)))
+            found |= ent->alias == version;
+        if (!found) {
+            fprintf(stderr, "%s: couldn't detect the version of %s\n", argv0, archive_name);
+            goto fail;
+        }
+    }
+
+    if (!(thdat = thdat_open(version, input, &error)))
+        goto fail;
+
+    entry_index = thdat_entry_by_name(thdat, entry_name, &error);
+    if (entry_index == -1) {
+        if (error)
+            thtk_error_free(&error);
+        fprintf(stderr, "%s: %s not found in %s\n", argv0, entry_name, archive_name);
+        goto fail;
+    }
+
+    /* The size reported before reading is not final for every format; th08
+     * and th09 drop a trailing header while decoding, so the entry is read
+     * into growing memory and measured afterwards. */
+    if (!(output = thtk_io_open_growing_memory(&error)))
+        goto fail;
+    if (thdat_entry_read_data(thdat, entry_index, output, &error) == -1)
+        goto fail;
+    if ((entry_size = thtk_io_seek(output, 0, SEEK_CUR, &error)) == -1)
+        goto fail;
+    if (entry_size == 0) {
+        fprintf(stderr, "%s: %s is empty\n", argv0, entry_name);
+        goto fail;
+    }
+
+    if (!(map = file_mmap_anonymous(entry_size)))
+        goto fail;
+    if (thtk_io_seek(output, 0, SEEK_SET, &error) == -1 ||
+        thtk_io_read(output, map, entry_size, &error) != entry_size) {
+        if (!error)
+            fprintf(stderr, "%s: failed reading %s from %s\n", argv0, entry_name, archive_name);
+        file_munmap(map, entry_size);
+        goto fail;
+    }
+
+    thtk_io_close(output);
+    thdat_free(thdat);
+    thtk_io_close(input);
+    *size = entry_size;
+    return map;
+
+fail:
+    if (error) {
+        print_error(error);
+        thtk_error_free(&error);
+    }
+    if (output)
+        thtk_io_close(output);
+    if (thdat)
+        thdat_free(thdat);
+    if (input)
+        thtk_io_close(input);
+    return NULL;
+}
+
+unsigned char*
+datpath_map(
+    const char* path,
+    unsigned int version,
+    long* size)
+{
+    const char* entry_name;
+    char* archive_name = datpath_split(path, &entry_name);
+    unsigned char* map;
+
+    if (archive_name) {
+        map = datpath_read(archive_name, entry_name, version, size);
+        free(archive_name);
+        return map;
+    }
+
+    FILE* stream = fopen(path, "rb");
+    if (!stream) {
+        fprintf(stderr, "%s: couldn't open %s for reading: %s\n",
+            argv0, path, strerror(errno));
+        return NULL;
+    }
+    map = NULL;
+    if ((*size = file_fsize(stream)) != -1)
+        map = file_mmap(stream, *size);
+    fclose(stream);
+    return map;
+}
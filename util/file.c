@@ -33,12 +33,18 @@
 #include <string.h>
 #ifdef HAVE_MMAP
 #include <sys/mman.h>
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
 #endif
 #ifdef HAVE_FSTAT
 #include <sys/stat.h>
 #endif
 #ifdef _WIN32
 #include <windows.h>
+/* The plain versions use a 32-bit st_size. */
+#define stat _stat64
+#define fstat _fstat64
 #endif
 #include "file.h"
 #include "program.h"
@@ -46,11 +52,11 @@
 int
 file_seek(
     FILE* stream,
-    long offset)
+    off_t offset)
 {
-    if (fseek(stream, offset, SEEK_SET) != 0) {
-        fprintf(stderr, "%s: failed seeking to %lu: %s\n",
-            argv0, offset, strerror(errno));
+    if (fseeko(stream, offset, SEEK_SET) != 0) {
+        fprintf(stderr, "%s: failed seeking to %" PRId64 ": %s\n",
+            argv0, (int64_t)offset, strerror(errno));
         return 0;
     } else
         return 1;
@@ -60,14 +66,14 @@ int
 file_seekable(
     FILE* stream)
 {
-    return ftell(stream) != -1;
+    return ftello(stream) != -1;
 }
 
-long
+off_t
 file_tell(
     FILE* stream)
 {
-    long pos = ftell(stream);
+    off_t pos = ftello(stream);
     if (pos == -1)
         fprintf(stderr, "%s: ftell failed: %s\n", argv0, strerror(errno));
     return pos;
@@ -134,8 +140,7 @@ file_read_asciiz(
 }
 
 /* Might be better to use stat, but it's probably less cross-platform. */
-/* This will fail for 2GB+ files, but who cares. */
-long
+off_t
 file_fsize(
     FILE* stream)
 {
@@ -155,12 +160,12 @@ file_fsize(
 
     return sb.st_size;
 #else
-    long prev, end;
+    off_t prev, end;
 
     if ((prev = file_tell(stream)) == -1)
         return -1;
 
-    if (fseek(stream, 0, SEEK_END) == -1) {
+    if (fseeko(stream, 0, SEEK_END) == -1) {
         fprintf(stderr, "%s: failed seeking to end: %s\n",
             argv0, strerror(errno));
         return -1;
@@ -176,6 +181,45 @@ file_fsize(
 #endif
 }
 
+int
+file_stat(
+    const char* path,
+    uint64_t* size,
+    uint64_t* mtime)
+{
+#if defined(_WIN32)
+    WIN32_FILE_ATTRIBUTE_DATA data;
+
+    if (!GetFileAttributesExA(path, GetFileExInfoStandard, &data))
+        return 0;
+
+    *size = (uint64_t)data.nFileSizeHigh << 32 | data.nFileSizeLow;
+    /* In 100 nanosecond intervals. */
+    *mtime = (uint64_t)data.ftLastWriteTime.dwHighDateTime << 32 |
+        data.ftLastWriteTime.dwLowDateTime;
+    return 1;
+#elif defined(HAVE_FSTAT)
+    struct stat sb;
+
+    if (stat(path, &sb) == -1)
+        return 0;
+
+    *size = sb.st_size;
+    *mtime = (uint64_t)sb.st_mtime * 1000000000;
+#if defined(HAVE_STRUCT_STAT_ST_MTIM)
+    *mtime += sb.st_mtim.tv_nsec;
+#elif defined(HAVE_STRUCT_STAT_ST_MTIMESPEC)
+    *mtime += sb.st_mtimespec.tv_nsec;
+#endif
+    return 1;
+#else
+    (void)path;
+    (void)size;
+    (void)mtime;
+    return 0;
+#endif
+}
+
 void*
 file_mmap(
     FILE* stream,
@@ -224,6 +268,50 @@ file_mmap(
 #endif
 }
 
+void*
+file_mmap_anonymous(
+    size_t length)
+{
+#if defined(HAVE_MMAP)
+    void* map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "%s: mmap failed: %s\n", argv0, strerror(errno));
+        return NULL;
+    }
+    return map;
+#elif defined(_WIN32)
+    LARGE_INTEGER li;
+    li.QuadPart = length;
+    HANDLE map = CreateFileMappingW(
+        INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, li.HighPart, li.LowPart, NULL);
+    if (!map) {
+        char *buf;
+        FormatMessageA(
+            FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
+            NULL, GetLastError(), MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), (LPSTR)&buf, 0, NULL);
+        fprintf(stderr, "%s: CreateFileMappingW failed: %s\n", argv0, buf);
+        LocalFree(buf);
+        return NULL;
+    }
+    void *view = MapViewOfFile(map, FILE_MAP_WRITE, 0, 0, length);
+    if (!view) {
+        char *buf;
+        FormatMessageA(
+            FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
+            NULL, GetLastError(), MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), (LPSTR)&buf, 0, NULL);
+        fprintf(stderr, "%s: MapViewOfFile failed: %s\n", argv0, buf);
+        LocalFree(buf);
+    }
+    CloseHandle(map);
+    return view;
+#else
+    void* buffer = malloc(length);
+    if (!buffer)
+        fprintf(stderr, "%s: failed allocating %lu bytes\n", argv0, (long unsigned int)length);
+    return buffer;
+#endif
+}
+
 int
 file_munmap(
     void* map,
@@ -29,20 +29,21 @@
 #ifndef FILE_H_
 #define FILE_H_
 
+#include <inttypes.h>
 #include <stdio.h>
 #include <sys/types.h>
 
 /* A wrapper for fseek with SEEK_SET which prints an error message upon error.*/
 int file_seek(
     FILE* stream,
-    long offset);
+    off_t offset);
 
 /* Checks if a stream is seekable. */
 int file_seekable(
     FILE* stream);
 
 /* A wrapper for ftell which prints an error message upon error. */
-long file_tell(
+off_t file_tell(
     FILE* stream);
 
 /* A wrapper for fread which prints an error message upon error. */
@@ -65,13 +66,28 @@ ssize_t file_read_asciiz(
 
 /* Returns the filesize of the passed file stream, or -1 and an error message
  * upon error. */
-long file_fsize(
+off_t file_fsize(
     FILE* stream);
 
+/* Gets the size and modification time of the named file.  The time is as
+ * precise as the platform allows and only meant to be compared with other
+ * results of this function.  Returns 0 without printing anything upon
+ * error. */
+int file_stat(
+    const char* path,
+    uint64_t* size,
+    uint64_t* mtime);
+
 void* file_mmap(
     FILE* stream,
     size_t length);
 
+/* Returns writable memory that is released with file_munmap, so that data
+ * that doesn't come from a file can take the place of a mapping.  Returns
+ * NULL and prints an error message upon error. */
+void* file_mmap_anonymous(
+    size_t length);
+
 int file_munmap(
     void* map,
     size_t length);
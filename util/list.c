@@ -118,7 +118,15 @@ list_prepend_to(
 {
     list_node_t* new = list_node_new();
     new->data = data;
+    list_prepend_node_to(list, new, old);
+}
 
+void
+list_prepend_node_to(
+    list_t* list,
+    list_node_t* new,
+    list_node_t* old)
+{
     if (old->prev)
         old->prev->next = new;
     else
@@ -160,7 +168,15 @@ list_append_to(
 {
     list_node_t* new = list_node_new();
     new->data = data;
+    list_append_node_to(list, new, old);
+}
 
+void
+list_append_node_to(
+    list_t* list,
+    list_node_t* new,
+    list_node_t* old)
+{
     if (old->next)
         old->next->prev = new;
     else
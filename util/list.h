@@ -62,6 +62,8 @@ void list_prepend(list_t* list, list_node_t* node);
 void list_prepend_new(list_t* list, void* data);
 /* Inserts a new node before the specified node. */
 void list_prepend_to(list_t* list, void* data, list_node_t* node);
+/* Inserts a node before the specified node. */
+void list_prepend_node_to(list_t* list, list_node_t* node, list_node_t* old);
 /* Sets a node as the head of the list. */
 void list_append(list_t* list, list_node_t* node);
 /* Creates a new node containing the data and makes it the new head of the
@@ -69,6 +71,8 @@ void list_append(list_t* list, list_node_t* node);
 void list_append_new(list_t* list, void* data);
 /* Inserts a new node after the specified node. */
 void list_append_to(list_t* list, void* data, list_node_t* node);
+/* Inserts a node after the specified node. */
+void list_append_node_to(list_t* list, list_node_t* node, list_node_t* old);
 /* Removes and frees the node from the list.
  * Does not free the data. */
 void list_del(list_t* list, list_node_t* node);